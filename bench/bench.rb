@@ -0,0 +1,86 @@
+# Micro-benchmarks of the wrapper. Run with `rake bench`, that builds the
+# stub AAL2 library in spec/support/aal2stub.c and preloads it, so that the
+# numbers measure the wrapper and not the crypto, and do not need the real
+# library at runtime.
+#
+# For every operation in benchmarks.rb it reports the throughput, via
+# benchmark-ips, and the number of Ruby objects allocated per call. The OTP
+# calls are then run on an increasing number of threads, to show how they
+# scale.
+#
+# Environment:
+#
+#   BENCH_TIME     seconds to run each benchmark for (default 2)
+#   BENCH_THREADS  comma-separated thread counts (default 1,2,4,nprocessors)
+#
+require 'benchmark/ips'
+require_relative 'benchmarks'
+
+BENCH_TIME    = Float(ENV.fetch('BENCH_TIME', 2))
+BENCH_THREADS = ENV.fetch('BENCH_THREADS', [1, 2, 4, Etc.nprocessors].uniq.sort.join(',')).split(',').map(&:to_i)
+
+# Runs the given block on the given number of threads for BENCH_TIME
+# seconds, each thread working on its own token, and returns the total
+# number of calls per second.
+#
+def throughput(threads)
+  deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + BENCH_TIME
+
+  counts = threads.times.map do |i|
+    Thread.new do
+      count = 0
+
+      while Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+        yield i
+        count += 1
+      end
+
+      count
+    end
+  end.map(&:value)
+
+  counts.inject(:+) / BENCH_TIME
+end
+
+
+puts "VACMAN Controller #{VacmanController::Kernel.version['version']} (#{VacmanController::Kernel.version['type']})"
+puts "Ruby #{RUBY_VERSION}, #{Etc.nprocessors} CPUs"
+puts
+
+Benchmark.ips do |x|
+  x.config(time: BENCH_TIME, warmup: 1)
+
+  BENCHMARKS.each do |name, bench|
+    x.report(name, &bench)
+  end
+end
+
+puts
+puts 'Allocations per call'
+puts
+
+BENCHMARKS.each do |name, bench|
+  printf "%-32s %8.1f\n", name, allocations(&bench)
+end
+
+puts
+puts 'Scaling'
+puts
+
+# A token per thread, as tokens must not be shared across threads
+digipasses = BENCH_THREADS.max.times.map { |i| LowLevel::Digipass.from_h(TOKENS[i % TOKENS.size]) }
+passwords  = BENCH_THREADS.max.times.map { |i| OTPS[i % OTPS.size] }
+
+{
+  'generate_password' => ->(i) { LowLevel.generate_password(digipasses[i]) },
+  'verify_password'   => ->(i) { LowLevel.verify_password(digipasses[i], passwords[i]) },
+}.each do |name, bench|
+  base = nil
+
+  BENCH_THREADS.each do |threads|
+    ops  = throughput(threads, &bench)
+    base ||= ops
+
+    printf "%-20s %3d threads %12.1f i/s %6.2fx\n", name, threads, ops, ops / base
+  end
+end
@@ -0,0 +1,50 @@
+# The operations measured by bench.rb, and checked against the stored
+# allocation baselines by check.rb.
+#
+require 'etc'
+require 'vacman_controller'
+
+DPX_FILENAME  = 'sample_dpx/VDP0000000.dpx'
+TRANSPORT_KEY = '11111111111111111111111111111111'
+
+LowLevel = VacmanController::LowLevel
+
+TOKENS    = LowLevel.import(DPX_FILENAME, TRANSPORT_KEY)
+OTPS      = TOKENS.map { |token| LowLevel.generate_password(token) }
+
+hash      = TOKENS.first
+digipass  = LowLevel::Digipass.from_h(hash)
+otp       = OTPS.first
+dump      = digipass.dump
+store     = LowLevel::TokenStore.new(64).tap { |s| s.add(hash) }
+
+BENCHMARKS = {
+  'generate_password (hash)'     => -> { LowLevel.generate_password(hash) },
+  'generate_password (digipass)' => -> { LowLevel.generate_password(digipass) },
+  'verify_password (hash)'       => -> { LowLevel.verify_password(hash, otp) },
+  'verify_password (digipass)'   => -> { LowLevel.verify_password(digipass, otp) },
+  "verify_passwords (#{TOKENS.size})" => -> { LowLevel.verify_passwords(TOKENS, OTPS) },
+  'TokenStore#verify'            => -> { store.verify(hash['serial'], hash['app_name'], otp) },
+  'generate_passwords (4096)'    => -> { LowLevel.generate_passwords(digipass, Time.now.to_i, 30, 4096) },
+  'get_token_property'           => -> { LowLevel.get_token_property(digipass, :use_count) },
+  'get_token_properties'         => -> { LowLevel.get_token_properties(digipass) },
+  'generate_activation'          => -> { LowLevel.generate_activation(digipass) },
+  "generate_activations (#{TOKENS.size})" => -> { LowLevel.generate_activations(TOKENS, Etc.nprocessors) { } },
+  'import'                       => -> { LowLevel.import(DPX_FILENAME, TRANSPORT_KEY) },
+  'Digipass.from_h'              => -> { LowLevel::Digipass.from_h(hash) },
+  'Digipass#to_h'                => -> { digipass.to_h },
+  'Digipass#write_to'            => -> { digipass.write_to(hash) },
+  'Digipass#dump'                => -> { digipass.dump },
+  'Digipass.load'                => -> { LowLevel::Digipass.load(dump) },
+}
+
+# Returns the number of objects allocated by a single run of the given
+# block, averaged over the given number of runs.
+#
+def allocations(runs = 1000)
+  yield # warm up
+
+  before = GC.stat(:total_allocated_objects)
+  runs.times { yield }
+  (GC.stat(:total_allocated_objects) - before) / runs.to_f
+end
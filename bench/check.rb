@@ -0,0 +1,53 @@
+# Checks the Ruby objects allocated per call by the operations in
+# benchmarks.rb against the baselines stored in baseline.yml, and fails if
+# any of them allocates more. Run with `rake bench:check`, against the stub
+# AAL2 library as `rake bench`.
+#
+# Allocations do not depend on the machine, unlike the throughput, so they
+# can be checked on any CI runner. They do depend on the Ruby version, so
+# baselines are kept per Ruby minor version, and a version without one is
+# reported and not checked.
+#
+# Environment:
+#
+#   BENCH_TOLERANCE  objects per call allowed above the baseline (default 0.5)
+#   BENCH_UPDATE     if set, stores the measured allocations as the baseline
+#
+require 'yaml'
+require_relative 'benchmarks'
+
+BASELINE_FILE   = File.expand_path('baseline.yml', __dir__)
+BENCH_TOLERANCE = Float(ENV.fetch('BENCH_TOLERANCE', 0.5))
+
+ruby      = RUBY_VERSION[/\A\d+\.\d+/]
+baselines = File.exist?(BASELINE_FILE) ? YAML.load_file(BASELINE_FILE) : {}
+measured  = BENCHMARKS.map { |name, bench| [name, allocations(&bench).round(1)] }.to_h
+
+if ENV['BENCH_UPDATE']
+  baselines[ruby] = measured
+  File.write(BASELINE_FILE, baselines.sort.to_h.to_yaml)
+
+  puts "Stored the allocation baselines for Ruby #{ruby} in #{BASELINE_FILE}"
+  exit
+end
+
+baseline = baselines[ruby]
+
+unless baseline
+  puts "No allocation baselines for Ruby #{ruby}, run with BENCH_UPDATE=1 to store them"
+  exit
+end
+
+failures = measured.select do |name, count|
+  expected = baseline[name]
+  status   = expected.nil? ? 'new' : count > expected + BENCH_TOLERANCE ? 'FAIL' : 'ok'
+
+  printf "%-32s %8.1f %8s  %s\n", name, count, expected || '-', status
+
+  status == 'FAIL'
+end
+
+unless failures.empty?
+  abort "#{failures.size} operations allocate more than their baseline, " \
+        "by more than #{BENCH_TOLERANCE} objects per call"
+end
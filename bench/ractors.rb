@@ -0,0 +1,70 @@
+# Compares verifying OTPs on threads with verifying them on a RactorPool.
+# Run with `rake bench:ractors`, that preloads the stub AAL2 library, so
+# that the numbers measure the wrapper and the Ruby-side work, that the
+# threads run under the GVL while the Ractors run in parallel.
+#
+# Environment:
+#
+#   BENCH_TIME     seconds to run each benchmark for (default 2)
+#   BENCH_WORKERS  comma-separated worker counts (default 1,2,4,nprocessors)
+#   BENCH_BATCH    tokens verified per RactorPool#verify_all call (default 64)
+#
+require 'etc'
+require 'vacman_controller'
+
+abort 'Ractors need Ruby 3.0 or later' unless defined?(Ractor)
+
+DPX_FILENAME  = 'sample_dpx/VDP0000000.dpx'
+TRANSPORT_KEY = '11111111111111111111111111111111'
+
+BENCH_TIME    = Float(ENV.fetch('BENCH_TIME', 2))
+BENCH_WORKERS = ENV.fetch('BENCH_WORKERS', [1, 2, 4, Etc.nprocessors].uniq.sort.join(',')).split(',').map(&:to_i)
+BENCH_BATCH   = Integer(ENV.fetch('BENCH_BATCH', 64))
+
+Warning[:experimental] = false
+
+imported = VacmanController::Token.import(DPX_FILENAME, TRANSPORT_KEY)
+tokens   = BENCH_BATCH.times.map { |i| VacmanController::Token.load(imported[i % imported.size].dump) }
+otps     = tokens.map(&:generate)
+
+# Returns the number of verifications per second of the given block, that
+# verifies the given number of tokens per call.
+#
+def rate(per_call)
+  deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + BENCH_TIME
+  started  = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  calls    = 0
+
+  while Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+    yield
+    calls += 1
+  end
+
+  calls * per_call / (Process.clock_gettime(Process::CLOCK_MONOTONIC) - started)
+end
+
+
+puts "VACMAN Controller #{VacmanController::Kernel.version['version']} (#{VacmanController::Kernel.version['type']})"
+puts "Ruby #{RUBY_VERSION}, #{Etc.nprocessors} CPUs, #{BENCH_BATCH} tokens per batch"
+puts
+
+base = nil
+
+BENCH_WORKERS.each do |workers|
+  slices = tokens.each_index.group_by { |i| i % workers }.values
+
+  threads = rate(tokens.size) do
+    slices.map do |slice|
+      Thread.new { slice.each { |i| tokens[i].verify(otps[i]) } }
+    end.each(&:join)
+  end
+
+  pool    = VacmanController::RactorPool.new(workers: workers)
+  ractors = rate(tokens.size) { pool.verify_all(tokens, otps) }
+  pool.close
+
+  base ||= threads
+
+  printf "%3d workers  threads %12.1f i/s %6.2fx  ractors %12.1f i/s %6.2fx\n",
+    workers, threads, threads / base, ractors, ractors / base
+end
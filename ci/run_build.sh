@@ -19,8 +19,8 @@ chmod +x cc-test-reporter
 
 ./cc-test-reporter before-build
 
-# Run the build
-bash ./ci/exec bundle exec rake
+# Run the build, and check the allocations per call against the baselines
+bash ./ci/exec bundle exec rake default bench:check
 build_status=$?
 
 echo "Build exited with $?"
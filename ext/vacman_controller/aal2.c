@@ -0,0 +1,286 @@
+/*
+ * Vacman Controller wrapper
+ *
+ * This Ruby Extension wraps the VASCO Vacman Controller
+ * library and makes its API accessible to Ruby code.
+ *
+ * (C) 2013 https://github.com/mlankenau
+ * (C) 2019 m.barnaba@ifad.org
+ */
+#include "vacman_controller.h"
+#include <ruby/thread.h>
+
+/*
+ * The AAL2 calls that do actual crypto or file work are run through the
+ * wrappers in this file, that release the GVL for the duration of the call.
+ *
+ * The contract with the callers is that everything passed in here lives on
+ * the C stack or in frozen Ruby strings that are kept alive by the caller:
+ * no Ruby object may be touched while the GVL is not held. Marshalling from
+ * and to the token hash is therefore done by the callers, before and after
+ * calling these wrappers.
+ *
+ * There is no unblocking function, as the AAL2 calls are CPU bound and
+ * cannot be interrupted: a Thread#raise or Thread#kill is delivered when the
+ * call returns.
+ *
+ * As they only touch their arguments, the calls are safe to run on another
+ * thread: where supported, a Fiber scheduler may offload them to its own
+ * worker pool, so that they do not stall the event loop.
+ */
+static void *vacman_without_gvl(void *(*func)(void *), void *data) {
+#ifdef RB_NOGVL_OFFLOAD_SAFE
+  return rb_nogvl(func, data, NULL, NULL, RB_NOGVL_OFFLOAD_SAFE);
+#else
+  return rb_thread_call_without_gvl(func, data, NULL, NULL);
+#endif
+}
+
+
+struct verify_password_args {
+  TDigipassBlob *dpdata;
+  TKernelParms  *kernel_parms;
+  aat_ascii     *password;
+  aat_int32      result;
+};
+
+static void *verify_password_nogvl(void *ptr) {
+  struct verify_password_args *args = ptr;
+
+  args->result = vacman_window_verify(args->dpdata, args->kernel_parms,
+                                      args->password);
+
+  return NULL;
+}
+
+/*
+ * AAL2VerifyPassword without the GVL, with the adaptive window
+ */
+aat_int32 vacman_aal2_verify_password(TDigipassBlob *dpdata, TKernelParms *kernel_parms, aat_ascii *password) {
+  struct verify_password_args args = { dpdata, kernel_parms, password, 0 };
+
+  vacman_without_gvl(verify_password_nogvl, &args);
+
+  return args.result;
+}
+
+
+struct generate_password_args {
+  TDigipassBlob *dpdata;
+  TKernelParms  *kernel_parms;
+  aat_ascii     *password;
+  aat_int32      result;
+};
+
+static void *generate_password_nogvl(void *ptr) {
+  struct generate_password_args *args = ptr;
+
+  uint64_t start = vacman_stats_start();
+
+  args->result = AAL2GenPassword(args->dpdata, args->kernel_parms,
+                                 args->password, NULL);
+
+  vacman_stats_record(STAT_GEN_PASSWORD, start, args->result);
+
+  return NULL;
+}
+
+/*
+ * AAL2GenPassword without the GVL
+ */
+aat_int32 vacman_aal2_generate_password(TDigipassBlob *dpdata, TKernelParms *kernel_parms, aat_ascii *password) {
+  struct generate_password_args args = { dpdata, kernel_parms, password, 0 };
+
+  vacman_without_gvl(generate_password_nogvl, &args);
+
+  return args.result;
+}
+
+
+struct dpx_init_args {
+  TDPXHandle *dpx_handle;
+  aat_ascii  *filename;
+  aat_ascii  *key;
+  aat_int16  *appl_count;
+  aat_ascii  *appl_names;
+  aat_int16  *token_count;
+  aat_int32   result;
+};
+
+static void *dpx_init_nogvl(void *ptr) {
+  struct dpx_init_args *args = ptr;
+
+  uint64_t start = vacman_stats_start();
+
+  args->result = AAL2DPXInit(args->dpx_handle, args->filename, args->key,
+                             args->appl_count, args->appl_names,
+                             args->token_count);
+
+  vacman_stats_record(STAT_DPX_INIT, start, args->result);
+
+  return NULL;
+}
+
+/*
+ * AAL2DPXInit without the GVL, as it reads and decrypts the DPX file
+ */
+aat_int32 vacman_aal2_dpx_init(TDPXHandle *dpx_handle, aat_ascii *filename, aat_ascii *key,
+                               aat_int16 *appl_count, aat_ascii *appl_names, aat_int16 *token_count) {
+  struct dpx_init_args args = {
+    dpx_handle, filename, key, appl_count, appl_names, token_count, 0
+  };
+
+  vacman_without_gvl(dpx_init_nogvl, &args);
+
+  return args.result;
+}
+
+
+struct dpx_get_token_args {
+  TDPXHandle    *dpx_handle;
+  TKernelParms  *kernel_parms;
+  aat_ascii     *appl_names;
+  aat_ascii     *serial;
+  aat_ascii     *type;
+  aat_ascii     *authmode;
+  TDigipassBlob *dpdata;
+  aat_int32      result;
+};
+
+static void *dpx_get_token_nogvl(void *ptr) {
+  struct dpx_get_token_args *args = ptr;
+
+  uint64_t start = vacman_stats_start();
+
+  args->result = AAL2DPXGetToken(args->dpx_handle, args->kernel_parms,
+                                 args->appl_names, args->serial, args->type,
+                                 args->authmode, args->dpdata);
+
+  vacman_stats_record(STAT_DPX_GET_TOKEN, start, args->result == 107 ? 0 : args->result);
+
+  return NULL;
+}
+
+/*
+ * AAL2DPXGetToken without the GVL
+ */
+aat_int32 vacman_aal2_dpx_get_token(TDPXHandle *dpx_handle, TKernelParms *kernel_parms, aat_ascii *appl_names,
+                                    aat_ascii *serial, aat_ascii *type, aat_ascii *authmode, TDigipassBlob *dpdata) {
+  struct dpx_get_token_args args = {
+    dpx_handle, kernel_parms, appl_names, serial, type, authmode, dpdata, 0
+  };
+
+  vacman_without_gvl(dpx_get_token_nogvl, &args);
+
+  return args.result;
+}
+
+
+struct gen_activation_args {
+  TDigipassBlob **dpdata_ary;
+  aat_int32       appl_count;
+  TKernelParms   *kernel_parms;
+  aat_ascii      *static_vector;
+  aat_int32      *actv_flags;
+  aat_ascii      *serial_num;
+  aat_ascii      *actv_code;
+  aat_int32       result;
+};
+
+static void *gen_activation_nogvl(void *ptr) {
+  struct gen_activation_args *args = ptr;
+
+  uint64_t start = vacman_stats_start();
+
+  args->result = AAL2GenActivationCodeXErc(args->dpdata_ary,    /* DPData */
+                                           args->appl_count,    /* Appl_count */
+                                           args->kernel_parms,  /* CallParms */
+                                           args->static_vector, /* aStaticVectorIn DIGIPASS parameter setting */
+                                           NULL,                /* aSharedData for encryption */
+                                           NULL,                /* aAlea for encryption */
+                                           args->actv_flags,    /* ActivationFlags */
+                                           args->serial_num,    /* aSerialNumberSuffix */
+                                           args->actv_code,     /* aXFAD */
+                                           NULL);               /* aXERC */
+
+  vacman_stats_record(STAT_GEN_ACTIVATION, start, args->result);
+
+  return NULL;
+}
+
+/*
+ * AAL2GenActivationCodeXErc without the GVL
+ */
+aat_int32 vacman_aal2_gen_activation(TDigipassBlob **dpdata_ary, aat_int32 appl_count, TKernelParms *kernel_parms,
+                                     aat_ascii *static_vector, aat_int32 *actv_flags, aat_ascii *serial_num,
+                                     aat_ascii *actv_code) {
+  struct gen_activation_args args = {
+    dpdata_ary, appl_count, kernel_parms, static_vector, actv_flags,
+    serial_num, actv_code, 0
+  };
+
+  vacman_without_gvl(gen_activation_nogvl, &args);
+
+  return args.result;
+}
+
+
+struct verify_passwords_args {
+  TDigipassBlob  *dpdata;
+  TKernelParms   *kernel_parms;
+  aat_ascii     **passwords;
+  aat_int32      *results;
+  const char     *skip;
+  long            done;
+  long            count;
+  volatile int    cancelled;
+};
+
+static void *verify_passwords_nogvl(void *ptr) {
+  struct verify_passwords_args *args = ptr;
+
+  while (args->done < args->count && !args->cancelled) {
+    long i = args->done;
+
+    if (args->skip && args->skip[i]) {
+      args->done++;
+      continue;
+    }
+
+    args->results[i] = vacman_window_verify(&args->dpdata[i], args->kernel_parms,
+                                            args->passwords[i]);
+
+    args->done++;
+  }
+
+  return NULL;
+}
+
+static void verify_passwords_ubf(void *ptr) {
+  struct verify_passwords_args *args = ptr;
+
+  args->cancelled = 1;
+}
+
+/*
+ * AAL2VerifyPassword on the given arrays of tokens and passwords, from the
+ * given index, in a single GVL release. Tokens whose skip flag is set, if
+ * skip is not NULL, are left alone.
+ *
+ * As a batch may take long, it can be interrupted in between two tokens.
+ * Returns the index of the first token that was not verified, that is equal
+ * to count if the batch has been completed. Pending interrupts are not
+ * checked, so that the caller can write back the results of the tokens that
+ * were verified before checking them.
+ */
+long vacman_aal2_verify_passwords(TDigipassBlob *dpdata, TKernelParms *kernel_parms, aat_ascii **passwords,
+                                  aat_int32 *results, const char *skip, long from, long count) {
+  struct verify_passwords_args args = {
+    dpdata, kernel_parms, passwords, results, skip, from, count, 0
+  };
+
+  rb_thread_call_without_gvl2(verify_passwords_nogvl, &args,
+                              verify_passwords_ubf, &args);
+
+  return args.done;
+}
@@ -0,0 +1,472 @@
+/*
+ * Vacman Controller wrapper
+ *
+ * This Ruby Extension wraps the VASCO Vacman Controller
+ * library and makes its API accessible to Ruby code.
+ *
+ * (C) 2013 https://github.com/mlankenau
+ * (C) 2019 m.barnaba@ifad.org
+ */
+#include "vacman_controller.h"
+#include <ruby/thread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+/*
+ * VacmanController::LowLevel::AsyncQueue verifies OTPs on a set of native
+ * worker threads, and reports the completed verifications through a pipe,
+ * so that an event loop can wait for them along with its other IO, and
+ * any number of verifications can be in flight at once.
+ *
+ * #submit copies the token blob, the OTP and the kernel parameters into a
+ * job, queues it and returns its ticket straight away. The workers run the
+ * jobs without touching any Ruby object and move them to the completed
+ * list, writing a byte into the pipe when the list was empty. #reap, that
+ * is called once the pipe is readable, writes the blobs back into their
+ * tokens and returns the ticket and AAL2 result code of every job.
+ *
+ * As with verify_passwords, the same token must not be submitted again
+ * before its verification has been reaped.
+ */
+static VALUE c_AsyncQueue;
+
+struct async_job {
+  struct async_job *next;
+  long              ticket;
+  aat_int32         result;
+  TKernelParms      kernel_parms;
+  TDigipassBlob     dpdata;
+  aat_ascii         password[];
+};
+
+struct vacman_async {
+  pthread_mutex_t   lock;
+  pthread_cond_t    submitted;
+  struct async_job *pending, *pending_tail;  /* Jobs to run, in order */
+  struct async_job *done, *done_tail;        /* Jobs to reap */
+
+  pthread_t        *threads;
+  long              workers;
+  int               closed;
+  int               fds[2];     /* The completion pipe */
+
+  long              next_ticket;
+  VALUE             tokens;     /* Ticket => token, for the jobs in flight */
+};
+
+static void async_push(struct async_job **head, struct async_job **tail, struct async_job *job) {
+  job->next = NULL;
+
+  if (*tail) {
+    (*tail)->next = job;
+  } else {
+    *head = job;
+  }
+
+  *tail = job;
+}
+
+static void async_free_list(struct async_job *job) {
+  while (job) {
+    struct async_job *next = job->next;
+    free(job);
+    job = next;
+  }
+}
+
+/*
+ * Runs the jobs, until the queue is closed.
+ */
+static void *async_worker(void *ptr) {
+  struct vacman_async *async = ptr;
+
+  for (;;) {
+    pthread_mutex_lock(&async->lock);
+
+    while (async->pending == NULL && !async->closed) {
+      pthread_cond_wait(&async->submitted, &async->lock);
+    }
+
+    struct async_job *job = async->pending;
+
+    if (job == NULL) {
+      pthread_mutex_unlock(&async->lock);
+      break;
+    }
+
+    async->pending = job->next;
+    if (async->pending == NULL) async->pending_tail = NULL;
+
+    pthread_mutex_unlock(&async->lock);
+
+    uint64_t replay_key;
+
+    if (!vacman_replay_lookup(&job->dpdata, &job->kernel_parms, job->password, &replay_key, &job->result)) {
+      job->result = vacman_window_verify(&job->dpdata, &job->kernel_parms, job->password);
+      vacman_replay_store(replay_key, job->result, &job->dpdata, &job->kernel_parms);
+    }
+
+    pthread_mutex_lock(&async->lock);
+    int was_empty = async->done == NULL;
+    async_push(&async->done, &async->done_tail, job);
+    pthread_mutex_unlock(&async->lock);
+
+    /* A full pipe is readable already */
+    if (was_empty) {
+      ssize_t unused = write(async->fds[1], "", 1);
+      (void)unused;
+    }
+  }
+
+  return NULL;
+}
+
+static void *async_join_nogvl(void *ptr) {
+  struct vacman_async *async = ptr;
+
+  for (long i = 0; i < async->workers; i++) {
+    pthread_join(async->threads[i], NULL);
+  }
+
+  return NULL;
+}
+
+/*
+ * Stops the workers once they complete the verification they are running,
+ * and drops the jobs that were not reaped.
+ *
+ * The pipe is made readable, so that whoever waits on it wakes up, and it
+ * is only closed when the queue is freed: closing it now would not wake up
+ * a waiter, and its descriptor could be reused under its feet.
+ */
+static void async_close(struct vacman_async *async, int with_gvl) {
+  if (async->threads == NULL) return;
+
+  pthread_mutex_lock(&async->lock);
+  async->closed = 1;
+  pthread_cond_broadcast(&async->submitted);
+  pthread_mutex_unlock(&async->lock);
+
+  if (with_gvl) {
+    rb_thread_call_without_gvl(async_join_nogvl, async, NULL, NULL);
+  } else {
+    async_join_nogvl(async);
+  }
+
+  async_free_list(async->pending);
+  async_free_list(async->done);
+  async->pending = async->pending_tail = NULL;
+  async->done    = async->done_tail    = NULL;
+
+  ssize_t unused = write(async->fds[1], "", 1);
+  (void)unused;
+
+  pthread_cond_destroy(&async->submitted);
+  pthread_mutex_destroy(&async->lock);
+
+  xfree(async->threads);
+  async->threads = NULL;
+}
+
+static void async_mark(void *ptr) {
+  struct vacman_async *async = ptr;
+
+  rb_gc_mark(async->tokens);
+}
+
+static void async_free(void *ptr) {
+  struct vacman_async *async = ptr;
+
+  async_close(async, 0);
+
+  if (async->fds[0] >= 0) close(async->fds[0]);
+  if (async->fds[1] >= 0) close(async->fds[1]);
+
+  xfree(async);
+}
+
+static size_t async_memsize(const void *ptr) {
+  const struct vacman_async *async = ptr;
+
+  return sizeof(*async) + async->workers * sizeof(pthread_t);
+}
+
+static const rb_data_type_t vacman_async_type = {
+  "VacmanController::LowLevel::AsyncQueue",
+  { async_mark, async_free, async_memsize, },
+  0, 0,
+  0,
+};
+
+static struct vacman_async *async_get(VALUE obj) {
+  struct vacman_async *async = rb_check_typeddata(obj, &vacman_async_type);
+
+  if (async->threads == NULL) {
+    rb_raise(e_VacmanError, "async queue closed");
+  }
+
+  return async;
+}
+
+static VALUE async_alloc(VALUE klass) {
+  struct vacman_async *async;
+  VALUE obj = TypedData_Make_Struct(klass, struct vacman_async,
+                                    &vacman_async_type, async);
+
+  async->tokens = Qnil;
+  async->fds[0] = async->fds[1] = -1;
+
+  return obj;
+}
+
+/*
+ * AsyncQueue.new(workers)
+ *
+ * Starts the given number of worker threads.
+ */
+static VALUE vacman_async_initialize(VALUE self, VALUE rbworkers) {
+  struct vacman_async *async = rb_check_typeddata(self, &vacman_async_type);
+  long workers = NUM2LONG(rbworkers);
+
+  if (workers < 1) {
+    rb_raise(rb_eArgError, "invalid number of workers given: %ld", workers);
+  }
+
+  if (async->threads) {
+    rb_raise(e_VacmanError, "async queue already started");
+  }
+
+  if (pipe(async->fds) != 0) {
+    rb_sys_fail("pipe");
+  }
+
+  for (int i = 0; i < 2; i++) {
+    fcntl(async->fds[i], F_SETFL, fcntl(async->fds[i], F_GETFL) | O_NONBLOCK);
+    fcntl(async->fds[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  RB_OBJ_WRITE(self, &async->tokens, rb_hash_new());
+
+  pthread_mutex_init(&async->lock, NULL);
+  pthread_cond_init(&async->submitted, NULL);
+
+  async->threads = ALLOC_N(pthread_t, workers);
+
+  /* Signals are for Ruby to handle, so the workers block them all */
+  sigset_t all, saved;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &saved);
+
+  for (long i = 0; i < workers; i++) {
+    if (pthread_create(&async->threads[i], NULL, async_worker, async) != 0) break;
+    async->workers++;
+  }
+
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+  if (async->workers == 0) {
+    async_close(async, 1);
+    rb_raise(e_VacmanError, "cannot start worker threads");
+  }
+
+  return self;
+}
+
+/*
+ * AsyncQueue#submit(token, password, params = nil)
+ *
+ * Queues the verification of the given OTP against the given token, and
+ * returns its ticket.
+ */
+static VALUE vacman_async_submit(int argc, VALUE *argv, VALUE self) {
+  VALUE token, password, params;
+  rb_scan_args(argc, argv, "21", &token, &password, &params);
+
+  struct vacman_async *async = async_get(self);
+
+  TKernelParms kernel_parms;
+  TDigipassBlob dpdata;
+
+  /* All of these may raise: do them before allocating the job */
+  vacman_kernel_params_snapshot(params, &kernel_parms);
+  vacman_rbhash_to_digipass(token, &dpdata);
+
+  const char *passwd = StringValueCStr(password);
+  size_t passwd_size = strlen(passwd) + 1;
+
+  /* Allocated with malloc(), as jobs are also freed by the GC free function */
+  struct async_job *job = malloc(sizeof(struct async_job) + passwd_size);
+
+  if (job == NULL) {
+    rb_memerror();
+  }
+
+  job->kernel_parms = kernel_parms;
+  job->dpdata       = dpdata;
+  memcpy(job->password, passwd, passwd_size);
+
+  job->ticket = async->next_ticket++;
+  rb_hash_aset(async->tokens, LONG2NUM(job->ticket), token);
+
+  pthread_mutex_lock(&async->lock);
+  async_push(&async->pending, &async->pending_tail, job);
+  pthread_cond_signal(&async->submitted);
+  pthread_mutex_unlock(&async->lock);
+
+  return LONG2NUM(job->ticket);
+}
+
+struct async_reap_args {
+  struct vacman_async *async;
+  struct async_job    *job;    /* The jobs not reported yet */
+  VALUE                ret;
+};
+
+struct async_write_args {
+  TDigipassBlob *dpdata;
+  VALUE          token;
+};
+
+static VALUE async_write_back(VALUE ptr) {
+  struct async_write_args *args = (struct async_write_args *)ptr;
+
+  vacman_digipass_to_rbhash(args->dpdata, args->token);
+
+  return Qnil;
+}
+
+static VALUE async_reap_body(VALUE ptr) {
+  struct async_reap_args *args = (struct async_reap_args *)ptr;
+
+  while (args->job) {
+    struct async_job *job = args->job;
+    VALUE ticket = LONG2NUM(job->ticket);
+    VALUE result = INT2FIX(job->result);
+
+    struct async_write_args write = { &job->dpdata, rb_hash_delete(args->async->tokens, ticket) };
+    int state = 0;
+
+    /* A token that cannot be written back fails its own verification only */
+    rb_protect(async_write_back, (VALUE)&write, &state);
+
+    if (state) {
+      result = rb_errinfo();
+
+      if (!rb_obj_is_kind_of(result, rb_eException)) {
+        rb_jump_tag(state);
+      }
+
+      rb_set_errinfo(Qnil);
+    }
+
+    args->job = job->next;
+    free(job);
+
+    rb_ary_push(args->ret, rb_assoc_new(ticket, result));
+  }
+
+  return args->ret;
+}
+
+/* Frees the jobs left behind by a non-local exit */
+static VALUE async_reap_ensure(VALUE ptr) {
+  struct async_reap_args *args = (struct async_reap_args *)ptr;
+
+  while (args->job) {
+    struct async_job *next = args->job->next;
+    free(args->job);
+    args->job = next;
+  }
+
+  return Qnil;
+}
+
+/*
+ * AsyncQueue#reap
+ *
+ * Writes back the tokens of the completed verifications, and returns an
+ * Array with the ticket and the AAL2 result code of each one, or the
+ * exception raised writing back its token. Call it when #fileno is
+ * readable: it does not wait.
+ */
+static VALUE vacman_async_reap(VALUE self) {
+  struct vacman_async *async = async_get(self);
+  char buf[64];
+
+  /* Allocated first, so that nothing raises once the list is taken */
+  struct async_reap_args args = { async, NULL, rb_ary_new() };
+
+  /* Drain the pipe before taking the list, so that no wake-up is lost */
+  while (read(async->fds[0], buf, sizeof(buf)) > 0);
+
+  pthread_mutex_lock(&async->lock);
+  args.job = async->done;
+  async->done = async->done_tail = NULL;
+  pthread_mutex_unlock(&async->lock);
+
+  return rb_ensure(async_reap_body, (VALUE)&args, async_reap_ensure, (VALUE)&args);
+}
+
+/*
+ * AsyncQueue#fileno
+ *
+ * The file descriptor that becomes readable when verifications complete.
+ */
+static VALUE vacman_async_fileno(VALUE self) {
+  return INT2FIX(async_get(self)->fds[0]);
+}
+
+/*
+ * AsyncQueue#size
+ *
+ * The number of verifications submitted and not yet reaped.
+ */
+static VALUE vacman_async_size(VALUE self) {
+  return LONG2NUM(RHASH_SIZE(async_get(self)->tokens));
+}
+
+/*
+ * AsyncQueue#close
+ *
+ * Stops the workers, waiting for the verifications they are running, and
+ * drops the ones that were not reaped: their tokens are left untouched.
+ */
+static VALUE vacman_async_close(VALUE self) {
+  struct vacman_async *async = rb_check_typeddata(self, &vacman_async_type);
+
+  async_close(async, 1);
+
+  if (!NIL_P(async->tokens)) {
+    RB_OBJ_WRITE(self, &async->tokens, rb_hash_new());
+  }
+
+  return Qnil;
+}
+
+/*
+ * AsyncQueue#closed?
+ */
+static VALUE vacman_async_closed_p(VALUE self) {
+  struct vacman_async *async = rb_check_typeddata(self, &vacman_async_type);
+
+  return async->threads ? Qfalse : Qtrue;
+}
+
+
+/*
+ * Define the AsyncQueue class
+ */
+void vacman_async_init(VALUE lowlevel) {
+  c_AsyncQueue = rb_define_class_under(lowlevel, "AsyncQueue", rb_cObject);
+  rb_define_alloc_func(c_AsyncQueue, async_alloc);
+
+  rb_define_method(c_AsyncQueue, "initialize", vacman_async_initialize, 1);
+  rb_define_method(c_AsyncQueue, "submit",     vacman_async_submit, -1);
+  rb_define_method(c_AsyncQueue, "reap",       vacman_async_reap, 0);
+  rb_define_method(c_AsyncQueue, "fileno",     vacman_async_fileno, 0);
+  rb_define_method(c_AsyncQueue, "size",       vacman_async_size, 0);
+  rb_define_method(c_AsyncQueue, "close",      vacman_async_close, 0);
+  rb_define_method(c_AsyncQueue, "closed?",    vacman_async_closed_p, 0);
+}
@@ -0,0 +1,300 @@
+/*
+ * Vacman Controller wrapper
+ *
+ * This Ruby Extension wraps the VASCO Vacman Controller
+ * library and makes its API accessible to Ruby code.
+ *
+ * (C) 2013 https://github.com/mlankenau
+ * (C) 2019 m.barnaba@ifad.org
+ */
+#include "vacman_controller.h"
+#include <sched.h>
+#include <time.h>
+
+/*
+ * Audit stream of the verification outcomes.
+ *
+ * Every verification, whether run by AAL2 or answered by the replay cache,
+ * pushes a fixed-size record with the token serial number and application
+ * name, the result code, and the last_time_shift and error_count of the
+ * token afterwards, into a bounded ring buffer. The records are taken out
+ * in batches by LowLevel.audit_drain, as a String that is the records
+ * back to back, ready to be appended to a file or to be unpacked.
+ *
+ * Verifications run on any thread, with or without the GVL, so the ring is
+ * a lock-free multiple producers queue: a producer claims a slot moving the
+ * tail with a CAS, fills it, and publishes it bumping the slot sequence.
+ * A verification never waits: when the ring is full the record is dropped,
+ * and counted. Drains take a mutex, that is never taken by producers.
+ *
+ * The ring is resized or freed only once no producer is running, tracked
+ * by the audit_writers counter.
+ *
+ * It is disabled by default, and enabled via configure_audit.
+ */
+#define AUDIT_UNKNOWN INT32_MIN   /* Token property that is not available */
+
+struct audit_record {
+  int64_t  time;                  /* CLOCK_REALTIME nanoseconds */
+  int32_t  result;                /* AAL2 result code, 0 meaning success */
+  int32_t  last_time_shift;       /* Or AUDIT_UNKNOWN */
+  int32_t  error_count;           /* Or AUDIT_UNKNOWN */
+  char     serial[10];
+  char     app_name[12];
+  char     reserved[6];
+};
+
+typedef char audit_record_size_check[sizeof(struct audit_record) == 48 ? 1 : -1];
+typedef char audit_serial_size_check[VACMAN_SERIAL_SIZE == 10 && VACMAN_APP_NAME_SIZE == 12 ? 1 : -1];
+
+struct audit_slot {
+  uint64_t            sequence;   /* The position the slot is free or full for */
+  struct audit_record record;
+} __attribute__((aligned(64)));
+
+struct audit_ring {
+  uint64_t tail __attribute__((aligned(64)));   /* Next position to claim */
+  uint64_t head __attribute__((aligned(64)));   /* Next position to drain */
+  uint64_t mask;
+  struct audit_slot slots[];
+};
+
+static struct audit_ring *audit_ring;
+static uint64_t audit_writers;                  /* Producers running */
+static pthread_mutex_t audit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+  uint64_t pushed;
+  uint64_t dropped;
+} audit_stats __attribute__((aligned(64)));
+
+/*
+ * Reads the given integer token property, or returns AUDIT_UNKNOWN
+ */
+static int32_t audit_property(TDigipassBlob *dpdata, TKernelParms *kernel_parms, aat_int32 property) {
+  aat_ascii value[64];
+  char *end;
+
+  uint64_t start = vacman_stats_start();
+  aat_int32 result = AAL2GetTokenProperty(dpdata, kernel_parms, property, value);
+  vacman_stats_record(STAT_GET_TOKEN_PROPERTY, start, result);
+
+  if (result != 0) {
+    return AUDIT_UNKNOWN;
+  }
+
+  long number = strtol(value, &end, 10);
+
+  /* "NA" or "DISABLE" when the token was never verified */
+  return end != value && *end == '\0' ? (int32_t)number : AUDIT_UNKNOWN;
+}
+
+/*
+ * Pushes the outcome of a verification of the given token. Does not use
+ * any Ruby API, nor ever waits.
+ */
+void vacman_audit_verify(TDigipassBlob *dpdata, TKernelParms *kernel_parms, aat_int32 result) {
+  if (__atomic_load_n(&audit_ring, __ATOMIC_RELAXED) == NULL) {
+    return;
+  }
+
+  struct audit_record record;
+  struct timespec ts;
+
+  memset(&record, 0, sizeof(record));
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  record.time            = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  record.result          = result;
+  record.last_time_shift = audit_property(dpdata, kernel_parms, LAST_TIME_SHIFT);
+  record.error_count     = audit_property(dpdata, kernel_parms, ERROR_COUNT);
+  memcpy(record.serial,   dpdata->Serial,  sizeof(record.serial));
+  memcpy(record.app_name, dpdata->AppName, sizeof(record.app_name));
+
+  __atomic_fetch_add(&audit_writers, 1, __ATOMIC_SEQ_CST);
+
+  struct audit_ring *ring = __atomic_load_n(&audit_ring, __ATOMIC_SEQ_CST);
+
+  if (ring) {
+    uint64_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    struct audit_slot *slot;
+
+    for (;;) {
+      slot = &ring->slots[pos & ring->mask];
+
+      int64_t diff = (int64_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - pos);
+
+      if (diff == 0) {
+        if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+          break;
+        }
+      } else if (diff < 0) {
+        slot = NULL; /* Full */
+        break;
+      } else {
+        pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+      }
+    }
+
+    if (slot) {
+      slot->record = record;
+      __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+      __atomic_fetch_add(&audit_stats.pushed, 1, __ATOMIC_RELAXED);
+    } else {
+      __atomic_fetch_add(&audit_stats.dropped, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  __atomic_fetch_sub(&audit_writers, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Detaches the ring, and waits for the producers still writing to it
+ */
+static struct audit_ring *audit_detach(void) {
+  struct audit_ring *ring = __atomic_exchange_n(&audit_ring, NULL, __ATOMIC_SEQ_CST);
+
+  while (__atomic_load_n(&audit_writers, __ATOMIC_ACQUIRE) > 0) {
+    sched_yield();
+  }
+
+  return ring;
+}
+
+
+/*
+ * LowLevel.configure_audit(capacity)
+ *
+ * Sizes the ring to hold capacity records, rounded up to a power of two,
+ * 0 disabling the audit. Records not drained yet are lost.
+ */
+static VALUE vacman_audit_configure(VALUE module, VALUE rbcapacity) {
+  long capacity = NUM2LONG(rbcapacity);
+
+  if (capacity < 0 || capacity > (1L << 24)) {
+    rb_raise(rb_eArgError, "invalid audit capacity given: %ld", capacity);
+  }
+
+  struct audit_ring *ring = NULL;
+
+  if (capacity > 0) {
+    uint64_t size = 1;
+    while (size < (uint64_t)capacity) size <<= 1;
+
+    if (posix_memalign((void **)&ring, 64, sizeof(*ring) + size * sizeof(struct audit_slot)) != 0) {
+      rb_memerror();
+    }
+
+    memset(ring, 0, sizeof(*ring));
+    ring->mask = size - 1;
+
+    for (uint64_t i = 0; i < size; i++) {
+      ring->slots[i].sequence = i;
+    }
+  }
+
+  pthread_mutex_lock(&audit_lock);
+
+  free(audit_detach());
+
+  __atomic_store_n(&audit_stats.pushed,  0, __ATOMIC_RELAXED);
+  __atomic_store_n(&audit_stats.dropped, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&audit_ring, ring, __ATOMIC_SEQ_CST);
+
+  pthread_mutex_unlock(&audit_lock);
+
+  return Qnil;
+}
+
+/*
+ * LowLevel.audit_drain(max)
+ *
+ * Takes at most max records out of the ring, and returns them as a binary
+ * String, that is empty if there are none.
+ *
+ * Records are 48 bytes each, in the native byte order: the time in
+ * nanoseconds since the epoch as a 64 bit integer, the result code, the
+ * last_time_shift and the error_count as 32 bit integers, the latter two
+ * being -2**31 when not known, the serial number in 10 bytes and the
+ * application name in 12, NUL padded, and 6 reserved bytes.
+ */
+static VALUE vacman_audit_drain(VALUE module, VALUE rbmax) {
+  long max = NUM2LONG(rbmax);
+
+  if (max <= 0 || max > (1L << 24)) {
+    rb_raise(rb_eArgError, "invalid number of records given: %ld", max);
+  }
+
+  /* Allocated before taking the lock, that the GC must never wait for */
+  VALUE ret = rb_str_buf_new(max * sizeof(struct audit_record));
+  struct audit_record *out = (struct audit_record *)RSTRING_PTR(ret);
+  long count = 0;
+
+  pthread_mutex_lock(&audit_lock);
+
+  struct audit_ring *ring = audit_ring;
+
+  if (ring) {
+    uint64_t pos = ring->head;
+
+    for (; count < max; count++, pos++) {
+      struct audit_slot *slot = &ring->slots[pos & ring->mask];
+
+      /* Stops at a slot claimed but not filled yet, or at the tail */
+      if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + 1) {
+        break;
+      }
+
+      out[count] = slot->record;
+      __atomic_store_n(&slot->sequence, pos + ring->mask + 1, __ATOMIC_RELEASE);
+    }
+
+    ring->head = pos;
+  }
+
+  pthread_mutex_unlock(&audit_lock);
+
+  rb_str_set_len(ret, count * sizeof(struct audit_record));
+
+  return ret;
+}
+
+/*
+ * LowLevel.audit_stats
+ *
+ * Returns the ring capacity, and the number of records pushed, dropped
+ * because the ring was full, and waiting to be drained.
+ */
+static VALUE vacman_audit_stats(VALUE module) {
+  uint64_t capacity = 0, pending = 0;
+
+  pthread_mutex_lock(&audit_lock);
+
+  if (audit_ring) {
+    capacity = audit_ring->mask + 1;
+    pending  = __atomic_load_n(&audit_ring->tail, __ATOMIC_RELAXED) - audit_ring->head;
+  }
+
+  pthread_mutex_unlock(&audit_lock);
+
+  VALUE ret = rb_hash_new();
+
+  rb_hash_aset(ret, rb_str_new2("capacity"), ULL2NUM(capacity));
+  rb_hash_aset(ret, rb_str_new2("pushed"),   ULL2NUM(__atomic_load_n(&audit_stats.pushed, __ATOMIC_RELAXED)));
+  rb_hash_aset(ret, rb_str_new2("dropped"),  ULL2NUM(__atomic_load_n(&audit_stats.dropped, __ATOMIC_RELAXED)));
+  rb_hash_aset(ret, rb_str_new2("pending"),  ULL2NUM(pending));
+
+  return ret;
+}
+
+
+/*
+ * Define the audit methods
+ */
+void vacman_audit_init(VALUE lowlevel) {
+  rb_define_const(lowlevel, "AUDIT_RECORD_SIZE", INT2FIX(sizeof(struct audit_record)));
+
+  rb_define_singleton_method(lowlevel, "configure_audit", vacman_audit_configure, 1);
+  rb_define_singleton_method(lowlevel, "audit_drain",     vacman_audit_drain, 1);
+  rb_define_singleton_method(lowlevel, "audit_stats",     vacman_audit_stats, 0);
+}
@@ -0,0 +1,415 @@
+/*
+ * Vacman Controller wrapper
+ *
+ * This Ruby Extension wraps the VASCO Vacman Controller
+ * library and makes its API accessible to Ruby code.
+ *
+ * (C) 2013 https://github.com/mlankenau
+ * (C) 2019 m.barnaba@ifad.org
+ */
+#include "vacman_controller.h"
+
+/*
+ * VacmanController::LowLevel::Digipass holds a TDigipassBlob and the token
+ * static vector natively, and it can be passed to all the low-level calls
+ * in place of a token hash.
+ *
+ * The blob is copied from and to the object with a memcpy(), so that calls
+ * do not allocate nor look up any string. The Hash representation is only
+ * built when asked for, via #to_h or #write_to, for persistence purposes.
+ *
+ * Calls that change the blob flag the Digipass as dirty, so that it needs
+ * to be persisted only when #dirty? is true.
+ */
+static VALUE c_Digipass;
+
+static void digipass_mark(void *ptr) {
+  struct vacman_digipass *digipass = ptr;
+
+  rb_gc_mark(digipass->sv);
+}
+
+static size_t digipass_memsize(const void *ptr) {
+  return sizeof(struct vacman_digipass);
+}
+
+static const rb_data_type_t vacman_digipass_type = {
+  "VacmanController::LowLevel::Digipass",
+  { digipass_mark, RUBY_TYPED_DEFAULT_FREE, digipass_memsize, },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED,
+};
+
+/*
+ * Returns the Digipass structure wrapped by the given object, or NULL if
+ * the object is not a Digipass.
+ */
+struct vacman_digipass *vacman_digipass_get(VALUE obj) {
+  if (!rb_typeddata_is_kind_of(obj, &vacman_digipass_type)) {
+    return NULL;
+  }
+
+  return RTYPEDDATA_DATA(obj);
+}
+
+static struct vacman_digipass *digipass_get(VALUE obj) {
+  return rb_check_typeddata(obj, &vacman_digipass_type);
+}
+
+static VALUE digipass_alloc(VALUE klass) {
+  struct vacman_digipass *digipass;
+  VALUE obj = TypedData_Make_Struct(klass, struct vacman_digipass,
+                                    &vacman_digipass_type, digipass);
+
+  digipass->sv = Qnil;
+
+  return obj;
+}
+
+/*
+ * Builds a clean Digipass from the given blob and interned static vector.
+ */
+VALUE vacman_digipass_new(const TDigipassBlob *dpdata, VALUE sv) {
+  VALUE obj = digipass_alloc(c_Digipass);
+  struct vacman_digipass *digipass = RTYPEDDATA_DATA(obj);
+
+  memcpy(&digipass->dpdata, dpdata, sizeof(*dpdata));
+  RB_OBJ_WRITE(obj, &digipass->sv, sv);
+
+  return obj;
+}
+
+/*
+ * Digipass.from_h(hash)
+ *
+ * Builds a Digipass from a token hash, as returned by LowLevel.import.
+ */
+static VALUE vacman_digipass_s_from_h(VALUE klass, VALUE hash) {
+  Check_Type(hash, T_HASH);
+
+  VALUE obj = digipass_alloc(klass);
+  struct vacman_digipass *digipass = RTYPEDDATA_DATA(obj);
+
+  vacman_rbhash_to_digipass(hash, &digipass->dpdata);
+
+  VALUE sv = vacman_rbhash_get_sv(hash);
+
+  if (RB_TYPE_P(sv, T_STRING)) {
+    RB_OBJ_WRITE(obj, &digipass->sv, vacman_sv_intern(sv));
+  }
+
+  return obj;
+}
+
+/*
+ * Digipass#initialize_copy
+ */
+static VALUE vacman_digipass_init_copy(VALUE self, VALUE orig) {
+  struct vacman_digipass *digipass = digipass_get(self);
+  struct vacman_digipass *source   = digipass_get(orig);
+
+  memcpy(&digipass->dpdata, &source->dpdata, sizeof(digipass->dpdata));
+  RB_OBJ_WRITE(self, &digipass->sv, source->sv);
+  digipass->dirty = source->dirty;
+
+  return self;
+}
+
+/*
+ * Digipass#write_to(hash)
+ *
+ * Writes the token state into the given hash, and returns it.
+ */
+static VALUE vacman_digipass_write_to(VALUE self, VALUE hash) {
+  struct vacman_digipass *digipass = digipass_get(self);
+
+  Check_Type(hash, T_HASH);
+
+  vacman_digipass_to_rbhash(&digipass->dpdata, hash);
+
+  if (!NIL_P(digipass->sv)) {
+    vacman_rbhash_set_sv(hash, digipass->sv);
+  }
+
+  return hash;
+}
+
+/*
+ * Digipass#to_h
+ *
+ * Returns a new token hash, suitable for persistence.
+ */
+static VALUE vacman_digipass_to_h(VALUE self) {
+  return vacman_digipass_write_to(self, rb_hash_new());
+}
+
+/*
+ * Binary dump format, version 1. All integers are little endian.
+ *
+ *   0    4  Magic, "VCDP"
+ *   4    1  Version
+ *   5    1  Static vector kind: DUMP_SV_NONE, DUMP_SV_INLINE or DUMP_SV_DIGEST
+ *   6    2  Reserved, zero
+ *   8  248  The TDigipassBlob, byte for byte
+ * 256    4  Static vector length, if inline
+ * 260    n  Static vector, if inline
+ * 256    8  Static vector digest, if a reference to the registry (sv.c)
+ *
+ * The TDigipassBlob is made of byte arrays only, so its layout does not
+ * depend on the platform, and loading it is a single memcpy().
+ */
+#define DUMP_MAGIC        "VCDP"
+#define DUMP_VERSION      1
+#define DUMP_HEADER_SIZE  8
+#define DUMP_BLOB_SIZE    248
+#define DUMP_SV_NONE      0
+#define DUMP_SV_INLINE    1
+#define DUMP_SV_DIGEST    2
+
+typedef char dump_blob_size_check[sizeof(TDigipassBlob) == DUMP_BLOB_SIZE ? 1 : -1];
+
+static void dump_put_uint32(unsigned char *buf, uint32_t val) {
+  buf[0] = val;
+  buf[1] = val >> 8;
+  buf[2] = val >> 16;
+  buf[3] = val >> 24;
+}
+
+static uint32_t dump_get_uint32(const unsigned char *buf) {
+  return (uint32_t)buf[0] | (uint32_t)buf[1] << 8 |
+         (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24;
+}
+
+static void dump_put_uint64(unsigned char *buf, uint64_t val) {
+  dump_put_uint32(buf, (uint32_t)val);
+  dump_put_uint32(buf + 4, (uint32_t)(val >> 32));
+}
+
+static uint64_t dump_get_uint64(const unsigned char *buf) {
+  return (uint64_t)dump_get_uint32(buf) | (uint64_t)dump_get_uint32(buf + 4) << 32;
+}
+
+/*
+ * Digipass#dump(sv_digest = false)
+ *
+ * Returns the token state and static vector in the binary dump format, as
+ * a binary String suitable for persistence.
+ *
+ * If sv_digest is true, the static vector is referenced by its digest, so
+ * it must be registered before loading the dump back.
+ */
+static VALUE vacman_digipass_dump(int argc, VALUE *argv, VALUE self) {
+  VALUE sv_digest;
+  rb_scan_args(argc, argv, "01", &sv_digest);
+
+  struct vacman_digipass *digipass = digipass_get(self);
+  VALUE sv = digipass->sv;
+  int kind = NIL_P(sv) ? DUMP_SV_NONE : RTEST(sv_digest) ? DUMP_SV_DIGEST : DUMP_SV_INLINE;
+
+  long size = DUMP_HEADER_SIZE + DUMP_BLOB_SIZE;
+  if (kind == DUMP_SV_INLINE) size += 4 + RSTRING_LEN(sv);
+  if (kind == DUMP_SV_DIGEST) size += 8;
+
+  VALUE ret = rb_str_new(NULL, size);
+  unsigned char *buf = (unsigned char *)RSTRING_PTR(ret);
+
+  memcpy(buf, DUMP_MAGIC, 4);
+  buf[4] = DUMP_VERSION;
+  buf[5] = kind;
+  buf[6] = buf[7] = 0;
+
+  memcpy(buf + DUMP_HEADER_SIZE, &digipass->dpdata, DUMP_BLOB_SIZE);
+  buf += DUMP_HEADER_SIZE + DUMP_BLOB_SIZE;
+
+  if (kind == DUMP_SV_INLINE) {
+    dump_put_uint32(buf, RSTRING_LEN(sv));
+    memcpy(buf + 4, RSTRING_PTR(sv), RSTRING_LEN(sv));
+  } else if (kind == DUMP_SV_DIGEST) {
+    dump_put_uint64(buf, vacman_sv_digest(RSTRING_PTR(sv), RSTRING_LEN(sv)));
+  }
+
+  return ret;
+}
+
+/*
+ * Parses the given String returned by Digipass#dump into the given blob,
+ * and returns the static vector.
+ */
+static VALUE digipass_load(VALUE data, TDigipassBlob *dpdata) {
+  StringValue(data);
+
+  const unsigned char *buf = (const unsigned char *)RSTRING_PTR(data);
+  long len = RSTRING_LEN(data);
+
+  if (len < DUMP_HEADER_SIZE + DUMP_BLOB_SIZE || memcmp(buf, DUMP_MAGIC, 4) != 0) {
+    rb_raise(e_VacmanError, "invalid token dump given");
+  }
+
+  if (buf[4] != DUMP_VERSION) {
+    rb_raise(e_VacmanError, "unsupported token dump version %d", buf[4]);
+  }
+
+  VALUE sv = Qnil;
+  const unsigned char *rest = buf + DUMP_HEADER_SIZE + DUMP_BLOB_SIZE;
+  long rest_len = len - DUMP_HEADER_SIZE - DUMP_BLOB_SIZE;
+
+  switch (buf[5]) {
+    case DUMP_SV_NONE:
+      if (rest_len != 0) {
+        rb_raise(e_VacmanError, "invalid token dump given: trailing data");
+      }
+      break;
+
+    case DUMP_SV_INLINE:
+      if (rest_len < 4 || dump_get_uint32(rest) != (uint32_t)(rest_len - 4)) {
+        rb_raise(e_VacmanError, "invalid token dump given: truncated static vector");
+      }
+      sv = vacman_sv_intern(rb_str_new((const char *)rest + 4, rest_len - 4));
+      break;
+
+    case DUMP_SV_DIGEST:
+      if (rest_len != 8) {
+        rb_raise(e_VacmanError, "invalid token dump given: truncated static vector digest");
+      }
+
+      sv = vacman_sv_lookup(dump_get_uint64(rest));
+
+      if (NIL_P(sv)) {
+        rb_raise(e_VacmanError, "unknown static vector %"PRIsVALUE", register it first",
+                 vacman_sv_digest_hex(dump_get_uint64(rest)));
+      }
+      break;
+
+    default:
+      rb_raise(e_VacmanError, "invalid token dump given: unknown static vector kind %d", buf[5]);
+  }
+
+  memcpy(dpdata, buf + DUMP_HEADER_SIZE, DUMP_BLOB_SIZE);
+
+  RB_GC_GUARD(data);
+
+  return sv;
+}
+
+/*
+ * Digipass.load(data)
+ *
+ * Builds a Digipass from a String returned by Digipass#dump.
+ */
+static VALUE vacman_digipass_s_load(VALUE klass, VALUE data) {
+  TDigipassBlob dpdata;
+  VALUE sv = digipass_load(data, &dpdata);
+
+  VALUE obj = digipass_alloc(klass);
+  struct vacman_digipass *digipass = RTYPEDDATA_DATA(obj);
+
+  memcpy(&digipass->dpdata, &dpdata, sizeof(dpdata));
+  RB_OBJ_WRITE(obj, &digipass->sv, sv);
+
+  return obj;
+}
+
+/*
+ * Digipass#restore(data)
+ *
+ * Replaces the token state with the one in the given String returned by
+ * Digipass#dump, for instance by another Ractor, flagging the Digipass as
+ * dirty if it changed.
+ */
+static VALUE vacman_digipass_restore(VALUE self, VALUE data) {
+  struct vacman_digipass *digipass = digipass_get(self);
+
+  TDigipassBlob dpdata;
+  VALUE sv = digipass_load(data, &dpdata);
+
+  vacman_digipass_to_rbhash(&dpdata, self);
+  RB_OBJ_WRITE(self, &digipass->sv, sv);
+
+  return self;
+}
+
+/*
+ * Digipass#dirty?
+ *
+ * Returns whether the token state has been changed by a low-level call
+ * since the Digipass was built, or since clean! was last called.
+ */
+static VALUE vacman_digipass_dirty_p(VALUE self) {
+  return digipass_get(self)->dirty ? Qtrue : Qfalse;
+}
+
+/*
+ * Digipass#clean!
+ *
+ * Clears the dirty flag, once the token state has been persisted.
+ */
+static VALUE vacman_digipass_clean(VALUE self) {
+  digipass_get(self)->dirty = 0;
+
+  return self;
+}
+
+/*
+ * Digipass#serial
+ */
+static VALUE vacman_digipass_serial(VALUE self) {
+  struct vacman_digipass *digipass = digipass_get(self);
+
+  return rb_str_new(digipass->dpdata.Serial,
+                    strnlen(digipass->dpdata.Serial, sizeof(digipass->dpdata.Serial)));
+}
+
+/*
+ * Digipass#app_name
+ */
+static VALUE vacman_digipass_app_name(VALUE self) {
+  struct vacman_digipass *digipass = digipass_get(self);
+
+  return rb_str_new(digipass->dpdata.AppName,
+                    strnlen(digipass->dpdata.AppName, sizeof(digipass->dpdata.AppName)));
+}
+
+/*
+ * Digipass#static_vector
+ */
+static VALUE vacman_digipass_static_vector(VALUE self) {
+  return digipass_get(self)->sv;
+}
+
+/*
+ * Digipass#static_vector_digest
+ */
+static VALUE vacman_digipass_static_vector_digest(VALUE self) {
+  VALUE sv = digipass_get(self)->sv;
+
+  if (NIL_P(sv)) {
+    return Qnil;
+  }
+
+  return vacman_sv_digest_hex(vacman_sv_digest(RSTRING_PTR(sv), RSTRING_LEN(sv)));
+}
+
+
+/*
+ * Define the Digipass class
+ */
+void vacman_digipass_init(VALUE lowlevel) {
+  c_Digipass = rb_define_class_under(lowlevel, "Digipass", rb_cObject);
+  rb_define_alloc_func(c_Digipass, digipass_alloc);
+  rb_undef_method(CLASS_OF(c_Digipass), "new");
+
+  rb_define_singleton_method(c_Digipass, "from_h", vacman_digipass_s_from_h, 1);
+  rb_define_singleton_method(c_Digipass, "load",   vacman_digipass_s_load, 1);
+
+  rb_define_method(c_Digipass, "initialize_copy", vacman_digipass_init_copy, 1);
+  rb_define_method(c_Digipass, "write_to",        vacman_digipass_write_to, 1);
+  rb_define_method(c_Digipass, "to_h",            vacman_digipass_to_h, 0);
+  rb_define_method(c_Digipass, "dump",            vacman_digipass_dump, -1);
+  rb_define_method(c_Digipass, "restore",         vacman_digipass_restore, 1);
+  rb_define_method(c_Digipass, "dirty?",          vacman_digipass_dirty_p, 0);
+  rb_define_method(c_Digipass, "clean!",          vacman_digipass_clean, 0);
+  rb_define_method(c_Digipass, "serial",          vacman_digipass_serial, 0);
+  rb_define_method(c_Digipass, "app_name",        vacman_digipass_app_name, 0);
+  rb_define_method(c_Digipass, "static_vector",   vacman_digipass_static_vector, 0);
+  rb_define_method(c_Digipass, "static_vector_digest", vacman_digipass_static_vector_digest, 0);
+}
@@ -8,90 +8,538 @@
  * (C) 2019 m.barnaba@ifad.org
  */
 #include "vacman_controller.h"
+#include <ruby/util.h>
 
 /*
- * Imports a .DPX file containing token seeds and initialisation values.
- *
- * Pass the pre-shared key to validate it as the second argument. The
- * key is not validated by the AAL2 library, if you pass a different
- * key than the one that was used to create the DPX, you will get back
- * tokens that generate different OTPs.
- *
+ * State of a DPX import in progress
  */
-VALUE vacman_dpx_import(VALUE module, VALUE filename, VALUE key) {
-  TDPXHandle dpx_handle;
-  aat_int16  appl_count;
-  aat_ascii  appl_names[13*8];
-  aat_int16  token_count;
+struct dpx_import {
+  TDPXHandle   dpx_handle;
+  TKernelParms kernel_parms;
+  aat_ascii    appl_names[13*8];
+  VALUE        sv;    /* The static vector, shared by all the tokens */
+  long         chunk; /* How many tokens to yield at once, or 0 */
+};
 
-  aat_int32 result = AAL2DPXInit(&dpx_handle,
-                                 rb_string_value_cstr(&filename),
-                                 rb_string_value_cstr(&key),
-                                 &appl_count,
-                                 appl_names,
-                                 &token_count);
+/*
+ * Opens the given DPX file and reads its static vector, that is kept as a
+ * single frozen String shared across all the imported tokens.
+ */
+static void dpx_import_open(struct dpx_import *import, VALUE filename, VALUE key, VALUE params) {
+  aat_int16 appl_count;
+  aat_int16 token_count;
+
+  vacman_kernel_params_snapshot(params, &import->kernel_parms);
+
+  /* Read by AAL2 without the GVL, so they must not change under our feet */
+  filename = rb_str_new_frozen(StringValue(filename));
+  key      = rb_str_new_frozen(StringValue(key));
+
+  aat_int32 result = vacman_aal2_dpx_init(&import->dpx_handle,
+                                          rb_string_value_cstr(&filename),
+                                          rb_string_value_cstr(&key),
+                                          &appl_count,
+                                          import->appl_names,
+                                          &token_count);
+
+  RB_GC_GUARD(filename);
+  RB_GC_GUARD(key);
 
   /* Open the DPX */
   if (result != 0) {
     vacman_library_error("AAL2DPXInit", result);
-    return Qnil;
+    return;
   }
 
   /* Get static vector for token activation code generation */
   aat_ascii sw_out_static_vector[4094+1];
   aat_int32 sw_out_static_vector_len = sizeof(sw_out_static_vector);
-  result = AAL2DPXGetStaticVector(&dpx_handle,
-                                  &g_KernelParms,
+  uint64_t start = vacman_stats_start();
+  result = AAL2DPXGetStaticVector(&import->dpx_handle,
+                                  &import->kernel_parms,
                                   sw_out_static_vector,
                                   &sw_out_static_vector_len);
+  vacman_stats_record(STAT_DPX_GET_STATIC_VECTOR, start, result);
 
   /* If no static vector is present, clear the buffer */
   if (result != 0) {
     memset(sw_out_static_vector, 0, sizeof(sw_out_static_vector));
   }
 
-  /* Get the tokens */
+  import->sv = vacman_sv_intern(rb_str_new2(sw_out_static_vector));
+}
+
+/*
+ * Reads the next token from the DPX and returns it as an hash, or returns
+ * nil when there are no more tokens.
+ */
+static VALUE dpx_import_next(struct dpx_import *import) {
   aat_ascii sw_out_serial_No[22+1];
   aat_ascii sw_out_type[5+1];
   aat_ascii sw_out_authmode[2+1];
   TDigipassBlob dpdata;
 
+  aat_int32 result = vacman_aal2_dpx_get_token(&import->dpx_handle,
+      &import->kernel_parms,
+      import->appl_names,
+      sw_out_serial_No,
+      sw_out_type,
+      sw_out_authmode,
+      &dpdata);
+
+  if (result < 0) {
+    vacman_library_error("AAL2DPXGetToken", result);
+    return Qnil;
+  }
+
+  if (result == 107) return Qnil;
+
+  VALUE hash = rb_hash_new();
+
+  vacman_digipass_to_rbhash(&dpdata, hash);
+  vacman_rbhash_set_sv(hash, import->sv);
+
+  return hash;
+}
+
+static VALUE dpx_import_close(VALUE ptr) {
+  struct dpx_import *import = (struct dpx_import *)ptr;
+
+  AAL2DPXClose(&import->dpx_handle);
+
+  return Qnil;
+}
+
+static VALUE dpx_import_collect(VALUE ptr) {
+  struct dpx_import *import = (struct dpx_import *)ptr;
   VALUE list = rb_ary_new();
+  VALUE hash;
+
+  while ((hash = dpx_import_next(import)) != Qnil) {
+    rb_ary_push(list, hash);
+  }
+
+  return list;
+}
+
+static VALUE dpx_import_yield(VALUE ptr) {
+  struct dpx_import *import = (struct dpx_import *)ptr;
+  VALUE chunk = Qnil;
+  VALUE hash;
+
+  while ((hash = dpx_import_next(import)) != Qnil) {
+    if (import->chunk == 0) {
+      rb_yield(hash);
+      continue;
+    }
+
+    if (NIL_P(chunk)) {
+      chunk = rb_ary_new_capa(import->chunk);
+    }
+
+    rb_ary_push(chunk, hash);
+
+    if (RARRAY_LEN(chunk) == import->chunk) {
+      rb_yield(chunk);
+      chunk = Qnil;
+    }
+  }
+
+  if (!NIL_P(chunk)) {
+    rb_yield(chunk);
+  }
+
+  return Qnil;
+}
+
+/*
+ * Imports a .DPX file containing token seeds and initialisation values.
+ *
+ * Pass the pre-shared key to validate it as the second argument. The
+ * key is not validated by the AAL2 library, if you pass a different
+ * key than the one that was used to create the DPX, you will get back
+ * tokens that generate different OTPs.
+ *
+ */
+VALUE vacman_dpx_import(int argc, VALUE *argv, VALUE module) {
+  VALUE filename, key, params;
+  rb_scan_args(argc, argv, "21", &filename, &key, &params);
+
+  struct dpx_import import;
+  memset(&import, 0, sizeof(import));
+
+  dpx_import_open(&import, filename, key, params);
+
+  VALUE list = rb_ensure(dpx_import_collect, (VALUE)&import,
+                         dpx_import_close,   (VALUE)&import);
+
+  RB_GC_GUARD(import.sv);
+
+  return list;
+}
+
+/*
+ * Imports a .DPX file like vacman_dpx_import() does, but yields every token
+ * hash to the given block instead of returning them all, so that memory use
+ * does not depend on the DPX size.
+ *
+ * If a chunk size is given, Arrays of at most that many token hashes are
+ * yielded instead.
+ */
+VALUE vacman_dpx_import_each(int argc, VALUE *argv, VALUE module) {
+  VALUE filename, key, chunk, params;
+  rb_scan_args(argc, argv, "22", &filename, &key, &chunk, &params);
+
+  RETURN_ENUMERATOR(module, argc, argv);
 
-  while (1) {
-    result = AAL2DPXGetToken(&dpx_handle,
-        &g_KernelParms,
-        appl_names,
-        sw_out_serial_No,
-        sw_out_type,
-        sw_out_authmode,
-        &dpdata);
+  struct dpx_import import;
+  memset(&import, 0, sizeof(import));
 
+  if (!NIL_P(chunk)) {
+    import.chunk = NUM2LONG(chunk);
+
+    if (import.chunk < 1) {
+      rb_raise(rb_eArgError, "invalid chunk size given: %ld", import.chunk);
+    }
+  }
+
+  dpx_import_open(&import, filename, key, params);
+
+  rb_ensure(dpx_import_yield, (VALUE)&import,
+            dpx_import_close, (VALUE)&import);
+
+  RB_GC_GUARD(import.sv);
+
+  return Qnil;
+}
+
+
+/*
+ * Bulk import of many DPX files, that are decoded concurrently by a pool
+ * of native workers (see pool.c), each one with its own DPX handle.
+ *
+ * The workers hand back batches of TDigipassBlob structures, that are
+ * converted into token hashes and yielded by the Ruby thread, along with
+ * an event telling the file as done or as failed. A failing file does not
+ * stop the others.
+ */
+enum dpx_bulk_event {
+  DPX_BULK_TOKENS,
+  DPX_BULK_DONE,
+  DPX_BULK_ERROR,
+};
+
+struct dpx_bulk_file {
+  char *filename;
+  char *key;
+  char *sv;     /* Set by the worker before it pushes the first tokens */
+};
+
+struct dpx_bulk_item {
+  long          file;
+  int           event;
+  const char   *method;   /* The AAL2 call that failed */
+  aat_int32     result;   /* and its error code */
+  long          count;    /* Tokens in the batch, or in the whole file when done */
+  TDigipassBlob tokens[];
+};
+
+struct dpx_bulk {
+  struct vacman_pool    pool;
+  TKernelParms          kernel_parms;
+  struct dpx_bulk_file *files;
+  long                  count;
+  long                  workers;
+  long                  batch;
+  VALUE                 filenames;
+  VALUE                 keys;
+  VALUE                 svs;     /* The static vector of each file, once seen */
+  struct dpx_bulk_item *current; /* The item being converted */
+};
+
+static struct dpx_bulk_item *dpx_bulk_item_new(struct vacman_pool *pool, long file, int event, long count) {
+  struct dpx_bulk_item *item = vacman_pool_alloc(pool,
+      sizeof(struct dpx_bulk_item) + count * sizeof(TDigipassBlob));
+
+  if (item) {
+    item->file   = file;
+    item->event  = event;
+    item->method = NULL;
+    item->result = 0;
+    item->count  = 0;
+  }
+
+  return item;
+}
+
+static void dpx_bulk_report(struct vacman_pool *pool, long file, int event,
+                            const char *method, aat_int32 result, long count) {
+  struct dpx_bulk_item *item = dpx_bulk_item_new(pool, file, event, 0);
+
+  if (item) {
+    item->method = method;
+    item->result = result;
+    item->count  = count;
+
+    vacman_pool_push(pool, item);
+  }
+}
+
+/*
+ * Imports a whole file, runs on a worker without the GVL.
+ */
+static void dpx_bulk_work(struct vacman_pool *pool, long job) {
+  struct dpx_bulk *bulk = pool->data;
+  struct dpx_bulk_file *file = &bulk->files[job];
+
+  TKernelParms kernel_parms = bulk->kernel_parms;
+  TDPXHandle dpx_handle;
+  aat_ascii appl_names[13*8];
+  aat_int16 appl_count;
+  aat_int16 token_count;
+
+  uint64_t start = vacman_stats_start();
+  aat_int32 result = AAL2DPXInit(&dpx_handle, file->filename, file->key,
+                                 &appl_count, appl_names, &token_count);
+  vacman_stats_record(STAT_DPX_INIT, start, result);
+
+  if (result != 0) {
+    dpx_bulk_report(pool, job, DPX_BULK_ERROR, "AAL2DPXInit", result, 0);
+    return;
+  }
+
+  aat_ascii static_vector[4094+1];
+  aat_int32 static_vector_len = sizeof(static_vector);
+
+  start = vacman_stats_start();
+  result = AAL2DPXGetStaticVector(&dpx_handle, &kernel_parms, static_vector, &static_vector_len);
+  vacman_stats_record(STAT_DPX_GET_STATIC_VECTOR, start, result);
+
+  if (result != 0) {
+    static_vector[0] = '\0';
+  }
+
+  size_t sv_size = strlen(static_vector) + 1;
+  if ((file->sv = vacman_pool_alloc(pool, sv_size)) != NULL) {
+    memcpy(file->sv, static_vector, sv_size);
+  }
+
+  struct dpx_bulk_item *item = NULL;
+  const char *method = NULL;
+  long total = 0;
+
+  while (file->sv && !vacman_pool_cancelled(pool)) {
+    if (item == NULL) {
+      item = dpx_bulk_item_new(pool, job, DPX_BULK_TOKENS, bulk->batch);
+      if (item == NULL) break;
+    }
+
+    aat_ascii serial[22+1];
+    aat_ascii type[5+1];
+    aat_ascii authmode[2+1];
+
+    start = vacman_stats_start();
+    result = AAL2DPXGetToken(&dpx_handle, &kernel_parms, appl_names,
+                             serial, type, authmode, &item->tokens[item->count]);
+    vacman_stats_record(STAT_DPX_GET_TOKEN, start, result == 107 ? 0 : result);
 
     if (result < 0) {
-      vacman_library_error("AAL2DPXGetToken", result);
-      return Qnil;
+      method = "AAL2DPXGetToken";
+      break;
     }
 
     if (result == 107) break;
 
-    VALUE hash = rb_hash_new();
+    total++;
 
-    vacman_digipass_to_rbhash_sv(&dpdata, sw_out_static_vector, hash);
-
-    rb_ary_push(list, hash);
+    if (++item->count == bulk->batch) {
+      vacman_pool_push(pool, item);
+      item = NULL;
+    }
   }
 
   AAL2DPXClose(&dpx_handle);
 
-  return list;
+  if (item && item->count > 0) {
+    vacman_pool_push(pool, item);
+  } else {
+    free(item);
+  }
+
+  if (method) {
+    dpx_bulk_report(pool, job, DPX_BULK_ERROR, method, result, total);
+  } else {
+    dpx_bulk_report(pool, job, DPX_BULK_DONE, NULL, 0, total);
+  }
+}
+
+/*
+ * Converts an item popped from the queue into the event Symbol and payload
+ * to yield: an Array of token hashes, the number of imported tokens or an
+ * Error.
+ */
+static VALUE dpx_bulk_payload(struct dpx_bulk *bulk, struct dpx_bulk_item *item, VALUE *event) {
+  switch (item->event) {
+    case DPX_BULK_TOKENS: {
+      VALUE sv = rb_ary_entry(bulk->svs, item->file);
+
+      if (NIL_P(sv)) {
+        sv = vacman_sv_intern(rb_str_new2(bulk->files[item->file].sv));
+        rb_ary_store(bulk->svs, item->file, sv);
+      }
+
+      VALUE tokens = rb_ary_new_capa(item->count);
+
+      for (long i = 0; i < item->count; i++) {
+        VALUE hash = rb_hash_new();
+
+        vacman_digipass_to_rbhash(&item->tokens[i], hash);
+        vacman_rbhash_set_sv(hash, sv);
+
+        rb_ary_push(tokens, hash);
+      }
+
+      *event = ID2SYM(rb_intern("tokens"));
+      return tokens;
+    }
+
+    case DPX_BULK_DONE:
+      *event = ID2SYM(rb_intern("done"));
+      return LONG2NUM(item->count);
+
+    default:
+      *event = ID2SYM(rb_intern("error"));
+      return vacman_library_error_new(item->method, item->result);
+  }
+}
+
+static VALUE dpx_bulk_run(VALUE ptr) {
+  struct dpx_bulk *bulk = (struct dpx_bulk *)ptr;
+
+  for (long i = 0; i < bulk->count; i++) {
+    VALUE filename = rb_ary_entry(bulk->filenames, i);
+    VALUE key = RB_TYPE_P(bulk->keys, T_ARRAY) ? rb_ary_entry(bulk->keys, i) : bulk->keys;
+
+    bulk->files[i].filename = ruby_strdup(StringValueCStr(filename));
+    bulk->files[i].key      = ruby_strdup(StringValueCStr(key));
+  }
+
+  bulk->pool.work      = dpx_bulk_work;
+  bulk->pool.free_item = free;
+  bulk->pool.data      = bulk;
+
+  vacman_pool_start(&bulk->pool, bulk->workers, bulk->count, bulk->workers * 2);
+
+  while ((bulk->current = vacman_pool_pop(&bulk->pool)) != NULL) {
+    VALUE event;
+    VALUE payload  = dpx_bulk_payload(bulk, bulk->current, &event);
+    VALUE filename = rb_ary_entry(bulk->filenames, bulk->current->file);
+
+    free(bulk->current);
+    bulk->current = NULL;
+
+    rb_yield_values(3, filename, event, payload);
+  }
+
+  return Qnil;
+}
+
+static VALUE dpx_bulk_close(VALUE ptr) {
+  struct dpx_bulk *bulk = (struct dpx_bulk *)ptr;
+
+  free(bulk->current);
+
+  /* Returns once the workers are joined, that read the files freed below */
+  vacman_pool_finish(&bulk->pool);
+
+  for (long i = 0; i < bulk->count; i++) {
+    xfree(bulk->files[i].filename);
+    xfree(bulk->files[i].key);
+    free(bulk->files[i].sv);
+  }
+
+  xfree(bulk->files);
+
+  return Qnil;
+}
+
+/*
+ * Imports the given DPX files concurrently, using at most the given number
+ * of worker threads, and yields the file name, the event and its payload
+ * for every step:
+ *
+ * * :tokens with an Array of at most batch token hashes
+ * * :done with the number of tokens imported from the file
+ * * :error with the Error that stopped the import of the file
+ *
+ * Either a single key for all the files or an Array with a key per file
+ * is accepted. Results are buffered in a queue of 2 * workers batches: when
+ * it is full, the workers wait for the block to catch up.
+ */
+VALUE vacman_dpx_import_files(int argc, VALUE *argv, VALUE module) {
+  VALUE filenames, keys, workers, batch, params;
+  rb_scan_args(argc, argv, "41", &filenames, &keys, &workers, &batch, &params);
+
+  rb_need_block();
+
+  if (!RB_TYPE_P(filenames, T_ARRAY)) {
+    rb_raise(e_VacmanError, "invalid arguments given, requires an array of file names");
+  }
+
+  if (RB_TYPE_P(keys, T_ARRAY)) {
+    if (RARRAY_LEN(keys) != RARRAY_LEN(filenames)) {
+      rb_raise(e_VacmanError, "invalid arguments given, got %ld files and %ld keys",
+               RARRAY_LEN(filenames), RARRAY_LEN(keys));
+    }
+
+    keys = rb_ary_dup(keys);
+  } else {
+    StringValue(keys);
+  }
+
+  struct dpx_bulk bulk;
+  memset(&bulk, 0, sizeof(bulk));
+
+  bulk.filenames = rb_ary_dup(filenames);
+  bulk.keys      = keys;
+  bulk.count     = RARRAY_LEN(bulk.filenames);
+  bulk.workers   = NUM2LONG(workers);
+  bulk.batch     = NUM2LONG(batch);
+  bulk.svs       = rb_ary_new();
+
+  if (bulk.batch < 1 || bulk.batch > 65536) {
+    rb_raise(rb_eArgError, "invalid batch size given: %ld", bulk.batch);
+  }
+
+  if (bulk.workers < 1) {
+    rb_raise(rb_eArgError, "invalid number of workers given: %ld", bulk.workers);
+  }
+
+  vacman_kernel_params_snapshot(params, &bulk.kernel_parms);
+
+  bulk.files = ZALLOC_N(struct dpx_bulk_file, bulk.count);
+
+  rb_ensure(dpx_bulk_run,   (VALUE)&bulk,
+            dpx_bulk_close, (VALUE)&bulk);
+
+  RB_GC_GUARD(bulk.filenames);
+  RB_GC_GUARD(bulk.keys);
+  RB_GC_GUARD(bulk.svs);
+
+  return Qnil;
 }
 
 
 /*
  * Generate token activation code
  */
-VALUE vacman_dpx_generate_token_activation(VALUE module, VALUE token) {
+VALUE vacman_dpx_generate_token_activation(int argc, VALUE *argv, VALUE module) {
+  VALUE token, params;
+  rb_scan_args(argc, argv, "11", &token, &params);
+
+  TKernelParms kernel_parms;
+  vacman_kernel_params_snapshot(params, &kernel_parms);
+
   TDigipassBlob dpdata;
 
   aat_ascii static_vector[4094+1];
@@ -103,16 +551,13 @@ VALUE vacman_dpx_generate_token_activation(VALUE module, VALUE token) {
   aat_ascii serial_num[14+1];
   aat_ascii actv_code[4142+1];
 
-  aat_int32 result = AAL2GenActivationCodeXErc(dpdata_ary,     /* DPData */
-                                               1,              /* Appl_count */
-                                               &g_KernelParms, /* CallParms */
-                                               static_vector,  /* aStaticVectorIn DIGIPASS parameter setting */
-                                               NULL,           /* aSharedData for encryption */
-                                               NULL,           /* aAlea for encryption */
-                                               &actv_flags,    /* ActivationFlags */
-                                               serial_num,     /* aSerialNumberSuffix */
-                                               actv_code,      /* aXFAD */
-                                               NULL);          /* aXERC */
+  aat_int32 result = vacman_aal2_gen_activation(dpdata_ary,     /* DPData */
+                                                1,              /* Appl_count */
+                                                &kernel_parms,  /* CallParms */
+                                                static_vector,  /* aStaticVectorIn DIGIPASS parameter setting */
+                                                &actv_flags,    /* ActivationFlags */
+                                                serial_num,     /* aSerialNumberSuffix */
+                                                actv_code);     /* aXFAD */
 
   if (result != 0) {
     vacman_library_error("AAL2GenActivationCodeXErc", result);
@@ -125,3 +570,279 @@ VALUE vacman_dpx_generate_token_activation(VALUE module, VALUE token) {
 
   return ret;
 }
+
+
+/*
+ * Bulk activation code generation, spread over a pool of native workers
+ * (see pool.c).
+ *
+ * Tokens that share a serial number are the applications of the same
+ * DIGIPASS: they are activated together, in up to DPX_ACTV_APPS slots of
+ * the DPData array, so that a single activation code provisions them all.
+ *
+ * The token blobs and static vectors are copied into native memory with
+ * the GVL held, before the workers start, so that the workers never touch
+ * a Ruby object.
+ */
+#define DPX_ACTV_APPS 8
+
+struct dpx_actv_group {
+  char serial[10+1];               /* Key of the groups table */
+  long tokens[DPX_ACTV_APPS];      /* Indexes of the tokens in the group */
+  int  count;
+  long sv;                         /* Index of the static vector */
+};
+
+struct dpx_actv_item {
+  long      group;
+  aat_int32 result;
+  aat_ascii serial_num[14+1];
+  aat_ascii actv_code[4142+1];
+};
+
+struct dpx_actv {
+  struct vacman_pool     pool;
+  TKernelParms           kernel_parms;
+  TDigipassBlob         *dpdata;   /* The blob of each token */
+  struct dpx_actv_group *groups;
+  long                   count;    /* Groups, that is activation codes */
+  char                 **svs;      /* The distinct static vectors */
+  long                   sv_count;
+  long                   workers;
+  VALUE                  tokens;
+  st_table              *sv_index; /* Static vector String => index in svs */
+  st_table              *open;     /* Serial => group still taking tokens */
+  struct dpx_actv_item  *current;  /* The item being converted */
+};
+
+/*
+ * Returns the index of the given static vector in the native copies,
+ * making a new copy the first time it is seen.
+ *
+ * Only interned Strings are used as keys, as they are kept alive and in
+ * place by the registry: tokens from the same DPX all carry the interned
+ * one, and are found without hashing it again.
+ */
+static long dpx_actv_sv(struct dpx_actv *actv, VALUE sv) {
+  st_data_t index;
+
+  if (st_lookup(actv->sv_index, (st_data_t)sv, &index)) {
+    return (long)index;
+  }
+
+  VALUE interned = vacman_sv_intern(sv);
+
+  if (!st_lookup(actv->sv_index, (st_data_t)interned, &index)) {
+    index = actv->sv_count++;
+    actv->svs[index] = ruby_strdup(StringValueCStr(interned));
+    st_insert(actv->sv_index, (st_data_t)interned, index);
+  }
+
+  return (long)index;
+}
+
+/*
+ * Adds the given token to the group of its serial number. A new group is
+ * started when the token has a different static vector, when the group is
+ * full, or when it already has an application with the same name.
+ */
+static void dpx_actv_add(struct dpx_actv *actv, long token, long sv) {
+  TDigipassBlob *dpdata = &actv->dpdata[token];
+  struct dpx_actv_group *group = NULL;
+
+  char serial[10+1];
+  memcpy(serial, dpdata->Serial, sizeof(dpdata->Serial));
+  serial[10] = '\0';
+
+  st_data_t found;
+  if (st_lookup(actv->open, (st_data_t)serial, &found)) {
+    group = &actv->groups[found];
+
+    if (group->sv != sv || group->count == DPX_ACTV_APPS) {
+      group = NULL;
+    } else {
+      for (int i = 0; i < group->count; i++) {
+        if (memcmp(actv->dpdata[group->tokens[i]].AppName, dpdata->AppName, sizeof(dpdata->AppName)) == 0) {
+          group = NULL;
+          break;
+        }
+      }
+    }
+  }
+
+  if (group == NULL) {
+    group = &actv->groups[actv->count];
+    memcpy(group->serial, serial, sizeof(serial));
+    group->sv = sv;
+
+    st_insert(actv->open, (st_data_t)group->serial, actv->count++);
+  }
+
+  group->tokens[group->count++] = token;
+}
+
+/*
+ * Generates the activation code of a group, runs on a worker without the
+ * GVL.
+ */
+static void dpx_actv_work(struct vacman_pool *pool, long job) {
+  struct dpx_actv *actv = pool->data;
+  struct dpx_actv_group *group = &actv->groups[job];
+
+  struct dpx_actv_item *item = vacman_pool_alloc(pool, sizeof(struct dpx_actv_item));
+  if (item == NULL) return;
+
+  TKernelParms kernel_parms = actv->kernel_parms;
+  TDigipassBlob dpdata[DPX_ACTV_APPS];
+  TDigipassBlob *dpdata_ary[DPX_ACTV_APPS] = { 0 };
+
+  for (int i = 0; i < group->count; i++) {
+    dpdata[i] = actv->dpdata[group->tokens[i]];
+    dpdata_ary[i] = &dpdata[i];
+  }
+
+  aat_ascii static_vector[4094+1];
+  snprintf(static_vector, sizeof(static_vector), "%s", actv->svs[group->sv]);
+
+  aat_int32 actv_flags = ACTV_OFFLINE;
+
+  item->group = job;
+
+  uint64_t start = vacman_stats_start();
+  item->result = AAL2GenActivationCodeXErc(dpdata_ary,        /* DPData */
+                                           group->count,      /* Appl_count */
+                                           &kernel_parms,     /* CallParms */
+                                           static_vector,     /* aStaticVectorIn DIGIPASS parameter setting */
+                                           NULL,              /* aSharedData for encryption */
+                                           NULL,              /* aAlea for encryption */
+                                           &actv_flags,       /* ActivationFlags */
+                                           item->serial_num,  /* aSerialNumberSuffix */
+                                           item->actv_code,   /* aXFAD */
+                                           NULL);             /* aXERC */
+  vacman_stats_record(STAT_GEN_ACTIVATION, start, item->result);
+
+  vacman_pool_push(pool, item);
+}
+
+/*
+ * Converts an item popped from the queue into the indexes of the tokens
+ * of its group and the activation data Hash, or the Error.
+ */
+static VALUE dpx_actv_payload(struct dpx_actv *actv, struct dpx_actv_item *item, VALUE *indexes) {
+  struct dpx_actv_group *group = &actv->groups[item->group];
+
+  *indexes = rb_ary_new_capa(group->count);
+
+  for (int i = 0; i < group->count; i++) {
+    rb_ary_push(*indexes, LONG2NUM(group->tokens[i]));
+  }
+
+  if (item->result != 0) {
+    return vacman_library_error_new("AAL2GenActivationCodeXErc", item->result);
+  }
+
+  VALUE ret = rb_hash_new();
+  rb_hash_aset(ret, rb_str_new2("serial"), rb_str_new2(item->serial_num));
+  rb_hash_aset(ret, rb_str_new2("activation"), rb_str_new2(item->actv_code));
+
+  return ret;
+}
+
+static VALUE dpx_actv_run(VALUE ptr) {
+  struct dpx_actv *actv = (struct dpx_actv *)ptr;
+  long count = RARRAY_LEN(actv->tokens);
+
+  actv->dpdata   = ALLOC_N(TDigipassBlob, count);
+  actv->groups   = ZALLOC_N(struct dpx_actv_group, count);
+  actv->svs      = ZALLOC_N(char *, count);
+  actv->sv_index = st_init_numtable();
+  actv->open     = st_init_strtable();
+
+  for (long i = 0; i < count; i++) {
+    VALUE token = RARRAY_AREF(actv->tokens, i);
+
+    vacman_rbhash_to_digipass(token, &actv->dpdata[i]);
+    dpx_actv_add(actv, i, dpx_actv_sv(actv, vacman_rbhash_fetch_sv(token)));
+  }
+
+  actv->pool.work      = dpx_actv_work;
+  actv->pool.free_item = free;
+  actv->pool.data      = actv;
+
+  vacman_pool_start(&actv->pool, actv->workers, actv->count, actv->workers * 2);
+
+  while ((actv->current = vacman_pool_pop(&actv->pool)) != NULL) {
+    VALUE indexes;
+    VALUE payload = dpx_actv_payload(actv, actv->current, &indexes);
+
+    free(actv->current);
+    actv->current = NULL;
+
+    rb_yield_values(2, indexes, payload);
+  }
+
+  return Qnil;
+}
+
+static VALUE dpx_actv_close(VALUE ptr) {
+  struct dpx_actv *actv = (struct dpx_actv *)ptr;
+
+  free(actv->current);
+
+  /* Returns once the workers are joined, that read the tokens freed below */
+  vacman_pool_finish(&actv->pool);
+
+  for (long i = 0; i < actv->sv_count; i++) {
+    xfree(actv->svs[i]);
+  }
+
+  if (actv->open)     st_free_table(actv->open);
+  if (actv->sv_index) st_free_table(actv->sv_index);
+
+  xfree(actv->svs);
+  xfree(actv->groups);
+  xfree(actv->dpdata);
+
+  return Qnil;
+}
+
+/*
+ * Generates the activation codes of the given tokens concurrently, using
+ * at most the given number of worker threads, and yields them as they are
+ * generated, in no particular order.
+ *
+ * Tokens with the same serial number and static vector are activated
+ * together. For each activation code, the indexes of its tokens in the
+ * given Array are yielded, along with either the activation data Hash, as
+ * returned by generate_activation, or the Error returned by AAL2.
+ */
+VALUE vacman_dpx_generate_activations(int argc, VALUE *argv, VALUE module) {
+  VALUE tokens, workers, params;
+  rb_scan_args(argc, argv, "21", &tokens, &workers, &params);
+
+  rb_need_block();
+
+  if (!RB_TYPE_P(tokens, T_ARRAY)) {
+    rb_raise(e_VacmanError, "invalid arguments given, requires an array of tokens");
+  }
+
+  struct dpx_actv actv;
+  memset(&actv, 0, sizeof(actv));
+
+  /* A private copy, so that the array cannot change under our feet */
+  actv.tokens  = rb_ary_dup(tokens);
+  actv.workers = NUM2LONG(workers);
+
+  if (actv.workers < 1) {
+    rb_raise(rb_eArgError, "invalid number of workers given: %ld", actv.workers);
+  }
+
+  vacman_kernel_params_snapshot(params, &actv.kernel_parms);
+
+  rb_ensure(dpx_actv_run,   (VALUE)&actv,
+            dpx_actv_close, (VALUE)&actv);
+
+  RB_GC_GUARD(actv.tokens);
+
+  return Qnil;
+}
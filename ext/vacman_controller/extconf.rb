@@ -16,6 +16,15 @@ end
 append_cflags "-I#{VACMAN_CONTROLLER}/include -fcommon -Wall -std=c99 -Wno-declaration-after-statement"
 append_ldflags "-L#{VACMAN_CONTROLLER}/lib -laal2sdk -Wl,-rpath #{VACMAN_CONTROLLER}/lib"
 
+# The bulk operations run AAL2 on native worker threads
+unless have_header('pthread.h') && have_library('pthread', 'pthread_create')
+  puts "No pthread library found"
+  exit 1
+end
+
+# Ruby 3.0+: the extension can be loaded and used by any Ractor
+have_func('rb_ext_ractor_safe', 'ruby.h')
+
 if find_library('aal2sdk', 'AAL2DPXInit', "#{VACMAN_CONTROLLER}/lib")
   create_makefile('vacman_controller/vacman_low_level')
 else
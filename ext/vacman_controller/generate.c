@@ -0,0 +1,331 @@
+/*
+ * Vacman Controller wrapper
+ *
+ * This Ruby Extension wraps the VASCO Vacman Controller
+ * library and makes its API accessible to Ruby code.
+ *
+ * (C) 2013 https://github.com/mlankenau
+ * (C) 2019 m.barnaba@ifad.org
+ */
+#include "vacman_controller.h"
+#include <ruby/thread.h>
+#include <time.h>
+
+/*
+ * Bulk OTP generation, to produce fixtures for load tests.
+ *
+ * OTPs are generated on a scratch copy of the token blob, that is never
+ * written back, so that the token is not altered. There are two ranges:
+ *
+ * - By time: the OTPs the token shows at from, from + step, and so on. The
+ *   clock is moved via the GMTAdjust kernel param, and every OTP is
+ *   generated from a fresh copy of the token.
+ *
+ * - By event: the OTPs the token shows as its event counter moves on, that
+ *   is successive AAL2GenPassword calls on the same copy.
+ *
+ * OTPs are generated in chunks of GENERATE_CHUNK, with the GVL released for
+ * a whole chunk, and handed to Ruby chunk by chunk. Many tokens are spread
+ * over a pool of native workers (see pool.c).
+ */
+#define GENERATE_CHUNK     4096
+#define GENERATE_OTP_SIZE  18
+
+struct generate_range {
+  TKernelParms kernel_parms;
+  int          event;        /* Successive event OTPs, else by time */
+  int64_t      from, step;   /* Seconds since the epoch, by time */
+  long         count;
+};
+
+struct generate_chunk {
+  long      token;           /* Index of the token, in bulk */
+  long      first, count;    /* The OTPs generated, from the first-th */
+  aat_int32 result;          /* Of the call that cut the chunk short */
+  aat_ascii otps[][GENERATE_OTP_SIZE];
+};
+
+#define GENERATE_CHUNK_SIZE(n) (sizeof(struct generate_chunk) + (size_t)(n) * GENERATE_OTP_SIZE)
+
+/*
+ * Generates at most max OTPs of the given token into the given chunk, from
+ * its first-th one, on the scratch blob. Runs without the GVL.
+ */
+static void generate_run(const struct generate_range *range, const TDigipassBlob *dpdata,
+                         TDigipassBlob *scratch, struct generate_chunk *chunk, long max) {
+  TKernelParms kernel_parms = range->kernel_parms;
+
+  chunk->count  = 0;
+  chunk->result = 0;
+
+  for (long i = 0; i < max; i++) {
+    if (!range->event) {
+      *scratch = *dpdata;
+      kernel_parms.GMTAdjust = (aat_int32)(range->from + (chunk->first + i) * range->step - time(NULL));
+    }
+
+    memset(chunk->otps[i], 0, GENERATE_OTP_SIZE);
+
+    uint64_t start = vacman_stats_start();
+    aat_int32 result = AAL2GenPassword(scratch, &kernel_parms, chunk->otps[i], NULL);
+    vacman_stats_record(STAT_GEN_PASSWORD, start, result);
+
+    if (result != 0) {
+      chunk->result = result;
+      break;
+    }
+
+    chunk->count++;
+  }
+}
+
+/*
+ * Parses the range arguments: from is nil for an event range
+ */
+static void generate_range_parse(struct generate_range *range, VALUE from, VALUE step, VALUE count, VALUE params) {
+  range->count = NUM2LONG(count);
+
+  if (range->count < 0) {
+    rb_raise(rb_eArgError, "invalid number of OTPs given: %ld", range->count);
+  }
+
+  if (NIL_P(from)) {
+    range->event = 1;
+  } else {
+    range->from = NUM2LL(from);
+    range->step = NUM2LL(step);
+
+    if (range->step <= 0) {
+      rb_raise(rb_eArgError, "invalid step given: %lld", (long long)range->step);
+    }
+
+    /* The clock offset must fit GMTAdjust */
+    int64_t now = time(NULL);
+
+    if (range->from - now < INT32_MIN || range->from - now > INT32_MAX ||
+        (range->count > 1 && (range->count - 1) > (INT32_MAX - (range->from - now)) / range->step)) {
+      rb_raise(rb_eArgError, "time range too far from now");
+    }
+  }
+
+  vacman_kernel_params_snapshot(params, &range->kernel_parms);
+}
+
+/*
+ * Converts the OTPs of a chunk into an Array of Strings
+ */
+static VALUE generate_chunk_otps(struct generate_chunk *chunk) {
+  VALUE ret = rb_ary_new_capa(chunk->count);
+
+  for (long i = 0; i < chunk->count; i++) {
+    rb_ary_push(ret, rb_str_new2(chunk->otps[i]));
+  }
+
+  return ret;
+}
+
+
+struct generate_args {
+  struct generate_range *range;
+  TDigipassBlob         *dpdata;
+  TDigipassBlob         *scratch;
+  struct generate_chunk *chunk;
+  long                   max;
+};
+
+static void *generate_nogvl(void *ptr) {
+  struct generate_args *args = ptr;
+
+  generate_run(args->range, args->dpdata, args->scratch, args->chunk, args->max);
+
+  return NULL;
+}
+
+/*
+ * Generates the given range of OTPs of the given token, without altering
+ * it. If a block is given, Arrays of OTPs are yielded as they are
+ * generated, else a single Array is returned.
+ *
+ * With a nil from, count successive event OTPs are generated, otherwise
+ * count OTPs by time, every step seconds from the from epoch time.
+ */
+VALUE vacman_generate_passwords(int argc, VALUE *argv, VALUE module) {
+  VALUE token, from, step, count, params;
+  rb_scan_args(argc, argv, "41", &token, &from, &step, &count, &params);
+
+  struct generate_range range;
+  generate_range_parse(&range, from, step, count, params);
+
+  TDigipassBlob dpdata, scratch;
+
+  vacman_rbhash_to_digipass(token, &dpdata);
+  scratch = dpdata;
+
+  /* Not moved by the GC, so it can be written without the GVL */
+  VALUE chunk_buf;
+  struct generate_chunk *chunk = ALLOCV(chunk_buf, GENERATE_CHUNK_SIZE(GENERATE_CHUNK));
+
+  struct generate_args args = { &range, &dpdata, &scratch, chunk, 0 };
+  VALUE ret = rb_block_given_p() ? Qnil : rb_ary_new_capa(range.count);
+
+  for (long first = 0; first < range.count; first += chunk->count) {
+    chunk->first = first;
+    args.max = range.count - first < GENERATE_CHUNK ? range.count - first : GENERATE_CHUNK;
+
+    rb_thread_call_without_gvl(generate_nogvl, &args, NULL, NULL);
+
+    VALUE otps = generate_chunk_otps(chunk);
+
+    if (NIL_P(ret)) {
+      rb_yield(otps);
+    } else {
+      rb_ary_concat(ret, otps);
+    }
+
+    if (chunk->result != 0) {
+      vacman_library_error("AAL2GenPassword", chunk->result);
+    }
+
+    rb_thread_check_ints();
+  }
+
+  ALLOCV_END(chunk_buf);
+
+  return ret;
+}
+
+
+/*
+ * The same range of OTPs of many tokens, one token per job
+ */
+struct generate_bulk {
+  struct vacman_pool     pool;
+  struct generate_range  range;
+  TDigipassBlob         *dpdata;   /* The blob of each token */
+  long                   workers;
+  VALUE                  tokens;
+  struct generate_chunk *current;  /* The chunk being converted */
+};
+
+/*
+ * Generates the OTPs of a token, and pushes them chunk by chunk. Runs on
+ * a worker without the GVL.
+ */
+static void generate_bulk_work(struct vacman_pool *pool, long job) {
+  struct generate_bulk *bulk = pool->data;
+  TDigipassBlob scratch = bulk->dpdata[job];
+
+  for (long first = 0; first < bulk->range.count; ) {
+    long max = bulk->range.count - first < GENERATE_CHUNK ? bulk->range.count - first : GENERATE_CHUNK;
+
+    struct generate_chunk *chunk = vacman_pool_alloc(pool, GENERATE_CHUNK_SIZE(max));
+    if (chunk == NULL) return;
+
+    chunk->token = job;
+    chunk->first = first;
+
+    generate_run(&bulk->range, &bulk->dpdata[job], &scratch, chunk, max);
+
+    first += chunk->count;
+
+    /* The chunk is not ours anymore once pushed */
+    aat_int32 result = chunk->result;
+
+    if (!vacman_pool_push(pool, chunk) || result != 0 || vacman_pool_cancelled(pool)) {
+      return;
+    }
+  }
+}
+
+static VALUE generate_bulk_run(VALUE ptr) {
+  struct generate_bulk *bulk = (struct generate_bulk *)ptr;
+  long count = RARRAY_LEN(bulk->tokens);
+
+  bulk->dpdata = ALLOC_N(TDigipassBlob, count);
+
+  for (long i = 0; i < count; i++) {
+    vacman_rbhash_to_digipass(RARRAY_AREF(bulk->tokens, i), &bulk->dpdata[i]);
+  }
+
+  bulk->pool.work      = generate_bulk_work;
+  bulk->pool.free_item = free;
+  bulk->pool.data      = bulk;
+
+  vacman_pool_start(&bulk->pool, bulk->workers, bulk->range.count > 0 ? count : 0, bulk->workers * 2);
+
+  while ((bulk->current = vacman_pool_pop(&bulk->pool)) != NULL) {
+    struct generate_chunk *chunk = bulk->current;
+
+    VALUE index = LONG2NUM(chunk->token);
+    VALUE first = LONG2NUM(chunk->first);
+    VALUE otps  = generate_chunk_otps(chunk);
+    VALUE error = chunk->result != 0 ? vacman_library_error_new("AAL2GenPassword", chunk->result) : Qnil;
+
+    free(chunk);
+    bulk->current = NULL;
+
+    if (RARRAY_LEN(otps) > 0) {
+      rb_yield_values(3, index, first, otps);
+    }
+
+    if (!NIL_P(error)) {
+      rb_yield_values(3, index, LONG2NUM(NUM2LONG(first) + RARRAY_LEN(otps)), error);
+    }
+  }
+
+  return Qnil;
+}
+
+static VALUE generate_bulk_close(VALUE ptr) {
+  struct generate_bulk *bulk = (struct generate_bulk *)ptr;
+
+  free(bulk->current);
+
+  /* Returns once the workers are joined, that read the blobs freed below */
+  vacman_pool_finish(&bulk->pool);
+
+  xfree(bulk->dpdata);
+
+  return Qnil;
+}
+
+/*
+ * Generates the given range of OTPs of each of the given tokens, as
+ * generate_passwords does, concurrently on at most the given number of
+ * worker threads.
+ *
+ * Yields the index of the token in the given Array, the position of the
+ * first OTP in the range, and either an Array of OTPs or the Error that
+ * stopped the generation for that token. The OTPs of each token are
+ * yielded in order, those of different tokens interleaved.
+ */
+VALUE vacman_generate_passwords_bulk(int argc, VALUE *argv, VALUE module) {
+  VALUE tokens, from, step, count, workers, params;
+  rb_scan_args(argc, argv, "51", &tokens, &from, &step, &count, &workers, &params);
+
+  rb_need_block();
+
+  if (!RB_TYPE_P(tokens, T_ARRAY)) {
+    rb_raise(e_VacmanError, "invalid arguments given, requires an array of tokens");
+  }
+
+  struct generate_bulk bulk;
+  memset(&bulk, 0, sizeof(bulk));
+
+  /* A private copy, so that the array cannot change under our feet */
+  bulk.tokens  = rb_ary_dup(tokens);
+  bulk.workers = NUM2LONG(workers);
+
+  if (bulk.workers < 1) {
+    rb_raise(rb_eArgError, "invalid number of workers given: %ld", bulk.workers);
+  }
+
+  generate_range_parse(&bulk.range, from, step, count, params);
+
+  rb_ensure(generate_bulk_run,   (VALUE)&bulk,
+            generate_bulk_close, (VALUE)&bulk);
+
+  RB_GC_GUARD(bulk.tokens);
+
+  return Qnil;
+}
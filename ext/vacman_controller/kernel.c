@@ -8,90 +8,383 @@
  * (C) 2019 m.barnaba@ifad.org
  */
 #include "vacman_controller.h"
+#include <stddef.h>
 
 /*
  * Vacman Controller kernel properties
  */
 struct kernel_property {
   const char *name;
-  aat_int32 *value;
+  size_t offset;
   aat_int32 deflt;
 };
 static struct kernel_property vacman_kernel_properties[] = {
-  { "ITimeWindow",    &g_KernelParms.ITimeWindow,    30  },  // Identification Window size in time steps
-  { "STimeWindow",    &g_KernelParms.STimeWindow,    24  },  // Signature Window size in secs
-  { "DiagLevel",      &g_KernelParms.DiagLevel,      0   },  // Requested Diagnostic Level
-  { "GMTAdjust",      &g_KernelParms.GMTAdjust,      0   },  // GMT Time adjustment to perform
-  { "CheckChallenge", &g_KernelParms.CheckChallenge, 0   },  // Verify Challenge Corrupted (mandatory for Gordian)
-  { "IThreshold",     &g_KernelParms.IThreshold,     3   },  // Identification Error Threshold
-  { "SThreshold",     &g_KernelParms.SThreshold,     1   },  // Signature Error Threshold
-  { "ChkInactDays",   &g_KernelParms.ChkInactDays,   0   },  // Check Inactive Days
-  { "DeriveVector",   &g_KernelParms.DeriveVector,   0   },  // Vector used to make Data Encryption unique
-  { "SyncWindow",     &g_KernelParms.SyncWindow,     2   },  // Synchronisation Time Window (h)
-  { "OnLineSG",       &g_KernelParms.OnLineSG,       2   },  // On line signature
-  { "EventWindow",    &g_KernelParms.EventWindow,    100 },  // Event Window size in nbr of iterations
-  { "HSMSlotId",      &g_KernelParms.HSMSlotId,      0   },  // HSM Slot id uses to store DB and Transport Key
+  { "ITimeWindow",    offsetof(TKernelParms, ITimeWindow),    30  },  // Identification Window size in time steps
+  { "STimeWindow",    offsetof(TKernelParms, STimeWindow),    24  },  // Signature Window size in secs
+  { "DiagLevel",      offsetof(TKernelParms, DiagLevel),      0   },  // Requested Diagnostic Level
+  { "GMTAdjust",      offsetof(TKernelParms, GMTAdjust),      0   },  // GMT Time adjustment to perform
+  { "CheckChallenge", offsetof(TKernelParms, CheckChallenge), 0   },  // Verify Challenge Corrupted (mandatory for Gordian)
+  { "IThreshold",     offsetof(TKernelParms, IThreshold),     3   },  // Identification Error Threshold
+  { "SThreshold",     offsetof(TKernelParms, SThreshold),     1   },  // Signature Error Threshold
+  { "ChkInactDays",   offsetof(TKernelParms, ChkInactDays),   0   },  // Check Inactive Days
+  { "DeriveVector",   offsetof(TKernelParms, DeriveVector),   0   },  // Vector used to make Data Encryption unique
+  { "SyncWindow",     offsetof(TKernelParms, SyncWindow),     2   },  // Synchronisation Time Window (h)
+  { "OnLineSG",       offsetof(TKernelParms, OnLineSG),       2   },  // On line signature
+  { "EventWindow",    offsetof(TKernelParms, EventWindow),    100 },  // Event Window size in nbr of iterations
+  { "HSMSlotId",      offsetof(TKernelParms, HSMSlotId),      0   },  // HSM Slot id uses to store DB and Transport Key
 };
 static size_t vacman_kernel_properties_count = sizeof(vacman_kernel_properties)/sizeof(struct kernel_property);
 
+#define KERNEL_PARAM(parms, i) \
+  (*(aat_int32 *)((char *)(parms) + vacman_kernel_properties[i].offset))
+
+/*
+ * Kernel parameters are held in immutable VacmanController::KernelParams
+ * objects, so that they can be read without locking: changing a parameter
+ * creates a new object and swaps it in place of the default one.
+ *
+ * Every call copies the parameters it needs onto the stack while holding
+ * the GVL (see vacman_kernel_params_snapshot()), so the AAL2 calls running
+ * without the GVL never see a half-written structure, and an object
+ * swapped out while a call is running is reclaimed by the Ruby GC.
+ *
+ * Being frozen, they are shareable across Ractors. The default parameters
+ * are held per Ractor: every Ractor starts from the library defaults, and
+ * changing them in a Ractor does not affect the others.
+ */
+static VALUE c_KernelParams;
+
+/* The process-wide default, used when no parameters are given. With
+ * Ractors, the library defaults every Ractor starts from. */
+static VALUE g_KernelParamsDefault = Qnil;
+
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+/* The Ractor-local key holding the default parameters of each Ractor */
+static rb_ractor_local_key_t kernel_params_default_key;
+#endif
+
+/* The thread variable holding the per-thread parameters. Not Thread#[],
+ * that is fiber-local. */
+static VALUE sym_kernel_params;
+static ID id_thread_variable_get, id_thread_variable_set;
+
+static size_t kernel_params_memsize(const void *ptr) {
+  return sizeof(TKernelParms);
+}
+
+static const rb_data_type_t vacman_kernel_params_type = {
+  "VacmanController::KernelParams",
+  { NULL, RUBY_TYPED_DEFAULT_FREE, kernel_params_memsize, },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY
+#ifdef RUBY_TYPED_FROZEN_SHAREABLE
+  | RUBY_TYPED_FROZEN_SHAREABLE
+#endif
+};
+
+static TKernelParms *kernel_params_get(VALUE params) {
+  return rb_check_typeddata(params, &vacman_kernel_params_type);
+}
+
+/*
+ * Allocates a new, frozen, KernelParams object copying the given parameters.
+ */
+static VALUE kernel_params_new(const TKernelParms *from) {
+  TKernelParms *parms;
+  VALUE obj = TypedData_Make_Struct(c_KernelParams, TKernelParms,
+                                    &vacman_kernel_params_type, parms);
+
+  memcpy(parms, from, sizeof(*parms));
+
+  return rb_obj_freeze(obj);
+}
+
+/*
+ * Lookup table from the interned parameter name to its index in
+ * vacman_kernel_properties, built once at init.
+ */
+static st_table *kernel_param_by_name;
+
+/*
+ * Looks up the given kernel parameter, by name as a Symbol or String, or by
+ * its index in the property names, raising an Error if not found.
+ */
+static size_t kernel_param_index(VALUE paramname) {
+  st_data_t index;
+
+  if (FIXNUM_P(paramname)) {
+    long i = FIX2LONG(paramname);
+
+    if (i >= 0 && (size_t)i < vacman_kernel_properties_count) {
+      return i;
+    }
+
+    rb_raise(e_VacmanError, "Invalid kernel param %ld", i);
+  }
+
+  ID id = rb_check_id(&paramname);
+
+  if (id && st_lookup(kernel_param_by_name, id, &index)) {
+    return index;
+  }
+
+  rb_raise(e_VacmanError, "Invalid kernel param %"PRIsVALUE, paramname);
+  return 0;
+}
+
+/*
+ * Sets the given parameters from a Ruby Hash of name => value pairs.
+ */
+static int kernel_params_update_i(VALUE paramname, VALUE rbval, VALUE ptr) {
+  TKernelParms *parms = (TKernelParms *)ptr;
+
+  KERNEL_PARAM(parms, kernel_param_index(paramname)) = rb_fix2int(rbval);
+
+  return ST_CONTINUE;
+}
+
+static void kernel_params_update(TKernelParms *parms, VALUE hash) {
+  if (NIL_P(hash)) {
+    return;
+  }
+
+  Check_Type(hash, T_HASH);
+  rb_hash_foreach(hash, kernel_params_update_i, (VALUE)parms);
+}
+
+/*
+ * Returns the default parameters of the current Ractor, or the process
+ * default ones.
+ */
+static VALUE kernel_params_default(void) {
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  VALUE params;
+
+  if (rb_ractor_local_storage_value_lookup(kernel_params_default_key, &params)) {
+    return params;
+  }
+#endif
+
+  return g_KernelParamsDefault;
+}
+
 /*
- * Initialise the kernel parameters with their defaults
+ * Swaps the default parameters, of the current Ractor or of the process.
  */
-void vacman_kernel_init_params() {
-  memset(&g_KernelParms, 0, sizeof(g_KernelParms));
+static void kernel_params_set_default(VALUE params) {
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  rb_ractor_local_storage_value_set(kernel_params_default_key, params);
+#else
+  g_KernelParamsDefault = params;
+#endif
+}
+
+/*
+ * Returns the parameters in effect on the current thread: the ones set via
+ * KernelParams.current=, or the default ones.
+ */
+static VALUE kernel_params_current(void) {
+  VALUE params = rb_funcall(rb_thread_current(), id_thread_variable_get, 1, sym_kernel_params);
+
+  return NIL_P(params) ? kernel_params_default() : params;
+}
+
+/*
+ * Copies the given KernelParams, or the current ones if nil is given, into
+ * the given structure. Used by all calls before invoking AAL2.
+ */
+void vacman_kernel_params_snapshot(VALUE params, TKernelParms *kernel_parms) {
+  if (NIL_P(params)) {
+    params = kernel_params_current();
+  }
+
+  memcpy(kernel_parms, kernel_params_get(params), sizeof(*kernel_parms));
+}
+
+
+/*
+ * KernelParams.new(hash = nil)
+ *
+ * Builds new kernel parameters from the library defaults, overridden by the
+ * given Hash of name => value pairs.
+ */
+static VALUE vacman_kernel_params_s_new(int argc, VALUE *argv, VALUE klass) {
+  VALUE hash;
+  TKernelParms parms;
+
+  rb_scan_args(argc, argv, "01", &hash);
 
-  g_KernelParms.ParmCount = 19; /* Number of valid parameters in this list */
+  memset(&parms, 0, sizeof(parms));
+
+  parms.ParmCount = 19; /* Number of valid parameters in this list */
 
   for (size_t i = 0; i < vacman_kernel_properties_count; i++) {
-    *vacman_kernel_properties[i].value = vacman_kernel_properties[i].deflt;
+    KERNEL_PARAM(&parms, i) = vacman_kernel_properties[i].deflt;
   }
+
+  kernel_params_update(&parms, hash);
+
+  return kernel_params_new(&parms);
+}
+
+/*
+ * KernelParams#merge(hash)
+ *
+ * Returns new kernel parameters, copied from these ones and overridden by the
+ * given Hash of name => value pairs.
+ */
+static VALUE vacman_kernel_params_merge(VALUE self, VALUE hash) {
+  TKernelParms parms;
+
+  memcpy(&parms, kernel_params_get(self), sizeof(parms));
+
+  kernel_params_update(&parms, hash);
+
+  return kernel_params_new(&parms);
 }
 
+/*
+ * KernelParams#[](name)
+ */
+static VALUE vacman_kernel_params_aref(VALUE self, VALUE paramname) {
+  size_t i = kernel_param_index(paramname);
+
+  return LONG2FIX(KERNEL_PARAM(kernel_params_get(self), i));
+}
 
 /*
- * Get kernel parameter names
+ * KernelParams#to_h
  */
-VALUE vacman_kernel_get_property_names() {
-  VALUE ret = rb_ary_new();
+static VALUE vacman_kernel_params_to_h(VALUE self) {
+  TKernelParms *parms = kernel_params_get(self);
+  VALUE ret = rb_hash_new();
 
   for (size_t i = 0; i < vacman_kernel_properties_count; i++) {
     const char *name = vacman_kernel_properties[i].name;
-    rb_ary_push(ret, rb_str_new2(name));
+    rb_hash_aset(ret, rb_str_new2(name), LONG2FIX(KERNEL_PARAM(parms, i)));
   }
 
   return ret;
 }
 
 /*
- * Get kernel parameter
+ * KernelParams.default
  */
-VALUE vacman_kernel_get_param(VALUE module, VALUE paramname) {
-  char *name = StringValueCStr(paramname);
+static VALUE vacman_kernel_params_s_default(VALUE klass) {
+  return kernel_params_default();
+}
+
+/*
+ * KernelParams.default = params
+ *
+ * Swaps the default parameters of the process, or of the current Ractor.
+ */
+static VALUE vacman_kernel_params_s_set_default(VALUE klass, VALUE params) {
+  kernel_params_get(params);
+
+  kernel_params_set_default(params);
+
+  return params;
+}
+
+/*
+ * KernelParams.current
+ */
+static VALUE vacman_kernel_params_s_current(VALUE klass) {
+  return kernel_params_current();
+}
+
+/*
+ * KernelParams.current = params
+ *
+ * Sets the parameters used by calls on the current thread, by all of its
+ * fibers. Pass nil to go back to the process default.
+ */
+static VALUE vacman_kernel_params_s_set_current(VALUE klass, VALUE params) {
+  if (!NIL_P(params)) {
+    kernel_params_get(params);
+  }
+
+  rb_funcall(rb_thread_current(), id_thread_variable_set, 2, sym_kernel_params, params);
+
+  return params;
+}
+
+
+/*
+ * Define the KernelParams class and initialise the default kernel parameters
+ */
+void vacman_kernel_init_params(VALUE controller) {
+  c_KernelParams = rb_define_class_under(controller, "KernelParams", rb_cObject);
+  rb_undef_alloc_func(c_KernelParams);
+
+  rb_define_singleton_method(c_KernelParams, "new",      vacman_kernel_params_s_new, -1);
+  rb_define_singleton_method(c_KernelParams, "default",  vacman_kernel_params_s_default, 0);
+  rb_define_singleton_method(c_KernelParams, "default=", vacman_kernel_params_s_set_default, 1);
+  rb_define_singleton_method(c_KernelParams, "current",  vacman_kernel_params_s_current, 0);
+  rb_define_singleton_method(c_KernelParams, "current=", vacman_kernel_params_s_set_current, 1);
+
+  rb_define_method(c_KernelParams, "merge", vacman_kernel_params_merge, 1);
+  rb_define_method(c_KernelParams, "[]",    vacman_kernel_params_aref, 1);
+  rb_define_method(c_KernelParams, "to_h",  vacman_kernel_params_to_h, 0);
+
+  sym_kernel_params      = ID2SYM(rb_intern("__vacman_kernel_params"));
+  id_thread_variable_get = rb_intern("thread_variable_get");
+  id_thread_variable_set = rb_intern("thread_variable_set");
+
+  kernel_param_by_name = st_init_numtable_with_size(vacman_kernel_properties_count);
 
   for (size_t i = 0; i < vacman_kernel_properties_count; i++) {
-    if (strcmp(name, vacman_kernel_properties[i].name) == 0) {
-      return LONG2FIX(*vacman_kernel_properties[i].value);
-    }
+    st_insert(kernel_param_by_name, rb_intern(vacman_kernel_properties[i].name), i);
   }
 
-  rb_raise(e_VacmanError, "Invalid kernel param %s", name);
-  return Qnil;
+  rb_gc_register_address(&g_KernelParamsDefault);
+  g_KernelParamsDefault = vacman_kernel_params_s_new(0, NULL, c_KernelParams);
+
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  kernel_params_default_key = rb_ractor_local_storage_value_newkey();
+#endif
 }
 
+
 /*
- * Set kernel parameter
+ * Get kernel parameter names
  */
-VALUE vacman_kernel_set_param(VALUE module, VALUE paramname, VALUE rbval) {
-  char *name = StringValueCStr(paramname);
-  int value  = rb_fix2int(rbval);
+VALUE vacman_kernel_get_property_names(VALUE module) {
+  VALUE ret = rb_ary_new();
 
   for (size_t i = 0; i < vacman_kernel_properties_count; i++) {
-    if (strcmp(name, vacman_kernel_properties[i].name) == 0) {
-      *vacman_kernel_properties[i].value = value;
-      return Qtrue;
-    }
+    const char *name = vacman_kernel_properties[i].name;
+    rb_ary_push(ret, rb_str_new2(name));
   }
 
-  rb_raise(e_VacmanError, "Invalid kernel param %s", name);
-  return Qnil;
+  return ret;
+}
+
+/*
+ * Get kernel parameter, from the default parameters
+ */
+VALUE vacman_kernel_get_param(VALUE module, VALUE paramname) {
+  return vacman_kernel_params_aref(kernel_params_default(), paramname);
+}
+
+/*
+ * Set kernel parameter, by swapping the default parameters with a modified
+ * copy of them. The arguments are converted before reading the defaults,
+ * so the swap never releases the GVL and concurrent writers do not lose
+ * each other's changes.
+ */
+VALUE vacman_kernel_set_param(VALUE module, VALUE paramname, VALUE rbval) {
+  TKernelParms parms;
+
+  size_t i  = kernel_param_index(paramname);
+  int value = rb_fix2int(rbval);
+
+  memcpy(&parms, kernel_params_get(kernel_params_default()), sizeof(parms));
+
+  KERNEL_PARAM(&parms, i) = value;
+
+  kernel_params_set_default(kernel_params_new(&parms));
+
+  return Qtrue;
 }
@@ -13,28 +13,57 @@
  * Extension entry point
  */
 void Init_vacman_low_level(void) {
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  /*
+   * All the global state is either set up once here, immutable and
+   * shareable, or guarded by native locks or atomics, and the kernel
+   * parameters default is kept per Ractor (kernel.c)
+   */
+  rb_ext_ractor_safe(true);
+#endif
+
   VALUE controller = rb_define_module("VacmanController");
   VALUE lowlevel   = rb_define_module_under(controller, "LowLevel");
 
   e_VacmanError = rb_define_class_under(controller, "Error", rb_eStandardError);
 
-  vacman_kernel_init_params();
+  vacman_serialize_init();
+  vacman_kernel_init_params(controller);
+  vacman_token_init();
+  vacman_digipass_init(lowlevel);
+  vacman_stats_init(lowlevel);
+  vacman_replay_init(lowlevel);
+  vacman_sv_init(lowlevel);
+  vacman_window_init(lowlevel);
+  vacman_audit_init(lowlevel);
+  vacman_async_init(lowlevel);
+  vacman_store_init(lowlevel);
+  vacman_tokenfile_init(lowlevel);
 
   /* Global methods */
   rb_define_singleton_method(lowlevel, "library_version",       vacman_library_version, 0);
 
   /* DPX methods */
-  rb_define_singleton_method(lowlevel, "import",                vacman_dpx_import, 2);
-  rb_define_singleton_method(lowlevel, "generate_activation",   vacman_dpx_generate_token_activation, 1);
+  rb_define_singleton_method(lowlevel, "import",                vacman_dpx_import, -1);
+  rb_define_singleton_method(lowlevel, "import_each",           vacman_dpx_import_each, -1);
+  rb_define_singleton_method(lowlevel, "import_files",          vacman_dpx_import_files, -1);
+  rb_define_singleton_method(lowlevel, "generate_activation",   vacman_dpx_generate_token_activation, -1);
+  rb_define_singleton_method(lowlevel, "generate_activations",  vacman_dpx_generate_activations, -1);
 
   /* Token methods */
   rb_define_singleton_method(lowlevel, "token_property_names",  vacman_token_get_property_names, 0);
-  rb_define_singleton_method(lowlevel, "get_token_property",    vacman_token_get_property, 2);
-  rb_define_singleton_method(lowlevel, "set_token_property",    vacman_token_set_property, 3);
-  rb_define_singleton_method(lowlevel, "set_token_pin",         vacman_token_set_pin, 2);
-  rb_define_singleton_method(lowlevel, "reset!",                vacman_token_reset_info, 1);
-  rb_define_singleton_method(lowlevel, "verify_password",       vacman_token_verify_password, 2);
-  rb_define_singleton_method(lowlevel, "generate_password",     vacman_token_generate_password, 1);
+  rb_define_singleton_method(lowlevel, "token_property_ids",    vacman_token_get_property_ids, 0);
+  rb_define_singleton_method(lowlevel, "get_token_property",    vacman_token_get_property, -1);
+  rb_define_singleton_method(lowlevel, "get_token_properties",  vacman_token_get_properties, -1);
+  rb_define_singleton_method(lowlevel, "set_token_property",    vacman_token_set_property, -1);
+  rb_define_singleton_method(lowlevel, "set_token_pin",         vacman_token_set_pin, -1);
+  rb_define_singleton_method(lowlevel, "reset!",                vacman_token_reset_info, -1);
+  rb_define_singleton_method(lowlevel, "verify_password",       vacman_token_verify_password, -1);
+  rb_define_singleton_method(lowlevel, "verify_password_status", vacman_token_verify_password_status, -1);
+  rb_define_singleton_method(lowlevel, "verify_passwords",      vacman_token_verify_passwords, -1);
+  rb_define_singleton_method(lowlevel, "generate_password",     vacman_token_generate_password, -1);
+  rb_define_singleton_method(lowlevel, "generate_passwords",    vacman_generate_passwords, -1);
+  rb_define_singleton_method(lowlevel, "generate_passwords_bulk", vacman_generate_passwords_bulk, -1);
 
   /* Kernel methods */
   rb_define_singleton_method(lowlevel, "kernel_property_names", vacman_kernel_get_property_names, 0);
@@ -43,9 +72,9 @@ void Init_vacman_low_level(void) {
 }
 
 /*
- * Raises an Error, decoding the Vacman Controller error code.
+ * Builds an Error, decoding the Vacman Controller error code.
  */
-void vacman_library_error(const char* method, int vacman_error_code) {
+VALUE vacman_library_error_new(const char* method, int vacman_error_code) {
   aat_ascii vacman_error_message[100]; // Recommended value in documentation.
 
   AAL2GetErrorMsg(vacman_error_code, vacman_error_message);
@@ -59,7 +88,14 @@ void vacman_library_error(const char* method, int vacman_error_code) {
   rb_iv_set(exc, "@error_code",     INT2FIX(vacman_error_code));
   rb_iv_set(exc, "@error_message",  rb_str_new2(vacman_error_message));
 
-  rb_exc_raise(exc);
+  return exc;
+}
+
+/*
+ * Raises an Error, decoding the Vacman Controller error code.
+ */
+void vacman_library_error(const char* method, int vacman_error_code) {
+  rb_exc_raise(vacman_library_error_new(method, vacman_error_code));
 }
 
 
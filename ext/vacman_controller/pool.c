@@ -0,0 +1,289 @@
+/*
+ * Vacman Controller wrapper
+ *
+ * This Ruby Extension wraps the VASCO Vacman Controller
+ * library and makes its API accessible to Ruby code.
+ *
+ * (C) 2013 https://github.com/mlankenau
+ * (C) 2019 m.barnaba@ifad.org
+ */
+#include "vacman_controller.h"
+#include <ruby/thread.h>
+#include <signal.h>
+
+/*
+ * A pool of native worker threads, that run AAL2 jobs outside of Ruby and
+ * hand their results back through a bounded queue.
+ *
+ * Jobs are numbered from 0 to jobs-1, and every worker picks the next one
+ * until none is left. The work function runs without the GVL: it must not
+ * touch any Ruby object, and it reports back by pushing malloc()ed items
+ * into the queue, that are popped by the Ruby thread that started the pool.
+ *
+ * The queue is bounded, so that a slow consumer throttles the workers
+ * instead of letting results pile up in memory.
+ *
+ * The Ruby thread must always call vacman_pool_finish(), in an ensure
+ * block: it stops the workers that are still running, waits for them and
+ * frees the items that were not popped.
+ */
+
+static void *pool_worker(void *ptr) {
+  struct vacman_pool *pool = ptr;
+  long job;
+
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    job = (pool->cancelled || pool->next == pool->jobs) ? -1 : pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (job < 0) break;
+
+    pool->work(pool, job);
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->running--;
+  pthread_cond_signal(&pool->readable);
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+/*
+ * Starts at most the given number of workers on the given number of jobs,
+ * with a queue that holds up to capacity items.
+ *
+ * The caller fills in work, free_item and data beforehand.
+ */
+void vacman_pool_start(struct vacman_pool *pool, long workers, long jobs, long capacity) {
+  if (workers < 1) {
+    rb_raise(rb_eArgError, "invalid number of workers given: %ld", workers);
+  }
+
+  if (workers > jobs) workers = jobs;
+  if (capacity < 1) capacity = 1;
+
+  pool->items    = ALLOC_N(void *, capacity);
+  pool->threads  = ALLOC_N(pthread_t, workers > 0 ? workers : 1);
+  pool->capacity = capacity;
+  pool->head     = 0;
+  pool->count    = 0;
+  pool->jobs     = jobs;
+  pool->next     = 0;
+  pool->workers  = 0;
+  pool->running  = 0;
+  pool->cancelled   = 0;
+  pool->interrupted = 0;
+  pool->nomem       = 0;
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->readable, NULL);
+  pthread_cond_init(&pool->writable, NULL);
+
+  /* Signals are for Ruby to handle, so the workers block them all */
+  sigset_t all, saved;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &saved);
+
+  for (long i = 0; i < workers; i++) {
+    pthread_mutex_lock(&pool->lock);
+    pool->running++;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (pthread_create(&pool->threads[i], NULL, pool_worker, pool) != 0) {
+      pthread_mutex_lock(&pool->lock);
+      pool->running--;
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+
+    pool->workers++;
+  }
+
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+  if (pool->workers == 0 && jobs > 0) {
+    rb_raise(e_VacmanError, "cannot start worker threads");
+  }
+}
+
+/*
+ * Pushes an item into the queue, waiting for room if it is full.
+ *
+ * Called by the workers. Returns 0 and frees the item if the pool has been
+ * cancelled, in which case the worker should stop as soon as possible.
+ */
+int vacman_pool_push(struct vacman_pool *pool, void *item) {
+  pthread_mutex_lock(&pool->lock);
+
+  while (pool->count == pool->capacity && !pool->cancelled) {
+    pthread_cond_wait(&pool->writable, &pool->lock);
+  }
+
+  if (pool->cancelled) {
+    pthread_mutex_unlock(&pool->lock);
+    pool->free_item(item);
+    return 0;
+  }
+
+  pool->items[(pool->head + pool->count) % pool->capacity] = item;
+  pool->count++;
+
+  pthread_cond_signal(&pool->readable);
+  pthread_mutex_unlock(&pool->lock);
+
+  return 1;
+}
+
+/*
+ * Allocates memory for an item, from a worker. On failure, the pool is
+ * cancelled and NULL is returned: vacman_pool_finish() then raises a
+ * NoMemoryError in the Ruby thread.
+ */
+void *vacman_pool_alloc(struct vacman_pool *pool, size_t size) {
+  void *ptr = malloc(size);
+
+  if (ptr == NULL) {
+    pthread_mutex_lock(&pool->lock);
+    pool->nomem = 1;
+    pool->cancelled = 1;
+    pthread_cond_broadcast(&pool->writable);
+    pthread_cond_signal(&pool->readable);
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  return ptr;
+}
+
+/*
+ * Returns whether the workers should stop.
+ */
+int vacman_pool_cancelled(struct vacman_pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  int cancelled = pool->cancelled;
+  pthread_mutex_unlock(&pool->lock);
+
+  return cancelled;
+}
+
+struct pool_pop_args {
+  struct vacman_pool *pool;
+  void *item;
+  int   result;
+};
+
+static void *pool_pop_nogvl(void *ptr) {
+  struct pool_pop_args *args = ptr;
+  struct vacman_pool *pool = args->pool;
+
+  pthread_mutex_lock(&pool->lock);
+
+  while (pool->count == 0 && pool->running > 0 && !pool->interrupted && !pool->cancelled) {
+    pthread_cond_wait(&pool->readable, &pool->lock);
+  }
+
+  if (pool->count > 0) {
+    args->item = pool->items[pool->head];
+    args->result = 1;
+
+    pool->head = (pool->head + 1) % pool->capacity;
+    pool->count--;
+
+    pthread_cond_signal(&pool->writable);
+
+  } else if (pool->interrupted) {
+    args->result = -1;
+
+  } else {
+    args->result = 0;
+  }
+
+  pool->interrupted = 0;
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+static void pool_pop_ubf(void *ptr) {
+  struct vacman_pool *pool = ptr;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->interrupted = 1;
+  pthread_cond_signal(&pool->readable);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Pops the next item from the queue, waiting for it without the GVL.
+ *
+ * Returns the item, or NULL once all the workers are done and the queue is
+ * empty. Pending interrupts are checked while waiting, so that the Ruby
+ * thread can be killed or raised into.
+ */
+void *vacman_pool_pop(struct vacman_pool *pool) {
+  struct pool_pop_args args = { pool, NULL, -1 };
+
+  do {
+    /* Left as is if an interrupt was pending and the pop did not run */
+    args.result = -1;
+
+    rb_thread_call_without_gvl2(pool_pop_nogvl, &args, pool_pop_ubf, pool);
+
+    if (args.result < 0) {
+      rb_thread_check_ints();
+    }
+  } while (args.result < 0);
+
+  return args.item;
+}
+
+static void *pool_join_nogvl(void *ptr) {
+  struct vacman_pool *pool = ptr;
+
+  for (long i = 0; i < pool->workers; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  return NULL;
+}
+
+/*
+ * Stops the workers, waits for them to complete the AAL2 call they are
+ * running and releases the pool resources, including the items that were
+ * not popped.
+ */
+void vacman_pool_finish(struct vacman_pool *pool) {
+  if (pool->threads == NULL) return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->cancelled = 1;
+  pthread_cond_broadcast(&pool->writable);
+  pthread_mutex_unlock(&pool->lock);
+
+  /*
+   * Not the interruptible variant, that skips the join if an interrupt is
+   * pending: the workers would be left running on the memory freed below.
+   * The workers are cancelled, so the wait is at most one AAL2 call.
+   */
+  rb_thread_call_without_gvl(pool_join_nogvl, pool, NULL, NULL);
+
+  while (pool->count > 0) {
+    pool->free_item(pool->items[pool->head]);
+    pool->head = (pool->head + 1) % pool->capacity;
+    pool->count--;
+  }
+
+  pthread_cond_destroy(&pool->writable);
+  pthread_cond_destroy(&pool->readable);
+  pthread_mutex_destroy(&pool->lock);
+
+  xfree(pool->threads);
+  xfree(pool->items);
+  pool->threads = NULL;
+  pool->items = NULL;
+
+  if (pool->nomem) {
+    rb_memerror();
+  }
+}
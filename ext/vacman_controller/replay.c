@@ -0,0 +1,383 @@
+/*
+ * Vacman Controller wrapper
+ *
+ * This Ruby Extension wraps the VASCO Vacman Controller
+ * library and makes its API accessible to Ruby code.
+ *
+ * (C) 2013 https://github.com/mlankenau
+ * (C) 2019 m.barnaba@ifad.org
+ */
+#include "vacman_controller.h"
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Cache of the OTPs recently verified, that answers the verification of an
+ * OTP seen before without calling AAL2VerifyPassword and without altering
+ * the token, so that double submissions and retry storms cost neither CPU
+ * nor a token write-back.
+ *
+ * - An OTP that was accepted is a replay, and is rejected as not valid
+ * - An OTP that was not valid is rejected again
+ *
+ * The cache never accepts an OTP: at worst, a colliding entry rejects one.
+ * Other results, such as a rejection because the token is locked, depend
+ * on the token state rather than on the OTP, and are not cached: the token
+ * may have been unlocked meanwhile.
+ *
+ * Entries are keyed by a seeded 64 bit hash of the token serial, the token
+ * application name and the OTP, so that no OTP is kept in memory. Unless
+ * a fixed TTL is configured, accepted OTPs expire after the time they may
+ * be accepted for, that is ITimeWindow time steps of the token, and OTPs
+ * that were not valid after REPLAY_DEFAULT_TTL: reading the time step
+ * costs an AAL2 call, that is only worth paying once the OTP was accepted.
+ *
+ * The cache is split into REPLAY_SHARDS shards, each with its own lock, so
+ * that threads verifying different tokens seldom contend. Every shard is a
+ * set-associative table of REPLAY_WAYS ways, evicting the expired or else
+ * least recently used entry of a set, so that the memory is bounded and
+ * allocated once.
+ *
+ * It is disabled by default, and enabled via configure_replay_cache.
+ */
+#define REPLAY_SHARDS        64
+#define REPLAY_WAYS          8
+#define REPLAY_INVALID       1    /* AAL2 result for an OTP that is not valid */
+#define REPLAY_DEFAULT_TTL   60   /* Seconds, for invalid OTPs and tokens without a time step */
+
+struct replay_entry {
+  uint64_t  key;        /* 0 if the entry is free */
+  uint64_t  expires;    /* CLOCK_MONOTONIC nanoseconds */
+  uint64_t  used;       /* Last use, in shard ticks */
+  int       accepted;   /* Whether the OTP was accepted, else it was invalid */
+};
+
+struct replay_shard {
+  pthread_mutex_t lock;
+  struct replay_entry *entries;
+  long     sets;
+  uint64_t tick;
+
+  uint64_t replays, rejects, misses, evictions;
+} __attribute__((aligned(64)));
+
+static struct replay_shard replay_shards[REPLAY_SHARDS];
+static long     replay_capacity = 0;
+static uint64_t replay_ttl = 0;   /* Nanoseconds, 0 to derive it from the token */
+static uint64_t replay_seed;
+
+static uint64_t replay_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t replay_fnv(uint64_t hash, const void *data, size_t len) {
+  const unsigned char *p = data;
+
+  for (size_t i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+static uint64_t replay_key(TDigipassBlob *dpdata, const aat_ascii *password) {
+  uint64_t key = replay_seed;
+
+  key = replay_fnv(key, dpdata->Serial,  sizeof(dpdata->Serial));
+  key = replay_fnv(key, dpdata->AppName, sizeof(dpdata->AppName));
+  key = replay_fnv(key, password, strlen(password));
+
+  return key ? key : 1;
+}
+
+static struct replay_shard *replay_shard(uint64_t key) {
+  return &replay_shards[key % REPLAY_SHARDS];
+}
+
+static struct replay_entry *replay_set(struct replay_shard *shard, uint64_t key) {
+  return &shard->entries[((key / REPLAY_SHARDS) % shard->sets) * REPLAY_WAYS];
+}
+
+/*
+ * Looks up the given OTP for the given token.
+ *
+ * Returns 1 and sets result if the verification can be answered from the
+ * cache, 0 otherwise. In both cases key is set, to be passed to
+ * vacman_replay_store() after the verification; it is 0 if the cache is
+ * disabled. Answers from the cache are audited as verifications. Does not
+ * use any Ruby API.
+ */
+int vacman_replay_lookup(TDigipassBlob *dpdata, TKernelParms *kernel_parms, const aat_ascii *password,
+                         uint64_t *key, aat_int32 *result) {
+  *key = 0;
+
+  if (__atomic_load_n(&replay_capacity, __ATOMIC_RELAXED) == 0) {
+    return 0;
+  }
+
+  *key = replay_key(dpdata, password);
+
+  struct replay_shard *shard = replay_shard(*key);
+  uint64_t now = replay_now();
+  int hit = 0;
+
+  pthread_mutex_lock(&shard->lock);
+
+  if (shard->entries) {
+    struct replay_entry *set = replay_set(shard, *key);
+
+    for (int i = 0; i < REPLAY_WAYS; i++) {
+      if (set[i].key == *key && set[i].expires > now) {
+        set[i].used = ++shard->tick;
+
+        if (set[i].accepted) {
+          shard->replays++;
+        } else {
+          shard->rejects++;
+        }
+
+        *result = REPLAY_INVALID;
+
+        hit = 1;
+        break;
+      }
+    }
+
+    if (!hit) shard->misses++;
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+
+  if (hit) {
+    vacman_audit_verify(dpdata, kernel_parms, *result);
+  }
+
+  return hit;
+}
+
+/*
+ * Returns the TTL of an entry for the given token, in nanoseconds. The token
+ * time step is read only for an accepted OTP.
+ */
+static uint64_t replay_entry_ttl(TDigipassBlob *dpdata, TKernelParms *kernel_parms, int accepted) {
+  if (replay_ttl) {
+    return replay_ttl;
+  }
+
+  if (!accepted) {
+    return REPLAY_DEFAULT_TTL * 1000000000ULL;
+  }
+
+  aat_ascii value[64];
+  long time_step = 0;
+
+  uint64_t start = vacman_stats_start();
+  aat_int32 result = AAL2GetTokenProperty(dpdata, kernel_parms, TIME_STEP, value);
+  vacman_stats_record(STAT_GET_TOKEN_PROPERTY, start, result);
+
+  if (result == 0) {
+    time_step = strtol(value, NULL, 10);
+  }
+
+  if (time_step <= 0 || kernel_parms->ITimeWindow <= 0) {
+    return REPLAY_DEFAULT_TTL * 1000000000ULL;
+  }
+
+  return (uint64_t)time_step * kernel_parms->ITimeWindow * 1000000000ULL;
+}
+
+/*
+ * Stores the result of the verification of the OTP with the given key, as
+ * returned by vacman_replay_lookup(), on the given token. Does not use any
+ * Ruby API.
+ */
+void vacman_replay_store(uint64_t key, aat_int32 result, TDigipassBlob *dpdata, TKernelParms *kernel_parms) {
+  if (key == 0 || (result != 0 && result != REPLAY_INVALID)) {
+    return;
+  }
+
+  uint64_t now = replay_now();
+  uint64_t expires = now + replay_entry_ttl(dpdata, kernel_parms, result == 0);
+
+  struct replay_shard *shard = replay_shard(key);
+
+  pthread_mutex_lock(&shard->lock);
+
+  if (shard->entries) {
+    struct replay_entry *set = replay_set(shard, key);
+    struct replay_entry *victim = &set[0];
+
+    for (int i = 0; i < REPLAY_WAYS; i++) {
+      if (set[i].key == key || set[i].key == 0 || set[i].expires <= now) {
+        victim = &set[i];
+        break;
+      }
+
+      if (set[i].used < victim->used) {
+        victim = &set[i];
+      }
+    }
+
+    if (victim->key != 0 && victim->key != key && victim->expires > now) {
+      shard->evictions++;
+    }
+
+    victim->key      = key;
+    victim->expires  = expires;
+    victim->used     = ++shard->tick;
+    victim->accepted = result == 0;
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+}
+
+
+/*
+ * LowLevel.configure_replay_cache(capacity, ttl)
+ *
+ * Sizes the cache to hold about capacity OTPs, 0 disabling it, and sets the
+ * time entries are kept for, in seconds, 0 meaning ITimeWindow time steps
+ * of the token. The cache is cleared.
+ */
+static VALUE vacman_replay_configure(VALUE module, VALUE rbcapacity, VALUE rbttl) {
+  long capacity = NUM2LONG(rbcapacity);
+  long ttl      = NUM2LONG(rbttl);
+
+  if (capacity < 0) {
+    rb_raise(rb_eArgError, "invalid replay cache capacity given: %ld", capacity);
+  }
+
+  if (ttl < 0) {
+    rb_raise(rb_eArgError, "invalid replay cache TTL given: %ld", ttl);
+  }
+
+  long sets = (capacity + REPLAY_SHARDS * REPLAY_WAYS - 1) / (REPLAY_SHARDS * REPLAY_WAYS);
+  int nomem = 0;
+
+  /* Disable lookups while the shards are resized */
+  __atomic_store_n(&replay_capacity, 0, __ATOMIC_RELAXED);
+
+  for (int i = 0; i < REPLAY_SHARDS; i++) {
+    struct replay_shard *shard = &replay_shards[i];
+
+    pthread_mutex_lock(&shard->lock);
+
+    free(shard->entries);
+    shard->entries = NULL;
+    shard->sets    = 0;
+
+    if (sets > 0 && !nomem) {
+      shard->entries = calloc(sets * REPLAY_WAYS, sizeof(struct replay_entry));
+
+      if (shard->entries) {
+        shard->sets = sets;
+      } else {
+        nomem = 1;
+      }
+    }
+
+    shard->tick = shard->replays = shard->rejects = shard->misses = shard->evictions = 0;
+
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  if (nomem) {
+    for (int i = 0; i < REPLAY_SHARDS; i++) {
+      struct replay_shard *shard = &replay_shards[i];
+
+      pthread_mutex_lock(&shard->lock);
+      free(shard->entries);
+      shard->entries = NULL;
+      shard->sets    = 0;
+      pthread_mutex_unlock(&shard->lock);
+    }
+
+    rb_memerror();
+  }
+
+  replay_ttl = (uint64_t)ttl * 1000000000ULL;
+  __atomic_store_n(&replay_capacity, sets * REPLAY_SHARDS * REPLAY_WAYS, __ATOMIC_RELAXED);
+
+  return Qnil;
+}
+
+/*
+ * LowLevel.replay_cache_stats
+ *
+ * Returns the cache capacity, the number of live entries, and the number
+ * of replays and rejects answered from the cache, of misses and of entries
+ * evicted before their expiry.
+ */
+static VALUE vacman_replay_stats(VALUE module) {
+  uint64_t replays = 0, rejects = 0, misses = 0, evictions = 0, entries = 0;
+  uint64_t now = replay_now();
+
+  for (int i = 0; i < REPLAY_SHARDS; i++) {
+    struct replay_shard *shard = &replay_shards[i];
+
+    pthread_mutex_lock(&shard->lock);
+
+    replays   += shard->replays;
+    rejects   += shard->rejects;
+    misses    += shard->misses;
+    evictions += shard->evictions;
+
+    for (long j = 0; j < shard->sets * REPLAY_WAYS; j++) {
+      if (shard->entries[j].key != 0 && shard->entries[j].expires > now) {
+        entries++;
+      }
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  VALUE ret = rb_hash_new();
+
+  rb_hash_aset(ret, rb_str_new2("capacity"),  LONG2NUM(__atomic_load_n(&replay_capacity, __ATOMIC_RELAXED)));
+  rb_hash_aset(ret, rb_str_new2("entries"),   ULL2NUM(entries));
+  rb_hash_aset(ret, rb_str_new2("replays"),   ULL2NUM(replays));
+  rb_hash_aset(ret, rb_str_new2("rejects"),   ULL2NUM(rejects));
+  rb_hash_aset(ret, rb_str_new2("misses"),    ULL2NUM(misses));
+  rb_hash_aset(ret, rb_str_new2("evictions"), ULL2NUM(evictions));
+
+  return ret;
+}
+
+/*
+ * LowLevel.clear_replay_cache
+ */
+static VALUE vacman_replay_clear(VALUE module) {
+  for (int i = 0; i < REPLAY_SHARDS; i++) {
+    struct replay_shard *shard = &replay_shards[i];
+
+    pthread_mutex_lock(&shard->lock);
+
+    if (shard->entries) {
+      memset(shard->entries, 0, shard->sets * REPLAY_WAYS * sizeof(struct replay_entry));
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  return Qnil;
+}
+
+
+/*
+ * Define the replay cache methods
+ */
+void vacman_replay_init(VALUE lowlevel) {
+  for (int i = 0; i < REPLAY_SHARDS; i++) {
+    pthread_mutex_init(&replay_shards[i].lock, NULL);
+  }
+
+  replay_seed = 0xcbf29ce484222325ULL ^ replay_now() ^ ((uint64_t)getpid() << 32);
+
+  rb_define_singleton_method(lowlevel, "configure_replay_cache", vacman_replay_configure, 2);
+  rb_define_singleton_method(lowlevel, "replay_cache_stats",     vacman_replay_stats, 0);
+  rb_define_singleton_method(lowlevel, "clear_replay_cache",     vacman_replay_clear, 0);
+}
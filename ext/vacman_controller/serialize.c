@@ -9,30 +9,85 @@
  */
 #include "vacman_controller.h"
 
-static VALUE rbhash_get_key(VALUE token, const char *property, int type);
+/*
+ * Token hash keys, created once as frozen strings, so that neither the
+ * lookups nor the writes into the token hash allocate a new key string.
+ */
+static VALUE key_blob     = Qnil;
+static VALUE key_serial   = Qnil;
+static VALUE key_app_name = Qnil;
+static VALUE key_flags1   = Qnil;
+static VALUE key_flags2   = Qnil;
+static VALUE key_sv       = Qnil;
+static VALUE key_sv_digest = Qnil;
+
+static VALUE rbhash_get_key(VALUE token, VALUE key, int type);
+static void rbhash_set_str(VALUE hash, VALUE key, const char *value, size_t len);
+static void rbhash_set_int(VALUE hash, VALUE key, int value);
+
+static VALUE serialize_key(VALUE *key, const char *name) {
+  *key = VACMAN_SHAREABLE(rb_obj_freeze(rb_str_new_cstr(name)));
+  rb_gc_register_address(key);
+
+  return *key;
+}
+
+/*
+ * Create the token hash keys
+ */
+void vacman_serialize_init(void) {
+  serialize_key(&key_blob,     "blob");
+  serialize_key(&key_serial,   "serial");
+  serialize_key(&key_app_name, "app_name");
+  serialize_key(&key_flags1,   "flags1");
+  serialize_key(&key_flags2,   "flags2");
+  serialize_key(&key_sv,       "sv");
+  serialize_key(&key_sv_digest, "sv_digest");
+}
 
 /*
  * Convert a Ruby Hash with the required keys to a TDigipassBlob structure.
+ *
+ * A native Digipass is accepted as well, and it is just copied over.
  */
 void vacman_rbhash_to_digipass(VALUE token, TDigipassBlob* dpdata) {
+  uint64_t start = vacman_stats_start();
+  struct vacman_digipass *digipass = vacman_digipass_get(token);
+
+  if (digipass) {
+    memcpy(dpdata, &digipass->dpdata, sizeof(*dpdata));
+    vacman_stats_record(STAT_MARSHAL, start, 0);
+    return;
+  }
+
   if (!RB_TYPE_P(token, T_HASH)) {
     rb_raise(e_VacmanError, "invalid token object given, requires an hash");
     return;
   }
 
-  VALUE blob     = rbhash_get_key(token, "blob",     T_STRING);
-  VALUE serial   = rbhash_get_key(token, "serial",   T_STRING);
-  VALUE app_name = rbhash_get_key(token, "app_name", T_STRING);
-  VALUE flag1    = rbhash_get_key(token, "flags1",   T_FIXNUM);
-  VALUE flag2    = rbhash_get_key(token, "flags2",   T_FIXNUM);
+  VALUE blob     = rbhash_get_key(token, key_blob,     T_STRING);
+  VALUE serial   = rbhash_get_key(token, key_serial,   T_STRING);
+  VALUE app_name = rbhash_get_key(token, key_app_name, T_STRING);
+  VALUE flag1    = rbhash_get_key(token, key_flags1,   T_FIXNUM);
+  VALUE flag2    = rbhash_get_key(token, key_flags2,   T_FIXNUM);
 
   memset(dpdata, 0, sizeof(*dpdata));
 
-  strcpy(dpdata->Blob, rb_string_value_cstr(&blob));
+  const char *blob_ptr = rb_string_value_cstr(&blob);
+  long blob_len = RSTRING_LEN(blob);
+
+  if (blob_len > (long)sizeof(dpdata->Blob)) {
+    rb_raise(e_VacmanError, "invalid token object given: blob is %ld bytes long, at most %d allowed",
+             blob_len, (int)sizeof(dpdata->Blob));
+  }
+
+  memcpy(dpdata->Blob, blob_ptr, blob_len);
   strncpy(dpdata->Serial, rb_string_value_cstr(&serial), sizeof(dpdata->Serial));
   strncpy(dpdata->AppName, rb_string_value_cstr(&app_name), sizeof(dpdata->AppName));
   dpdata->DPFlags[0] = rb_fix2int(flag1);
   dpdata->DPFlags[1] = rb_fix2int(flag2);
+
+  vacman_stats_record(STAT_MARSHAL, start, 0);
 }
 
 /*
@@ -53,44 +108,98 @@ void vacman_rbhash_to_digipass(VALUE token, TDigipassBlob* dpdata) {
 void vacman_rbhash_to_digipass_sv(VALUE token, TDigipassBlob* dpdata, aat_ascii* dpsv, aat_int32 dpsv_len) {
   vacman_rbhash_to_digipass(token, dpdata);
 
-  VALUE sv = rbhash_get_key(token, "sv", T_STRING);
+  VALUE sv = vacman_rbhash_fetch_sv(token);
 
   strncpy(dpsv, rb_string_value_cstr(&sv), dpsv_len);
 }
 
+/*
+ * Returns the static vector of the given token hash or Digipass, and raises
+ * an Error if it has none.
+ */
+VALUE vacman_rbhash_fetch_sv(VALUE token) {
+  struct vacman_digipass *digipass = vacman_digipass_get(token);
+  VALUE sv;
+
+  if (digipass) {
+    sv = digipass->sv;
+
+    if (NIL_P(sv)) {
+      rb_raise(e_VacmanError, "invalid token object given: sv property is nil");
+    }
+  } else {
+    sv = vacman_rbhash_get_sv(token);
+
+    if (NIL_P(sv)) {
+      sv = rbhash_get_key(token, key_sv, T_STRING);
+    }
+  }
+
+  return sv;
+}
+
 /*
  * Convert a TDigipassBlob structure into a Ruby Hash.
+ *
+ * Only the values that differ from the ones already in the hash are written,
+ * so that a call that did not change the token does not allocate anything.
+ *
+ * If a native Digipass is given in place of the Hash, the structure is just
+ * copied into it, and the Digipass is flagged as dirty if it changed.
  */
 void vacman_digipass_to_rbhash(TDigipassBlob* dpdata, VALUE hash) {
-  char buffer[256];
+  uint64_t start = vacman_stats_start();
+  struct vacman_digipass *digipass = vacman_digipass_get(hash);
+
+  if (digipass) {
+    if (memcmp(&digipass->dpdata, dpdata, sizeof(*dpdata)) != 0) {
+      memcpy(&digipass->dpdata, dpdata, sizeof(*dpdata));
+      digipass->dirty = 1;
+    }
 
-  memset(buffer, 0, sizeof(buffer));
-  strncpy(buffer, dpdata->Serial, 10);
-  rb_hash_aset(hash, rb_str_new2("serial"), rb_str_new2(buffer));
+    vacman_stats_record(STAT_UNMARSHAL, start, 0);
+    return;
+  }
 
-  memset(buffer, 0, sizeof(buffer));
-  strncpy(buffer, dpdata->AppName, 12);
-  rb_hash_aset(hash, rb_str_new2("app_name"), rb_str_new2(buffer));
+  rbhash_set_str(hash, key_serial,   dpdata->Serial,  strnlen(dpdata->Serial,  sizeof(dpdata->Serial)));
+  rbhash_set_str(hash, key_app_name, dpdata->AppName, strnlen(dpdata->AppName, sizeof(dpdata->AppName)));
+  rbhash_set_str(hash, key_blob,     dpdata->Blob,    strnlen(dpdata->Blob,    sizeof(dpdata->Blob)));
 
-  memset(buffer, 0, sizeof(buffer));
-  strncpy(buffer, dpdata->Blob, 224);
-  rb_hash_aset(hash, rb_str_new2("blob"), rb_str_new2(buffer));
+  rbhash_set_int(hash, key_flags1, dpdata->DPFlags[0]);
+  rbhash_set_int(hash, key_flags2, dpdata->DPFlags[1]);
 
-  rb_hash_aset(hash, rb_str_new2("flags1"), rb_fix_new(dpdata->DPFlags[0]));
-  rb_hash_aset(hash, rb_str_new2("flags2"), rb_fix_new(dpdata->DPFlags[1]));
+  vacman_stats_record(STAT_UNMARSHAL, start, 0);
 }
 
 /*
- * Convert the given TDigipassBlob and the given token static vector into a
- * Ruby hash.
+ * Returns the static vector from the given token hash, or nil if absent.
  *
- * Calls vacman_digipass_to_rbhash() and then adds to it the additional "sv"
- * key with the token static vector passed in as a C string.
+ * A token hash may reference a registered static vector by its digest, in
+ * the sv_digest key, in place of carrying it in the sv key.
  */
-void vacman_digipass_to_rbhash_sv(TDigipassBlob* dpdata, aat_ascii* dpsv, VALUE hash) {
-  vacman_digipass_to_rbhash(dpdata, hash);
+VALUE vacman_rbhash_get_sv(VALUE hash) {
+  VALUE sv = rb_hash_lookup(hash, key_sv);
+
+  if (NIL_P(sv)) {
+    VALUE digest = rb_hash_lookup(hash, key_sv_digest);
+
+    if (!NIL_P(digest)) {
+      sv = vacman_sv_lookup(vacman_sv_digest_parse(digest));
+
+      if (NIL_P(sv)) {
+        rb_raise(e_VacmanError, "unknown static vector %"PRIsVALUE", register it first", digest);
+      }
+    }
+  }
 
-  rb_hash_aset(hash, rb_str_new2("sv"), rb_str_new2(dpsv));
+  return sv;
+}
+
+/*
+ * Sets the static vector in the given token hash.
+ */
+void vacman_rbhash_set_sv(VALUE hash, VALUE sv) {
+  rb_hash_aset(hash, key_sv, sv);
 }
 
 /*
@@ -103,18 +212,47 @@ void vacman_digipass_to_rbhash_sv(TDigipassBlob* dpdata, aat_ascii* dpsv, VALUE
  * Otherwise, the value corresponding to the key is returned.
  *
  */
-static VALUE rbhash_get_key(VALUE token, const char *property, int type) {
-  VALUE ret = rb_hash_aref(token, rb_str_new2(property));
+static VALUE rbhash_get_key(VALUE token, VALUE key, int type) {
+  VALUE ret = rb_hash_aref(token, key);
 
   if (ret == Qnil) {
-    rb_raise(e_VacmanError, "invalid token object given: %s property is nil", property);
+    rb_raise(e_VacmanError, "invalid token object given: %s property is nil", RSTRING_PTR(key));
     return Qnil;
   }
 
   if (!RB_TYPE_P(ret, type)) {
-    rb_raise(e_VacmanError, "invalid token object given: %s property is not of the correct type", property);
+    rb_raise(e_VacmanError, "invalid token object given: %s property is not of the correct type", RSTRING_PTR(key));
     return Qnil;
   }
 
   return ret;
 }
+
+/*
+ * Sets the given string value into the given hash, unless the value already
+ * stored there has the same bytes.
+ */
+static void rbhash_set_str(VALUE hash, VALUE key, const char *value, size_t len) {
+  VALUE current = rb_hash_lookup(hash, key);
+
+  if (RB_TYPE_P(current, T_STRING) && (size_t)RSTRING_LEN(current) == len &&
+      memcmp(RSTRING_PTR(current), value, len) == 0) {
+    return;
+  }
+
+  rb_hash_aset(hash, key, rb_str_new(value, len));
+}
+
+/*
+ * Sets the given integer value into the given hash, unless it is already
+ * stored there.
+ */
+static void rbhash_set_int(VALUE hash, VALUE key, int value) {
+  VALUE rbval = INT2FIX(value);
+
+  if (rb_hash_lookup(hash, key) == rbval) {
+    return;
+  }
+
+  rb_hash_aset(hash, key, rbval);
+}
@@ -0,0 +1,278 @@
+/*
+ * Vacman Controller wrapper
+ *
+ * This Ruby Extension wraps the VASCO Vacman Controller
+ * library and makes its API accessible to Ruby code.
+ *
+ * (C) 2013 https://github.com/mlankenau
+ * (C) 2019 m.barnaba@ifad.org
+ */
+#include "vacman_controller.h"
+#include <time.h>
+
+/*
+ * Call counters, error code tallies and latency histograms for the AAL2
+ * calls and for the token marshalling.
+ *
+ * Recording is disabled by default, and costs a branch when disabled. It
+ * is enabled via LowLevel.stats_enabled = true, or by setting the
+ * VACMAN_CONTROLLER_STATS environment variable.
+ *
+ * Records are taken from any thread, with or without the GVL, so they only
+ * use relaxed atomic increments: every counter is exact, but a snapshot
+ * taken while calls are running may be a few calls behind across counters.
+ *
+ * Latencies are kept in log-linear buckets, HDR-style: each power of two
+ * is split into STATS_SUB_BUCKETS linear buckets, so that the relative
+ * error of a percentile is bounded to 1/STATS_SUB_BUCKETS at any scale.
+ */
+#define STATS_SUB_BITS     2
+#define STATS_SUB_BUCKETS  (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS      (48 * STATS_SUB_BUCKETS)   /* Up to ~39 hours */
+#define STATS_ERROR_CODES  16
+
+#define STATS_ADD(var, val) __atomic_fetch_add(&(var), (val), __ATOMIC_RELAXED)
+#define STATS_GET(var)      __atomic_load_n(&(var), __ATOMIC_RELAXED)
+#define STATS_SET(var, val) __atomic_store_n(&(var), (val), __ATOMIC_RELAXED)
+
+struct stats_error_code {
+  aat_int32 code;       /* 0 if the slot is free */
+  uint64_t  count;
+};
+
+struct stats_entry {
+  uint64_t calls;
+  uint64_t errors;
+  uint64_t other_errors; /* Errors with a code that did not fit in the tally */
+  uint64_t total_ns;
+  struct stats_error_code error_codes[STATS_ERROR_CODES];
+  uint64_t buckets[STATS_BUCKETS];
+} __attribute__((aligned(64)));
+
+static struct stats_entry vacman_stats[STAT_COUNT];
+
+static const char *vacman_stats_names[STAT_COUNT] = {
+  "AAL2VerifyPassword",
+  "AAL2GenPassword",
+  "AAL2GetTokenProperty",
+  "AAL2SetTokenProperty",
+  "AAL2ChangeStaticPassword",
+  "AAL2ResetTokenInfo",
+  "AAL2DPXInit",
+  "AAL2DPXGetStaticVector",
+  "AAL2DPXGetToken",
+  "AAL2GenActivationCodeXErc",
+  "marshal",
+  "unmarshal",
+};
+
+static int vacman_stats_enabled = 0;
+
+static uint64_t stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Returns the bucket for the given latency
+ */
+static int stats_bucket(uint64_t ns) {
+  if (ns < STATS_SUB_BUCKETS) {
+    return (int)ns;
+  }
+
+  int msb = 63 - __builtin_clzll(ns);
+  int bucket = (msb - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS +
+               (int)((ns >> (msb - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1));
+
+  return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+/*
+ * Returns the lowest latency that falls in the given bucket
+ */
+static uint64_t stats_bucket_floor(int bucket) {
+  if (bucket < STATS_SUB_BUCKETS) {
+    return bucket;
+  }
+
+  int shift = bucket / STATS_SUB_BUCKETS - 1;
+  uint64_t sub = STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS;
+
+  return sub << shift;
+}
+
+static void stats_error(struct stats_entry *entry, aat_int32 code) {
+  STATS_ADD(entry->errors, 1);
+
+  for (int i = 0; i < STATS_ERROR_CODES; i++) {
+    struct stats_error_code *slot = &entry->error_codes[i];
+    aat_int32 slot_code = STATS_GET(slot->code);
+
+    if (slot_code == 0) {
+      aat_int32 free_code = 0;
+
+      if (__atomic_compare_exchange_n(&slot->code, &free_code, code, 0,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        slot_code = code;
+      } else {
+        slot_code = free_code; /* Claimed meanwhile by another thread */
+      }
+    }
+
+    if (slot_code == code) {
+      STATS_ADD(slot->count, 1);
+      return;
+    }
+  }
+
+  STATS_ADD(entry->other_errors, 1);
+}
+
+/*
+ * Returns the start time of a call to be recorded, or 0 if recording is
+ * disabled. Safe to call without the GVL.
+ */
+uint64_t vacman_stats_start(void) {
+  if (!STATS_GET(vacman_stats_enabled)) {
+    return 0;
+  }
+
+  return stats_now();
+}
+
+/*
+ * Records a call started at the given time, that returned the given AAL2
+ * result code, 0 meaning success. Safe to call without the GVL.
+ */
+void vacman_stats_record(enum vacman_stat stat, uint64_t start, aat_int32 result) {
+  if (start == 0) {
+    return;
+  }
+
+  struct stats_entry *entry = &vacman_stats[stat];
+  uint64_t elapsed = stats_now() - start;
+
+  STATS_ADD(entry->calls, 1);
+  STATS_ADD(entry->total_ns, elapsed);
+  STATS_ADD(entry->buckets[stats_bucket(elapsed)], 1);
+
+  if (result != 0) {
+    stats_error(entry, result);
+  }
+}
+
+
+/*
+ * LowLevel.stats
+ *
+ * Returns an Hash keyed by AAL2 function name, with the number of calls,
+ * errors, an Hash of error code => count, the total time spent and the
+ * latency histogram as an Array of [from_ns, to_ns, count] for each
+ * non-empty bucket.
+ */
+static VALUE vacman_stats_get(VALUE module) {
+  VALUE ret = rb_hash_new();
+
+  for (int i = 0; i < STAT_COUNT; i++) {
+    struct stats_entry *entry = &vacman_stats[i];
+    VALUE stat = rb_hash_new();
+    VALUE error_codes = rb_hash_new();
+    VALUE histogram = rb_ary_new();
+
+    rb_hash_aset(stat, rb_str_new2("calls"),    ULL2NUM(STATS_GET(entry->calls)));
+    rb_hash_aset(stat, rb_str_new2("errors"),   ULL2NUM(STATS_GET(entry->errors)));
+    rb_hash_aset(stat, rb_str_new2("total_ns"), ULL2NUM(STATS_GET(entry->total_ns)));
+
+    for (int j = 0; j < STATS_ERROR_CODES; j++) {
+      aat_int32 code = STATS_GET(entry->error_codes[j].code);
+
+      if (code != 0) {
+        rb_hash_aset(error_codes, INT2FIX(code), ULL2NUM(STATS_GET(entry->error_codes[j].count)));
+      }
+    }
+
+    if (STATS_GET(entry->other_errors) > 0) {
+      rb_hash_aset(error_codes, ID2SYM(rb_intern("other")), ULL2NUM(STATS_GET(entry->other_errors)));
+    }
+
+    rb_hash_aset(stat, rb_str_new2("error_codes"), error_codes);
+
+    for (int j = 0; j < STATS_BUCKETS; j++) {
+      uint64_t count = STATS_GET(entry->buckets[j]);
+
+      if (count > 0) {
+        rb_ary_push(histogram, rb_ary_new3(3,
+              ULL2NUM(stats_bucket_floor(j)),
+              ULL2NUM(stats_bucket_floor(j + 1)),
+              ULL2NUM(count)));
+      }
+    }
+
+    rb_hash_aset(stat, rb_str_new2("histogram"), histogram);
+
+    rb_hash_aset(ret, rb_str_new2(vacman_stats_names[i]), stat);
+  }
+
+  return ret;
+}
+
+/*
+ * LowLevel.reset_stats
+ */
+static VALUE vacman_stats_reset(VALUE module) {
+  for (int i = 0; i < STAT_COUNT; i++) {
+    struct stats_entry *entry = &vacman_stats[i];
+
+    STATS_SET(entry->calls, 0);
+    STATS_SET(entry->errors, 0);
+    STATS_SET(entry->other_errors, 0);
+    STATS_SET(entry->total_ns, 0);
+
+    for (int j = 0; j < STATS_ERROR_CODES; j++) {
+      STATS_SET(entry->error_codes[j].count, 0);
+      STATS_SET(entry->error_codes[j].code, 0);
+    }
+
+    for (int j = 0; j < STATS_BUCKETS; j++) {
+      STATS_SET(entry->buckets[j], 0);
+    }
+  }
+
+  return Qnil;
+}
+
+/*
+ * LowLevel.stats_enabled
+ */
+static VALUE vacman_stats_get_enabled(VALUE module) {
+  return STATS_GET(vacman_stats_enabled) ? Qtrue : Qfalse;
+}
+
+/*
+ * LowLevel.stats_enabled = true or false
+ */
+static VALUE vacman_stats_set_enabled(VALUE module, VALUE enabled) {
+  STATS_SET(vacman_stats_enabled, RTEST(enabled) ? 1 : 0);
+
+  return enabled;
+}
+
+
+/*
+ * Define the stats methods
+ */
+void vacman_stats_init(VALUE lowlevel) {
+  const char *env = getenv("VACMAN_CONTROLLER_STATS");
+
+  if (env && *env && strcmp(env, "0") != 0) {
+    vacman_stats_enabled = 1;
+  }
+
+  rb_define_singleton_method(lowlevel, "stats",          vacman_stats_get, 0);
+  rb_define_singleton_method(lowlevel, "reset_stats",    vacman_stats_reset, 0);
+  rb_define_singleton_method(lowlevel, "stats_enabled",  vacman_stats_get_enabled, 0);
+  rb_define_singleton_method(lowlevel, "stats_enabled=", vacman_stats_set_enabled, 1);
+}
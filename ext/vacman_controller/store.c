@@ -0,0 +1,897 @@
+/*
+ * Vacman Controller wrapper
+ *
+ * This Ruby Extension wraps the VASCO Vacman Controller
+ * library and makes its API accessible to Ruby code.
+ *
+ * (C) 2013 https://github.com/mlankenau
+ * (C) 2019 m.barnaba@ifad.org
+ */
+#include "vacman_controller.h"
+#include <ruby/thread.h>
+
+/*
+ * VacmanController::LowLevel::TokenStore keeps token blobs in memory,
+ * keyed by serial number and application name, so that verifications do
+ * not need to load and save the token every time.
+ *
+ * The store is split into shards, each one with its own mutex guarding its
+ * hash table. The mutexes are only held for a few instructions, never while
+ * calling AAL2, allocating Ruby objects or waiting for the GVL.
+ *
+ * Every record is locked on its own via its busy flag: a verification owns
+ * the record for the duration of the AAL2 call, and works on its blob in
+ * place without the GVL, so different tokens verify in parallel and the
+ * verifications of the same token are serialised. A thread waiting for a
+ * busy record sleeps on the shard condition variable, without the GVL, and
+ * can be interrupted.
+ *
+ * Records whose blob changed are linked into the dirty list of their shard,
+ * that #flush hands to Ruby in batches for persistence.
+ *
+ * Records and tables are allocated with malloc(), so that they can be
+ * handled without the GVL, and their static vectors are interned, so they
+ * are kept alive by the registry (sv.c) and need no marking.
+ */
+static VALUE c_TokenStore;
+
+struct store_record {
+  struct store_record *next;        /* In the hash bin */
+  struct store_record *next_dirty;  /* In the dirty list */
+  uint64_t             hash;
+  char                 key[VACMAN_TOKEN_KEY_SIZE];
+  TDigipassBlob        dpdata;
+  VALUE                sv;          /* Interned static vector, or nil */
+  VALUE                owner;       /* Thread in #lock, only compared */
+  long                 users;       /* Threads owning or waiting for it */
+  unsigned             busy:1;      /* Owned by a thread */
+  unsigned             dirty:1;     /* Changed since it was last flushed */
+  unsigned             listed:1;    /* In the dirty list */
+  unsigned             deleted:1;   /* Removed, freed once unused */
+};
+
+struct store_shard {
+  pthread_mutex_t       lock;
+  pthread_cond_t        released;   /* A record is no longer busy */
+  struct store_record **bins;
+  long                  capacity;   /* Number of bins, a power of two */
+  long                  count;
+  struct store_record  *dirty;
+} __attribute__((aligned(64)));
+
+struct vacman_store {
+  struct store_shard *shards;
+  long                count;        /* A power of two */
+};
+
+/*
+ * Builds the record key from the given serial number and application name,
+ * zero padded as in the blob.
+ */
+void vacman_token_key(VALUE serial, VALUE app_name, char *key) {
+  StringValue(serial);
+  StringValue(app_name);
+
+  if (RSTRING_LEN(serial) > (long)VACMAN_SERIAL_SIZE) {
+    rb_raise(rb_eArgError, "invalid serial given: %"PRIsVALUE, serial);
+  }
+
+  if (RSTRING_LEN(app_name) > (long)VACMAN_APP_NAME_SIZE) {
+    rb_raise(rb_eArgError, "invalid app name given: %"PRIsVALUE, app_name);
+  }
+
+  memset(key, 0, VACMAN_TOKEN_KEY_SIZE);
+  memcpy(key, RSTRING_PTR(serial), RSTRING_LEN(serial));
+  memcpy(key + VACMAN_SERIAL_SIZE, RSTRING_PTR(app_name), RSTRING_LEN(app_name));
+}
+
+/*
+ * Builds the record key of the given blob
+ */
+void vacman_token_blob_key(const TDigipassBlob *dpdata, char *key) {
+  memcpy(key, dpdata->Serial, VACMAN_SERIAL_SIZE);
+  memcpy(key + VACMAN_SERIAL_SIZE, dpdata->AppName, VACMAN_APP_NAME_SIZE);
+}
+
+static uint64_t store_hash(const char *key) {
+  return vacman_sv_digest(key, VACMAN_TOKEN_KEY_SIZE);
+}
+
+/* The high bits pick the shard, the low ones the bin */
+static struct store_shard *store_shard(struct vacman_store *store, uint64_t hash) {
+  return &store->shards[(hash >> 32) & (store->count - 1)];
+}
+
+/*
+ * Looks up the record with the given key, with the shard lock held.
+ */
+static struct store_record *store_lookup(struct store_shard *shard, uint64_t hash, const char *key) {
+  struct store_record *record = shard->bins[hash & (shard->capacity - 1)];
+
+  while (record && (record->hash != hash || memcmp(record->key, key, VACMAN_TOKEN_KEY_SIZE) != 0)) {
+    record = record->next;
+  }
+
+  return record;
+}
+
+/*
+ * Inserts the given record, with the shard lock held, doubling the bins
+ * when there are as many records. Returns 0 if out of memory.
+ */
+static int store_insert(struct store_shard *shard, struct store_record *record) {
+  if (shard->count >= shard->capacity) {
+    long capacity = shard->capacity * 2;
+    struct store_record **bins = calloc(capacity, sizeof(*bins));
+
+    if (bins == NULL) {
+      return 0;
+    }
+
+    for (long i = 0; i < shard->capacity; i++) {
+      struct store_record *next;
+
+      for (struct store_record *r = shard->bins[i]; r; r = next) {
+        next = r->next;
+        r->next = bins[r->hash & (capacity - 1)];
+        bins[r->hash & (capacity - 1)] = r;
+      }
+    }
+
+    free(shard->bins);
+    shard->bins     = bins;
+    shard->capacity = capacity;
+  }
+
+  struct store_record **bin = &shard->bins[record->hash & (shard->capacity - 1)];
+
+  record->next = *bin;
+  *bin = record;
+  shard->count++;
+
+  return 1;
+}
+
+static void store_remove(struct store_shard *shard, struct store_record *record) {
+  struct store_record **link = &shard->bins[record->hash & (shard->capacity - 1)];
+
+  while (*link != record) {
+    link = &(*link)->next;
+  }
+
+  *link = record->next;
+  shard->count--;
+}
+
+/*
+ * Frees the given record if it was deleted and nothing refers to it any
+ * more, with the shard lock held.
+ */
+static void store_maybe_free(struct store_record *record) {
+  if (record->deleted && record->users == 0 && !record->listed) {
+    free(record);
+  }
+}
+
+/*
+ * Gives up the given record, with the shard lock held, listing it for the
+ * next flush if it is dirty, and wakes up whoever waits for it.
+ */
+static void store_release(struct store_shard *shard, struct store_record *record) {
+  record->busy  = 0;
+  record->owner = Qnil;
+  record->users--;
+
+  if (record->dirty && !record->listed && !record->deleted) {
+    record->next_dirty = shard->dirty;
+    record->listed     = 1;
+    shard->dirty       = record;
+  }
+
+  pthread_cond_broadcast(&shard->released);
+  store_maybe_free(record);
+}
+
+
+/*
+ * Acquisition of a record without the GVL
+ */
+enum store_status {
+  STORE_INTERRUPTED,  /* Woken up by Ruby, or not run at all */
+  STORE_NOT_FOUND,
+  STORE_ACQUIRED,
+};
+
+struct store_acquire_args {
+  struct store_shard  *shard;
+  uint64_t             hash;
+  const char          *key;
+  VALUE                owner;
+  int                  interrupted;
+  enum store_status    status;
+  struct store_record *record;
+
+  /* For verifications: the record is given up before returning */
+  TKernelParms        *kernel_parms;
+  aat_ascii           *password;
+  aat_int32            result;
+};
+
+/*
+ * Waits until the record is not busy, and takes it. Called and returns
+ * with the shard lock held.
+ */
+static void store_acquire_locked(struct store_acquire_args *args) {
+  struct store_shard *shard = args->shard;
+  struct store_record *record = store_lookup(shard, args->hash, args->key);
+
+  if (record == NULL) {
+    args->status = STORE_NOT_FOUND;
+    return;
+  }
+
+  record->users++;
+
+  while (record->busy && !args->interrupted) {
+    pthread_cond_wait(&shard->released, &shard->lock);
+  }
+
+  if (record->busy) {
+    record->users--;
+    store_maybe_free(record);
+    args->status = STORE_INTERRUPTED;
+    return;
+  }
+
+  if (record->deleted) {
+    record->users--;
+    store_maybe_free(record);
+    args->status = STORE_NOT_FOUND;
+    return;
+  }
+
+  record->busy   = 1;
+  record->owner  = args->owner;
+  args->record   = record;
+  args->status   = STORE_ACQUIRED;
+}
+
+static void *store_acquire_nogvl(void *ptr) {
+  struct store_acquire_args *args = ptr;
+
+  pthread_mutex_lock(&args->shard->lock);
+  store_acquire_locked(args);
+  pthread_mutex_unlock(&args->shard->lock);
+
+  return NULL;
+}
+
+/*
+ * Takes the record and verifies the OTP against it in place, as
+ * verify_password_status does, then gives it up.
+ */
+static void *store_verify_nogvl(void *ptr) {
+  struct store_acquire_args *args = ptr;
+  struct store_shard *shard = args->shard;
+
+  pthread_mutex_lock(&shard->lock);
+  store_acquire_locked(args);
+  pthread_mutex_unlock(&shard->lock);
+
+  if (args->status != STORE_ACQUIRED) {
+    return NULL;
+  }
+
+  struct store_record *record = args->record;
+  TDigipassBlob before = record->dpdata;
+  uint64_t replay_key;
+
+  if (!vacman_replay_lookup(&record->dpdata, args->kernel_parms, args->password, &replay_key, &args->result)) {
+    args->result = vacman_window_verify(&record->dpdata, args->kernel_parms, args->password);
+    vacman_replay_store(replay_key, args->result, &record->dpdata, args->kernel_parms);
+  }
+
+  pthread_mutex_lock(&shard->lock);
+  if (memcmp(&before, &record->dpdata, sizeof(before)) != 0) {
+    record->dirty = 1;
+  }
+  store_release(shard, record);
+  pthread_mutex_unlock(&shard->lock);
+
+  return NULL;
+}
+
+static void store_acquire_ubf(void *ptr) {
+  struct store_acquire_args *args = ptr;
+
+  pthread_mutex_lock(&args->shard->lock);
+  args->interrupted = 1;
+  pthread_cond_broadcast(&args->shard->released);
+  pthread_mutex_unlock(&args->shard->lock);
+}
+
+/*
+ * Runs the given acquisition without the GVL, until it is not interrupted.
+ *
+ * rb_thread_call_without_gvl2() either runs the function to completion, or
+ * does not run it at all when an interrupt is pending, and never raises:
+ * so a record that was taken is always handed back to the caller. Pending
+ * interrupts are then handled here, with nothing held.
+ */
+static void store_acquire_run(void *(*func)(void *), struct store_acquire_args *args) {
+  for (;;) {
+    args->interrupted = 0;
+    args->status = STORE_INTERRUPTED;
+
+    rb_thread_call_without_gvl2(func, args, store_acquire_ubf, args);
+
+    if (args->status != STORE_INTERRUPTED) {
+      return;
+    }
+
+    rb_thread_check_ints();
+  }
+}
+
+
+static void store_free(void *ptr) {
+  struct vacman_store *store = ptr;
+
+  for (long i = 0; i < store->count; i++) {
+    struct store_shard *shard = &store->shards[i];
+
+    for (long j = 0; j < shard->capacity; j++) {
+      struct store_record *next;
+
+      for (struct store_record *record = shard->bins[j]; record; record = next) {
+        next = record->next;
+        free(record);
+      }
+    }
+
+    free(shard->bins);
+    pthread_cond_destroy(&shard->released);
+    pthread_mutex_destroy(&shard->lock);
+  }
+
+  free(store->shards);
+  xfree(store);
+}
+
+static size_t store_memsize(const void *ptr) {
+  const struct vacman_store *store = ptr;
+  size_t size = sizeof(*store) + store->count * sizeof(struct store_shard);
+
+  for (long i = 0; i < store->count; i++) {
+    size += store->shards[i].capacity * sizeof(struct store_record *) +
+            store->shards[i].count * sizeof(struct store_record);
+  }
+
+  return size;
+}
+
+static const rb_data_type_t vacman_store_type = {
+  "VacmanController::LowLevel::TokenStore",
+  { NULL, store_free, store_memsize, },
+  0, 0,
+  0,
+};
+
+static struct vacman_store *store_get(VALUE obj) {
+  struct vacman_store *store = rb_check_typeddata(obj, &vacman_store_type);
+
+  if (store->shards == NULL) {
+    rb_raise(e_VacmanError, "token store not initialized");
+  }
+
+  return store;
+}
+
+static VALUE store_alloc(VALUE klass) {
+  struct vacman_store *store;
+
+  return TypedData_Make_Struct(klass, struct vacman_store, &vacman_store_type, store);
+}
+
+/*
+ * Raises if the current thread holds the given record via #lock, as it
+ * would wait for itself forever.
+ */
+static void store_check_owner(struct store_shard *shard, uint64_t hash, const char *key) {
+  VALUE current = rb_thread_current();
+
+  pthread_mutex_lock(&shard->lock);
+  struct store_record *record = store_lookup(shard, hash, key);
+  int owned = record && record->busy && record->owner == current;
+  pthread_mutex_unlock(&shard->lock);
+
+  if (owned) {
+    rb_raise(e_VacmanError, "token already locked by the current thread");
+  }
+}
+
+
+/*
+ * TokenStore.new(shards)
+ *
+ * Builds an empty store split into the given number of shards, rounded up
+ * to a power of two.
+ */
+static VALUE vacman_store_initialize(VALUE self, VALUE rbshards) {
+  struct vacman_store *store = rb_check_typeddata(self, &vacman_store_type);
+  long shards = NUM2LONG(rbshards);
+
+  if (shards < 1 || shards > 65536) {
+    rb_raise(rb_eArgError, "invalid number of shards given: %ld", shards);
+  }
+
+  if (store->shards) {
+    rb_raise(e_VacmanError, "token store already initialized");
+  }
+
+  long count = 1;
+  while (count < shards) count *= 2;
+
+  struct store_shard *all = NULL;
+
+  if (posix_memalign((void **)&all, 64, count * sizeof(*all)) != 0) {
+    rb_memerror();
+  }
+
+  memset(all, 0, count * sizeof(*all));
+
+  for (long i = 0; i < count; i++) {
+    all[i].capacity = 16;
+    all[i].bins = calloc(all[i].capacity, sizeof(*all[i].bins));
+
+    if (all[i].bins == NULL) {
+      while (i-- > 0) free(all[i].bins);
+      free(all);
+      rb_memerror();
+    }
+
+    pthread_mutex_init(&all[i].lock, NULL);
+    pthread_cond_init(&all[i].released, NULL);
+  }
+
+  store->shards = all;
+  store->count  = count;
+
+  return self;
+}
+
+/*
+ * TokenStore#add(token)
+ *
+ * Adds the given token hash or Digipass, unless a token with the same
+ * serial number and application name is stored already. Returns whether
+ * it was added: a stored token is never overwritten, as it may hold
+ * changes that were not flushed yet.
+ */
+static VALUE vacman_store_add(VALUE self, VALUE token) {
+  struct vacman_store *store = store_get(self);
+  struct vacman_digipass *digipass = vacman_digipass_get(token);
+
+  TDigipassBlob dpdata;
+  VALUE sv;
+
+  if (digipass) {
+    dpdata = digipass->dpdata;
+    sv     = digipass->sv;
+  } else {
+    vacman_rbhash_to_digipass(token, &dpdata);
+    sv = vacman_rbhash_get_sv(token);
+
+    if (!NIL_P(sv)) {
+      sv = vacman_sv_intern(sv);
+    }
+  }
+
+  struct store_record *record = malloc(sizeof(*record));
+
+  if (record == NULL) {
+    rb_memerror();
+  }
+
+  memset(record, 0, sizeof(*record));
+  vacman_token_blob_key(&dpdata, record->key);
+  record->hash   = store_hash(record->key);
+  record->dpdata = dpdata;
+  record->sv     = sv;
+  record->owner  = Qnil;
+
+  struct store_shard *shard = store_shard(store, record->hash);
+  int added, nomem = 0;
+
+  pthread_mutex_lock(&shard->lock);
+  added = store_lookup(shard, record->hash, record->key) == NULL;
+  if (added) {
+    nomem = !store_insert(shard, record);
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  if (!added || nomem) {
+    free(record);
+  }
+
+  if (nomem) {
+    rb_memerror();
+  }
+
+  return added ? Qtrue : Qfalse;
+}
+
+/*
+ * TokenStore#verify(serial, app_name, password, params = nil)
+ *
+ * Verifies the given OTP against the stored token, in place, and returns
+ * the AAL2 result code, 0 meaning success, or nil if the token is not
+ * stored. Waits for the verifications of the same token running on other
+ * threads.
+ */
+static VALUE vacman_store_verify(int argc, VALUE *argv, VALUE self) {
+  VALUE serial, app_name, password, params;
+  rb_scan_args(argc, argv, "31", &serial, &app_name, &password, &params);
+
+  struct vacman_store *store = store_get(self);
+  char key[VACMAN_TOKEN_KEY_SIZE];
+
+  vacman_token_key(serial, app_name, key);
+
+  TKernelParms kernel_parms;
+  vacman_kernel_params_snapshot(params, &kernel_parms);
+
+  /* Read by AAL2 without the GVL, so it must not change under our feet */
+  password = rb_str_new_frozen(StringValue(password));
+
+  struct store_acquire_args args;
+  memset(&args, 0, sizeof(args));
+
+  args.hash         = store_hash(key);
+  args.shard        = store_shard(store, args.hash);
+  args.key          = key;
+  args.owner        = Qnil;
+  args.kernel_parms = &kernel_parms;
+  args.password     = rb_string_value_cstr(&password);
+
+  store_check_owner(args.shard, args.hash, key);
+  store_acquire_run(store_verify_nogvl, &args);
+
+  RB_GC_GUARD(password);
+
+  return args.status == STORE_ACQUIRED ? INT2FIX(args.result) : Qnil;
+}
+
+
+struct store_lock_args {
+  struct store_shard  *shard;
+  struct store_record *record;
+  VALUE                digipass;
+};
+
+static VALUE store_lock_yield(VALUE ptr) {
+  struct store_lock_args *args = (struct store_lock_args *)ptr;
+
+  args->digipass = vacman_digipass_new(&args->record->dpdata, args->record->sv);
+
+  return rb_yield(args->digipass);
+}
+
+static VALUE store_lock_release(VALUE ptr) {
+  struct store_lock_args *args = (struct store_lock_args *)ptr;
+  struct store_record *record = args->record;
+  struct vacman_digipass *digipass = NIL_P(args->digipass) ? NULL : vacman_digipass_get(args->digipass);
+
+  pthread_mutex_lock(&args->shard->lock);
+  if (digipass && digipass->dirty) {
+    record->dpdata = digipass->dpdata;
+    record->dirty  = 1;
+  }
+  store_release(args->shard, record);
+  pthread_mutex_unlock(&args->shard->lock);
+
+  return Qnil;
+}
+
+/*
+ * TokenStore#lock(serial, app_name) { |digipass| ... }
+ *
+ * Yields a copy of the stored token as a Digipass, with the token locked,
+ * and writes back the changes made to it when the block returns. Returns
+ * the block value, or nil without yielding if the token is not stored.
+ *
+ * Other threads wait for the block to return before using the token, so
+ * keep it short. The Digipass must not be used after the block.
+ */
+static VALUE vacman_store_lock(VALUE self, VALUE serial, VALUE app_name) {
+  struct vacman_store *store = store_get(self);
+  char key[VACMAN_TOKEN_KEY_SIZE];
+
+  rb_need_block();
+  vacman_token_key(serial, app_name, key);
+
+  struct store_acquire_args args;
+  memset(&args, 0, sizeof(args));
+
+  args.hash  = store_hash(key);
+  args.shard = store_shard(store, args.hash);
+  args.key   = key;
+  args.owner = rb_thread_current();
+
+  store_check_owner(args.shard, args.hash, key);
+  store_acquire_run(store_acquire_nogvl, &args);
+
+  if (args.status != STORE_ACQUIRED) {
+    return Qnil;
+  }
+
+  struct store_lock_args lock = { args.shard, args.record, Qnil };
+
+  return rb_ensure(store_lock_yield, (VALUE)&lock, store_lock_release, (VALUE)&lock);
+}
+
+/*
+ * TokenStore#delete(serial, app_name)
+ *
+ * Removes the given token, waiting for the threads using it, and returns
+ * whether it was stored. Its changes that were not flushed are lost.
+ */
+static VALUE vacman_store_delete(VALUE self, VALUE serial, VALUE app_name) {
+  struct vacman_store *store = store_get(self);
+  char key[VACMAN_TOKEN_KEY_SIZE];
+
+  vacman_token_key(serial, app_name, key);
+
+  struct store_acquire_args args;
+  memset(&args, 0, sizeof(args));
+
+  args.hash  = store_hash(key);
+  args.shard = store_shard(store, args.hash);
+  args.key   = key;
+  args.owner = Qnil;
+
+  store_check_owner(args.shard, args.hash, key);
+  store_acquire_run(store_acquire_nogvl, &args);
+
+  if (args.status != STORE_ACQUIRED) {
+    return Qfalse;
+  }
+
+  pthread_mutex_lock(&args.shard->lock);
+  store_remove(args.shard, args.record);
+  args.record->deleted = 1;
+  store_release(args.shard, args.record);
+  pthread_mutex_unlock(&args.shard->lock);
+
+  return Qtrue;
+}
+
+
+/*
+ * A copy of a dirty record, taken by #flush
+ */
+struct store_flushed {
+  char          key[VACMAN_TOKEN_KEY_SIZE];
+  TDigipassBlob dpdata;
+  VALUE         sv;
+};
+
+struct store_flush_args {
+  struct vacman_store  *store;
+  struct store_flushed *records;
+  long                  count, done, batch;
+};
+
+/*
+ * Takes at most max records off the dirty list of the given shard, and
+ * copies the ones that are not busy into the given array, marking them
+ * clean. Returns the number of copies.
+ *
+ * Busy records are listed again when they are released, and deleted ones
+ * are freed once unused.
+ */
+static long store_flush_shard(struct store_shard *shard, struct store_flushed *out, long max) {
+  long count = 0;
+
+  pthread_mutex_lock(&shard->lock);
+
+  for (long n = 0; shard->dirty && n < max; n++) {
+    struct store_record *record = shard->dirty;
+
+    shard->dirty   = record->next_dirty;
+    record->listed = 0;
+
+    if (record->deleted) {
+      store_maybe_free(record);
+      continue;
+    }
+
+    if (record->busy || !record->dirty) {
+      continue;
+    }
+
+    memcpy(out[count].key, record->key, VACMAN_TOKEN_KEY_SIZE);
+    out[count].dpdata = record->dpdata;
+    out[count].sv     = record->sv;
+    record->dirty     = 0;
+    count++;
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+
+  return count;
+}
+
+/*
+ * Returns the number of records in the dirty list of the given shard
+ */
+static long store_dirty_count(struct store_shard *shard) {
+  long count = 0;
+
+  pthread_mutex_lock(&shard->lock);
+  for (struct store_record *record = shard->dirty; record; record = record->next_dirty) {
+    count++;
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  return count;
+}
+
+static VALUE store_flush_yield(VALUE ptr) {
+  struct store_flush_args *args = (struct store_flush_args *)ptr;
+
+  while (args->done < args->count) {
+    long size = args->count - args->done;
+    if (size > args->batch) size = args->batch;
+
+    VALUE batch = rb_ary_new_capa(size);
+
+    for (long i = 0; i < size; i++) {
+      struct store_flushed *flushed = &args->records[args->done + i];
+      rb_ary_push(batch, vacman_digipass_new(&flushed->dpdata, flushed->sv));
+    }
+
+    rb_yield(batch);
+    args->done += size;
+  }
+
+  return Qnil;
+}
+
+/*
+ * Marks dirty again the records that were not persisted, unless they were
+ * deleted in the meantime, and frees the copies.
+ */
+static VALUE store_flush_ensure(VALUE ptr) {
+  struct store_flush_args *args = (struct store_flush_args *)ptr;
+
+  for (long i = args->done; i < args->count; i++) {
+    struct store_flushed *flushed = &args->records[i];
+    uint64_t hash = store_hash(flushed->key);
+    struct store_shard *shard = store_shard(args->store, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    struct store_record *record = store_lookup(shard, hash, flushed->key);
+
+    if (record) {
+      record->dirty = 1;
+
+      if (!record->listed && !record->busy) {
+        record->next_dirty = shard->dirty;
+        record->listed     = 1;
+        shard->dirty       = record;
+      }
+    }
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  free(args->records);
+
+  return Qnil;
+}
+
+/*
+ * TokenStore#flush(batch) { |digipasses| ... }
+ *
+ * Yields the tokens that changed since the last flush as Arrays of at most
+ * batch Digipass copies, for persistence, and returns how many there were.
+ *
+ * The tokens are marked clean as they are taken: if the block raises, the
+ * tokens of that batch and of the following ones are marked dirty again,
+ * so they are yielded by the next flush. Tokens in use by a verification
+ * or #lock are left to the next flush.
+ */
+static VALUE vacman_store_flush(VALUE self, VALUE rbbatch) {
+  struct vacman_store *store = store_get(self);
+  long batch = NUM2LONG(rbbatch);
+
+  if (batch < 1) {
+    rb_raise(rb_eArgError, "invalid batch size given: %ld", batch);
+  }
+
+  rb_need_block();
+
+  struct store_flush_args args = { store, NULL, 0, 0, batch };
+
+  for (long i = 0; i < store->count; i++) {
+    long dirty = store_dirty_count(&store->shards[i]);
+
+    if (dirty == 0) {
+      continue;
+    }
+
+    /* The list may grow meanwhile, the records listed since are left
+     * for the next flush */
+    struct store_flushed *records = realloc(args.records, (args.count + dirty) * sizeof(*records));
+
+    if (records == NULL) {
+      store_flush_ensure((VALUE)&args);
+      rb_memerror();
+    }
+
+    args.records = records;
+    args.count  += store_flush_shard(&store->shards[i], records + args.count, dirty);
+  }
+
+  rb_ensure(store_flush_yield, (VALUE)&args, store_flush_ensure, (VALUE)&args);
+
+  return LONG2NUM(args.count);
+}
+
+/*
+ * TokenStore#size
+ */
+static VALUE vacman_store_size(VALUE self) {
+  struct vacman_store *store = store_get(self);
+  long count = 0;
+
+  for (long i = 0; i < store->count; i++) {
+    pthread_mutex_lock(&store->shards[i].lock);
+    count += store->shards[i].count;
+    pthread_mutex_unlock(&store->shards[i].lock);
+  }
+
+  return LONG2NUM(count);
+}
+
+/*
+ * TokenStore#dirty_size
+ *
+ * The number of tokens waiting to be flushed.
+ */
+static VALUE vacman_store_dirty_size(VALUE self) {
+  struct vacman_store *store = store_get(self);
+  long count = 0;
+
+  for (long i = 0; i < store->count; i++) {
+    count += store_dirty_count(&store->shards[i]);
+  }
+
+  return LONG2NUM(count);
+}
+
+/*
+ * TokenStore#shards
+ */
+static VALUE vacman_store_shards(VALUE self) {
+  return LONG2NUM(store_get(self)->count);
+}
+
+
+/*
+ * Define the TokenStore class
+ */
+void vacman_store_init(VALUE lowlevel) {
+  c_TokenStore = rb_define_class_under(lowlevel, "TokenStore", rb_cObject);
+  rb_define_alloc_func(c_TokenStore, store_alloc);
+
+  rb_define_method(c_TokenStore, "initialize", vacman_store_initialize, 1);
+  rb_define_method(c_TokenStore, "add",        vacman_store_add, 1);
+  rb_define_method(c_TokenStore, "verify",     vacman_store_verify, -1);
+  rb_define_method(c_TokenStore, "lock",       vacman_store_lock, 2);
+  rb_define_method(c_TokenStore, "delete",     vacman_store_delete, 2);
+  rb_define_method(c_TokenStore, "flush",      vacman_store_flush, 1);
+  rb_define_method(c_TokenStore, "size",       vacman_store_size, 0);
+  rb_define_method(c_TokenStore, "dirty_size", vacman_store_dirty_size, 0);
+  rb_define_method(c_TokenStore, "shards",     vacman_store_shards, 0);
+}
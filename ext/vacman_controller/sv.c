@@ -0,0 +1,220 @@
+/*
+ * Vacman Controller wrapper
+ *
+ * This Ruby Extension wraps the VASCO Vacman Controller
+ * library and makes its API accessible to Ruby code.
+ *
+ * (C) 2013 https://github.com/mlankenau
+ * (C) 2019 m.barnaba@ifad.org
+ */
+#include "vacman_controller.h"
+
+/*
+ * Content-addressed registry of static vectors.
+ *
+ * All the tokens of a DPX share the same static vector, of up to 4 KB. It
+ * is interned here on import, so that a single frozen String is kept per
+ * distinct static vector, whatever the number of tokens and imports, and
+ * tokens can reference it by its digest when persisted.
+ *
+ * The digest is the 64 bit FNV-1a of the static vector. It is only meant
+ * to tell apart the handful of static vectors of a deployment: a collision
+ * is detected and raises, rather than returning the wrong static vector.
+ *
+ * The registry only grows: every String is pinned for the lifetime of the
+ * process, and shareable across Ractors. As Ractors run in parallel, the
+ * table is guarded by a mutex, that is never held while allocating Ruby
+ * objects, lest a GC waits for a Ractor blocked on it.
+ */
+static st_table        *sv_table;  /* digest => frozen String */
+static pthread_mutex_t  sv_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Returns the digest of the given static vector
+ */
+uint64_t vacman_sv_digest(const char *sv, long len) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  for (long i = 0; i < len; i++) {
+    hash ^= (unsigned char)sv[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+/*
+ * Returns the registered static vector with the given digest, or nil.
+ */
+VALUE vacman_sv_lookup(uint64_t digest) {
+  st_data_t value;
+  int found;
+
+  pthread_mutex_lock(&sv_lock);
+  found = st_lookup(sv_table, (st_data_t)digest, &value);
+  pthread_mutex_unlock(&sv_lock);
+
+  return found ? (VALUE)value : Qnil;
+}
+
+/*
+ * Registers the given static vector, and returns the frozen String that is
+ * shared by all the tokens that have it.
+ */
+VALUE vacman_sv_intern(VALUE sv) {
+  StringValue(sv);
+
+  uint64_t digest = vacman_sv_digest(RSTRING_PTR(sv), RSTRING_LEN(sv));
+  VALUE interned = vacman_sv_lookup(digest);
+
+  if (!NIL_P(interned)) {
+    if (!rb_str_equal(interned, sv)) {
+      rb_raise(e_VacmanError, "static vector digest collision on %016llx",
+               (unsigned long long)digest);
+    }
+
+    return interned;
+  }
+
+  VALUE created = VACMAN_SHAREABLE(rb_obj_freeze(rb_str_new(RSTRING_PTR(sv), RSTRING_LEN(sv))));
+  st_data_t value;
+
+  /* Another Ractor may have registered it in the meantime */
+  pthread_mutex_lock(&sv_lock);
+  if (st_lookup(sv_table, (st_data_t)digest, &value)) {
+    interned = (VALUE)value;
+  } else {
+    st_insert(sv_table, (st_data_t)digest, (st_data_t)created);
+    interned = created;
+  }
+  pthread_mutex_unlock(&sv_lock);
+
+  if (interned == created) {
+    rb_gc_register_mark_object(interned);
+  } else if (!rb_str_equal(interned, sv)) {
+    rb_raise(e_VacmanError, "static vector digest collision on %016llx",
+             (unsigned long long)digest);
+  }
+
+  return interned;
+}
+
+/*
+ * Returns the digest of the given static vector as an hex String
+ */
+VALUE vacman_sv_digest_hex(uint64_t digest) {
+  char hex[16+1];
+
+  snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)digest);
+
+  return rb_str_new(hex, 16);
+}
+
+/*
+ * Parses a static vector digest in hex
+ */
+uint64_t vacman_sv_digest_parse(VALUE hex) {
+  StringValue(hex);
+
+  const char *ptr = RSTRING_PTR(hex);
+  uint64_t digest = 0;
+
+  if (RSTRING_LEN(hex) != 16) {
+    rb_raise(e_VacmanError, "invalid static vector digest given: %"PRIsVALUE, hex);
+  }
+
+  for (int i = 0; i < 16; i++) {
+    int c = ptr[i], nibble;
+
+    if (c >= '0' && c <= '9')      nibble = c - '0';
+    else if (c >= 'a' && c <= 'f') nibble = c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F') nibble = c - 'A' + 10;
+    else rb_raise(e_VacmanError, "invalid static vector digest given: %"PRIsVALUE, hex);
+
+    digest = digest << 4 | nibble;
+  }
+
+  return digest;
+}
+
+
+/*
+ * LowLevel.intern_static_vector(sv)
+ *
+ * Registers the given static vector, and returns its digest.
+ */
+static VALUE vacman_sv_intern_m(VALUE module, VALUE sv) {
+  sv = vacman_sv_intern(sv);
+
+  return vacman_sv_digest_hex(vacman_sv_digest(RSTRING_PTR(sv), RSTRING_LEN(sv)));
+}
+
+/*
+ * LowLevel.static_vector(digest)
+ *
+ * Returns the registered static vector with the given digest, or nil.
+ */
+static VALUE vacman_sv_lookup_m(VALUE module, VALUE digest) {
+  return vacman_sv_lookup(vacman_sv_digest_parse(digest));
+}
+
+struct sv_entry {
+  uint64_t digest;
+  VALUE    sv;
+};
+
+static int sv_collect_i(st_data_t key, st_data_t value, st_data_t arg) {
+  struct sv_entry **entry = (struct sv_entry **)arg;
+
+  (*entry)->digest = (uint64_t)key;
+  (*entry)->sv     = (VALUE)value;
+  (*entry)++;
+
+  return ST_CONTINUE;
+}
+
+/*
+ * LowLevel.static_vectors
+ *
+ * Returns all the registered static vectors, as an Hash keyed by digest.
+ */
+static VALUE vacman_sv_all(VALUE module) {
+  struct sv_entry *entries, *entry;
+  size_t count;
+
+  /* Copy the entries out, the Hash is built without holding the lock */
+  pthread_mutex_lock(&sv_lock);
+  count   = sv_table->num_entries;
+  entries = malloc((count ? count : 1) * sizeof(*entries));
+  entry   = entries;
+  if (entries) {
+    st_foreach(sv_table, sv_collect_i, (st_data_t)&entry);
+  }
+  pthread_mutex_unlock(&sv_lock);
+
+  if (!entries) {
+    rb_memerror();
+  }
+
+  VALUE ret = rb_hash_new();
+
+  for (size_t i = 0; i < count; i++) {
+    rb_hash_aset(ret, vacman_sv_digest_hex(entries[i].digest), entries[i].sv);
+  }
+
+  free(entries);
+
+  return ret;
+}
+
+
+/*
+ * Define the static vector registry methods
+ */
+void vacman_sv_init(VALUE lowlevel) {
+  sv_table = st_init_numtable();
+
+  rb_define_singleton_method(lowlevel, "intern_static_vector", vacman_sv_intern_m, 1);
+  rb_define_singleton_method(lowlevel, "static_vector",        vacman_sv_lookup_m, 1);
+  rb_define_singleton_method(lowlevel, "static_vectors",       vacman_sv_all, 0);
+}
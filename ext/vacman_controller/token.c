@@ -8,80 +8,223 @@
  * (C) 2019 m.barnaba@ifad.org
  */
 #include "vacman_controller.h"
+#include <time.h>
+#include <limits.h>
 
 /*
  * Vacman properties names and IDs registry
  */
+enum token_property_type {
+  PROPERTY_STRING,
+  PROPERTY_INT,
+  PROPERTY_BOOL,       /* YES or NO */
+  PROPERTY_TIME,       /* A ctime(3) string, in UTC */
+  PROPERTY_AUTH_MODE,  /* A two-letter code, mapped to a Symbol */
+};
+
 struct token_property {
   const char *name;
   aat_int32 id;
+  enum token_property_type type;
 };
 static struct token_property vacman_token_properties[] = {
-  {"token_model",                   TOKEN_MODEL                   },
-  {"token_status",                  TOKEN_STATUS                  },
-  {"use_count",                     USE_COUNT                     },
-  {"last_time_used",                LAST_TIME_USED                },
-  {"last_time_shift",               LAST_TIME_SHIFT               },
-  {"time_based_algo",               TIME_BASED_ALGO               },
-  {"event_based_algo",              EVENT_BASED_ALGO              },
-  {"pin_supported",                 PIN_SUPPORTED                 },
-  {"unlock_supported",              UNLOCK_SUPPORTED              },
-  {"pin_ch_on",                     PIN_CH_ON                     },
-  {"pin_change_enabled",            PIN_CH_ON                     },
-  {"pin_len",                       PIN_LEN                       },
-  {"pin_length",                    PIN_LEN                       },
-  {"pin_min_len",                   PIN_MIN_LEN                   },
-  {"pin_minimum_length",            PIN_MIN_LEN                   },
-  {"pin_enabled",                   PIN_ENABLED                   },
-  {"pin_ch_forced",                 PIN_CH_FORCED                 },
-  {"pin_change_forced",             PIN_CH_FORCED                 },
-  {"virtual_token_type",            VIRTUAL_TOKEN_TYPE            },
-  {"virtual_token_grace_period",    VIRTUAL_TOKEN_GRACE_PERIOD    },
-  {"virtual_token_remain_use",      VIRTUAL_TOKEN_REMAIN_USE      },
-  {"last_response_type",            LAST_RESPONSE_TYPE            },
-  {"error_count",                   ERROR_COUNT                   },
-  {"event_value",                   EVENT_VALUE                   },
-  {"last_event_value",              LAST_EVENT_VALUE              },
-  {"sync_windows",                  SYNC_WINDOWS                  },
-  {"primary_token_enabled",         PRIMARY_TOKEN_ENABLED         },
-  {"virtual_token_supported",       VIRTUAL_TOKEN_SUPPORTED       },
-  {"virtual_token_enabled",         VIRTUAL_TOKEN_ENABLED         },
-  {"code_word",                     CODE_WORD                     },
-  {"auth_mode",                     AUTH_MODE                     },
-  {"ocra_suite",                    OCRA_SUITE                    },
-  {"derivation_supported",          DERIVATION_SUPPORTED          },
-  {"max_dtf_number",                MAX_DTF_NUMBER                },
-  {"response_len",                  RESPONSE_LEN                  },
-  {"response_length",               RESPONSE_LEN                  },
-  {"response_format",               RESPONSE_FORMAT               },
-  {"response_chk",                  RESPONSE_CHK                  },
-  {"response_checksum",             RESPONSE_CHK                  },
-  {"time_step",                     TIME_STEP                     },
-  {"use_3des",                      TRIPLE_DES_USED               },
-  {"triple_des_used",               TRIPLE_DES_USED               },
+  {"token_model",                   TOKEN_MODEL,                  PROPERTY_STRING    },
+  {"token_status",                  TOKEN_STATUS,                 PROPERTY_STRING    },
+  {"use_count",                     USE_COUNT,                    PROPERTY_INT       },
+  {"last_time_used",                LAST_TIME_USED,               PROPERTY_TIME      },
+  {"last_time_shift",               LAST_TIME_SHIFT,              PROPERTY_INT       },
+  {"time_based_algo",               TIME_BASED_ALGO,              PROPERTY_BOOL      },
+  {"event_based_algo",              EVENT_BASED_ALGO,             PROPERTY_BOOL      },
+  {"pin_supported",                 PIN_SUPPORTED,                PROPERTY_BOOL      },
+  {"unlock_supported",              UNLOCK_SUPPORTED,             PROPERTY_BOOL      },
+  {"pin_ch_on",                     PIN_CH_ON,                    PROPERTY_BOOL      },
+  {"pin_change_enabled",            PIN_CH_ON,                    PROPERTY_BOOL      },
+  {"pin_len",                       PIN_LEN,                      PROPERTY_INT       },
+  {"pin_length",                    PIN_LEN,                      PROPERTY_INT       },
+  {"pin_min_len",                   PIN_MIN_LEN,                  PROPERTY_INT       },
+  {"pin_minimum_length",            PIN_MIN_LEN,                  PROPERTY_INT       },
+  {"pin_enabled",                   PIN_ENABLED,                  PROPERTY_BOOL      },
+  {"pin_ch_forced",                 PIN_CH_FORCED,                PROPERTY_BOOL      },
+  {"pin_change_forced",             PIN_CH_FORCED,                PROPERTY_BOOL      },
+  {"virtual_token_type",            VIRTUAL_TOKEN_TYPE,           PROPERTY_STRING    },
+  {"virtual_token_grace_period",    VIRTUAL_TOKEN_GRACE_PERIOD,   PROPERTY_TIME      },
+  {"virtual_token_remain_use",      VIRTUAL_TOKEN_REMAIN_USE,     PROPERTY_INT       },
+  {"last_response_type",            LAST_RESPONSE_TYPE,           PROPERTY_STRING    },
+  {"error_count",                   ERROR_COUNT,                  PROPERTY_INT       },
+  {"event_value",                   EVENT_VALUE,                  PROPERTY_INT       },
+  {"last_event_value",              LAST_EVENT_VALUE,             PROPERTY_INT       },
+  {"sync_windows",                  SYNC_WINDOWS,                 PROPERTY_BOOL      },
+  {"primary_token_enabled",         PRIMARY_TOKEN_ENABLED,        PROPERTY_BOOL      },
+  {"virtual_token_supported",       VIRTUAL_TOKEN_SUPPORTED,      PROPERTY_BOOL      },
+  {"virtual_token_enabled",         VIRTUAL_TOKEN_ENABLED,        PROPERTY_BOOL      },
+  {"code_word",                     CODE_WORD,                    PROPERTY_STRING    },
+  {"auth_mode",                     AUTH_MODE,                    PROPERTY_AUTH_MODE },
+  {"ocra_suite",                    OCRA_SUITE,                   PROPERTY_STRING    },
+  {"derivation_supported",          DERIVATION_SUPPORTED,         PROPERTY_BOOL      },
+  {"max_dtf_number",                MAX_DTF_NUMBER,               PROPERTY_INT       },
+  {"response_len",                  RESPONSE_LEN,                 PROPERTY_INT       },
+  {"response_length",               RESPONSE_LEN,                 PROPERTY_INT       },
+  {"response_format",               RESPONSE_FORMAT,              PROPERTY_STRING    },
+  {"response_chk",                  RESPONSE_CHK,                 PROPERTY_BOOL      },
+  {"response_checksum",             RESPONSE_CHK,                 PROPERTY_BOOL      },
+  {"time_step",                     TIME_STEP,                    PROPERTY_INT       },
+  {"use_3des",                      TRIPLE_DES_USED,              PROPERTY_BOOL      },
+  {"triple_des_used",               TRIPLE_DES_USED,              PROPERTY_BOOL      },
 };
 
 static size_t vacman_token_properties_count = sizeof(vacman_token_properties)/sizeof(struct token_property);
 
 /*
- * Convert property name to property ID
+ * Lookup tables from the interned property name and from the AAL2 property
+ * ID to the index in the registry, built once by vacman_token_init().
+ *
+ * The AAL2 property ID maps to the first registry entry with that ID, so
+ * that aliases of the same property share a single slot.
  */
-static long vacman_token_get_property_id(char *property_name) {
-  for (size_t i = 0; i < vacman_token_properties_count; i++) {
-    if (strcmp(property_name, vacman_token_properties[i].name) == 0) {
-      return vacman_token_properties[i].id;
+static st_table *vacman_token_property_by_name;
+static st_table *vacman_token_property_by_id;
+
+/*
+ * Convert property name, as a Symbol or String, or AAL2 property ID to its
+ * index in the registry. Strings that are not already interned are never
+ * property names, so the lookup does not allocate.
+ */
+static size_t vacman_token_get_property_index(VALUE property) {
+  st_data_t index;
+
+  if (FIXNUM_P(property)) {
+    if (st_lookup(vacman_token_property_by_id, FIX2LONG(property), &index)) {
+      return index;
     }
+
+    rb_raise(e_VacmanError, "Invalid property ID %ld", FIX2LONG(property));
+  }
+
+  ID id = rb_check_id(&property);
+
+  if (id && st_lookup(vacman_token_property_by_name, id, &index)) {
+    return index;
   }
 
-  rb_raise(e_VacmanError, "Invalid property name `%s'", property_name);
+  rb_raise(e_VacmanError, "Invalid property name `%"PRIsVALUE"'", property);
   return 0;
 }
 
+/*
+ * Returns the index of the first registry entry with the same ID as the
+ * given one.
+ */
+static size_t vacman_token_property_canonical(size_t index) {
+  st_data_t canonical;
+
+  st_lookup(vacman_token_property_by_id, vacman_token_properties[index].id, &canonical);
+
+  return canonical;
+}
+
+/*
+ * Authentication modes, as returned by AAL2 for the auth_mode property.
+ * The IDs are interned by vacman_token_init().
+ */
+static struct {
+  const char *code;
+  const char *name;
+  ID id;
+} vacman_token_auth_modes[] = {
+  { "RO", "response_only",         0 },
+  { "SG", "signature_application", 0 },
+  { "CR", "challenge_response",    0 },
+  { "MM", "multi_mode",            0 },
+  { "UL", "unlock_v2",             0 },
+};
+
+/*
+ * Parses the ctime(3) format used by AAL2 for dates, that are in UTC, and
+ * returns a UTC Time, or nil if the value cannot be parsed.
+ */
+static VALUE vacman_token_property_time(const char *value) {
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+
+  const char *end = strptime(value, "%a %b %d %H:%M:%S %Y", &tm);
+
+  if (end == NULL || *end != '\0') {
+    return Qnil;
+  }
+
+  struct timespec ts = { timegm(&tm), 0 };
+
+  return rb_time_timespec_new(&ts, INT_MAX-1); /* INT_MAX-1 means UTC */
+}
+
+/*
+ * Converts the string returned by AAL2 for the given property into the
+ * corresponding Ruby value, according to the property type.
+ *
+ * NA and DISABLE stand for a missing value and are returned as nil. Values
+ * that do not match their type are returned as Strings.
+ */
+static VALUE vacman_token_property_value(size_t index, const char *value) {
+  if (strcmp(value, "NA") == 0 || strcmp(value, "DISABLE") == 0) {
+    return Qnil;
+  }
+
+  switch (vacman_token_properties[index].type) {
+    case PROPERTY_INT:
+      return rb_cstr_to_inum(value, 10, 0);
+
+    case PROPERTY_BOOL:
+      if (strcmp(value, "YES") == 0) return Qtrue;
+      if (strcmp(value, "NO")  == 0) return Qfalse;
+      return Qnil;
+
+    case PROPERTY_TIME: {
+      VALUE time = vacman_token_property_time(value);
+      if (!NIL_P(time)) return time;
+      break;
+    }
+
+    case PROPERTY_AUTH_MODE:
+      for (size_t i = 0; i < sizeof(vacman_token_auth_modes)/sizeof(vacman_token_auth_modes[0]); i++) {
+        if (strcmp(value, vacman_token_auth_modes[i].code) == 0) {
+          return ID2SYM(vacman_token_auth_modes[i].id);
+        }
+      }
+      break;
+
+    case PROPERTY_STRING:
+      break;
+  }
+
+  return rb_str_new2(value);
+}
+
+
+/*
+ * Build the property lookup tables
+ */
+void vacman_token_init(void) {
+  vacman_token_property_by_name = st_init_numtable_with_size(vacman_token_properties_count);
+  vacman_token_property_by_id   = st_init_numtable_with_size(vacman_token_properties_count);
+
+  for (size_t i = 0; i < vacman_token_properties_count; i++) {
+    st_insert(vacman_token_property_by_name, rb_intern(vacman_token_properties[i].name), i);
+
+    if (!st_is_member(vacman_token_property_by_id, vacman_token_properties[i].id)) {
+      st_insert(vacman_token_property_by_id, vacman_token_properties[i].id, i);
+    }
+  }
+
+  for (size_t i = 0; i < sizeof(vacman_token_auth_modes)/sizeof(vacman_token_auth_modes[0]); i++) {
+    vacman_token_auth_modes[i].id = rb_intern(vacman_token_auth_modes[i].name);
+  }
+}
+
 
 /*
  * Get token property names
  */
-VALUE vacman_token_get_property_names() {
+VALUE vacman_token_get_property_names(VALUE module) {
   VALUE ret = rb_ary_new();
 
   for (size_t i = 0; i < vacman_token_properties_count; i++) {
@@ -94,18 +237,42 @@ VALUE vacman_token_get_property_names() {
 
 
 /*
- * Get the given property value from the given token.
+ * Get token property AAL2 IDs, as an Hash keyed by property name
+ */
+VALUE vacman_token_get_property_ids(VALUE module) {
+  VALUE ret = rb_hash_new();
+
+  for (size_t i = 0; i < vacman_token_properties_count; i++) {
+    rb_hash_aset(ret, rb_str_new2(vacman_token_properties[i].name),
+                 INT2FIX(vacman_token_properties[i].id));
+  }
+
+  return ret;
+}
+
+
+/*
+ * Get the given property value from the given token, converted to the
+ * Ruby type of the property.
  */
-VALUE vacman_token_get_property(VALUE module, VALUE token, VALUE property) {
+VALUE vacman_token_get_property(int argc, VALUE *argv, VALUE module) {
+  VALUE token, property, params;
+  rb_scan_args(argc, argv, "21", &token, &property, &params);
+
+  TKernelParms kernel_parms;
+  vacman_kernel_params_snapshot(params, &kernel_parms);
+
   TDigipassBlob dpdata;
   vacman_rbhash_to_digipass(token, &dpdata);
 
   aat_ascii value[64];
-  aat_int32 property_id = vacman_token_get_property_id(StringValueCStr(property));
-  aat_int32 result = AAL2GetTokenProperty(&dpdata, &g_KernelParms, property_id, value);
+  size_t index = vacman_token_get_property_index(property);
+  uint64_t start = vacman_stats_start();
+  aat_int32 result = AAL2GetTokenProperty(&dpdata, &kernel_parms, vacman_token_properties[index].id, value);
+  vacman_stats_record(STAT_GET_TOKEN_PROPERTY, start, result);
 
   if (result == 0) {
-    return rb_str_new2(value);
+    return vacman_token_property_value(index, value);
   } else {
     vacman_library_error("AAL2GetTokenProperty", result);
     return Qnil;
@@ -113,18 +280,94 @@ VALUE vacman_token_get_property(VALUE module, VALUE token, VALUE property) {
 }
 
 
+/*
+ * Get the given property values from the given token, or all of them if no
+ * names are given, and return them converted to their Ruby type in a Hash
+ * keyed by property name.
+ *
+ * The token is unmarshaled once, and every property ID is queried once,
+ * even when it is asked for under more than one name. A property that
+ * AAL2 fails to read does not fail the whole call: the Error is returned
+ * as its value instead.
+ */
+VALUE vacman_token_get_properties(int argc, VALUE *argv, VALUE module) {
+  VALUE token, names, params;
+  rb_scan_args(argc, argv, "12", &token, &names, &params);
+
+  TKernelParms kernel_parms;
+  vacman_kernel_params_snapshot(params, &kernel_parms);
+
+  TDigipassBlob dpdata;
+  vacman_rbhash_to_digipass(token, &dpdata);
+
+  if (NIL_P(names)) {
+    names = vacman_token_get_property_names(module);
+  } else {
+    Check_Type(names, T_ARRAY);
+    names = rb_ary_dup(names);
+  }
+
+  VALUE values[sizeof(vacman_token_properties)/sizeof(struct token_property)];
+  for (size_t i = 0; i < vacman_token_properties_count; i++) {
+    values[i] = Qundef;
+  }
+
+  VALUE ret = rb_hash_new();
+
+  for (long i = 0; i < RARRAY_LEN(names); i++) {
+    VALUE name = RARRAY_AREF(names, i);
+
+    size_t index = vacman_token_property_canonical(
+        vacman_token_get_property_index(name));
+
+    if (values[index] == Qundef) {
+      aat_ascii value[64];
+      uint64_t start = vacman_stats_start();
+      aat_int32 result = AAL2GetTokenProperty(&dpdata, &kernel_parms,
+                                              vacman_token_properties[index].id, value);
+      vacman_stats_record(STAT_GET_TOKEN_PROPERTY, start, result);
+
+      if (result == 0) {
+        values[index] = vacman_token_property_value(index, value);
+
+        /* Shared across aliases */
+        if (RB_TYPE_P(values[index], T_STRING)) {
+          rb_obj_freeze(values[index]);
+        }
+      } else {
+        values[index] = vacman_library_error_new("AAL2GetTokenProperty", result);
+      }
+    }
+
+    rb_hash_aset(ret, name, values[index]);
+  }
+
+  RB_GC_GUARD(names);
+
+  return ret;
+}
+
+
 /*
  * Set the given token property to the given value.
  */
-VALUE vacman_token_set_property(VALUE module, VALUE token, VALUE property, VALUE rbval) {
+VALUE vacman_token_set_property(int argc, VALUE *argv, VALUE module) {
+  VALUE token, property, rbval, params;
+  rb_scan_args(argc, argv, "31", &token, &property, &rbval, &params);
+
+  TKernelParms kernel_parms;
+  vacman_kernel_params_snapshot(params, &kernel_parms);
+
   TDigipassBlob dpdata;
 
-  aat_int32 property_id = vacman_token_get_property_id(StringValueCStr(property));
+  aat_int32 property_id = vacman_token_properties[vacman_token_get_property_index(property)].id;
   aat_int32 value = rb_fix2int(rbval);
 
   vacman_rbhash_to_digipass(token, &dpdata);
 
-  aat_int32 result = AAL2SetTokenProperty(&dpdata, &g_KernelParms, property_id, value);
+  uint64_t start = vacman_stats_start();
+  aat_int32 result = AAL2SetTokenProperty(&dpdata, &kernel_parms, property_id, value);
+  vacman_stats_record(STAT_SET_TOKEN_PROPERTY, start, result);
 
   vacman_digipass_to_rbhash(&dpdata, token);
 
@@ -140,7 +383,10 @@ VALUE vacman_token_set_property(VALUE module, VALUE token, VALUE property, VALUE
 /*
  * Changes the static password on the given token.
  */
-VALUE vacman_token_set_pin(VALUE module, VALUE token, VALUE pin) {
+VALUE vacman_token_set_pin(int argc, VALUE *argv, VALUE module) {
+  VALUE token, pin, params;
+  rb_scan_args(argc, argv, "21", &token, &pin, &params);
+
   TDigipassBlob dpdata;
 
   if (!RB_TYPE_P(pin, T_STRING)) {
@@ -148,10 +394,15 @@ VALUE vacman_token_set_pin(VALUE module, VALUE token, VALUE pin) {
     return Qnil;
   }
 
+  TKernelParms kernel_parms;
+  vacman_kernel_params_snapshot(params, &kernel_parms);
+
   vacman_rbhash_to_digipass(token, &dpdata);
 
   aat_ascii *passwd = StringValueCStr(pin);
-  aat_int32 result = AAL2ChangeStaticPassword(&dpdata, &g_KernelParms, passwd, passwd);
+  uint64_t start = vacman_stats_start();
+  aat_int32 result = AAL2ChangeStaticPassword(&dpdata, &kernel_parms, passwd, passwd);
+  vacman_stats_record(STAT_CHANGE_STATIC_PASSWORD, start, result);
 
   vacman_digipass_to_rbhash(&dpdata, token);
 
@@ -167,12 +418,20 @@ VALUE vacman_token_set_pin(VALUE module, VALUE token, VALUE pin) {
 /*
  * Resets the token error count and the time window shift.
  */
-VALUE vacman_token_reset_info(VALUE module, VALUE token) {
+VALUE vacman_token_reset_info(int argc, VALUE *argv, VALUE module) {
+  VALUE token, params;
+  rb_scan_args(argc, argv, "11", &token, &params);
+
+  TKernelParms kernel_parms;
+  vacman_kernel_params_snapshot(params, &kernel_parms);
+
   TDigipassBlob dpdata;
 
   vacman_rbhash_to_digipass(token, &dpdata);
 
-  aat_int32 result = AAL2ResetTokenInfo(&dpdata, &g_KernelParms);
+  uint64_t start = vacman_stats_start();
+  aat_int32 result = AAL2ResetTokenInfo(&dpdata, &kernel_parms);
+  vacman_stats_record(STAT_RESET_TOKEN_INFO, start, result);
 
   vacman_digipass_to_rbhash(&dpdata, token);
 
@@ -186,17 +445,48 @@ VALUE vacman_token_reset_info(VALUE module, VALUE token) {
 
 
 /*
- * Verifies the given OTP against the given token.
+ * Verifies the given OTP against the given token, updating the token hash,
+ * and returns the AAL2 result code.
  */
-VALUE vacman_token_verify_password(VALUE module, VALUE token, VALUE password) {
+static aat_int32 token_verify_password(VALUE token, VALUE password, VALUE params) {
+  TKernelParms kernel_parms;
+  vacman_kernel_params_snapshot(params, &kernel_parms);
+
   TDigipassBlob dpdata;
 
   vacman_rbhash_to_digipass(token, &dpdata);
 
-  aat_int32 result = AAL2VerifyPassword(&dpdata, &g_KernelParms, rb_string_value_cstr(&password), 0);
+  /* Read by AAL2 without the GVL, so it must not change under our feet */
+  password = rb_str_new_frozen(StringValue(password));
+
+  aat_ascii *passwd = rb_string_value_cstr(&password);
+  uint64_t replay_key;
+  aat_int32 result;
 
+  /* A recently seen OTP is answered without touching the token */
+  if (vacman_replay_lookup(&dpdata, &kernel_parms, passwd, &replay_key, &result)) {
+    return result;
+  }
+
+  result = vacman_aal2_verify_password(&dpdata, &kernel_parms, passwd);
+
+  RB_GC_GUARD(password);
+
+  vacman_replay_store(replay_key, result, &dpdata, &kernel_parms);
   vacman_digipass_to_rbhash(&dpdata, token);
 
+  return result;
+}
+
+/*
+ * Verifies the given OTP against the given token.
+ */
+VALUE vacman_token_verify_password(int argc, VALUE *argv, VALUE module) {
+  VALUE token, password, params;
+  rb_scan_args(argc, argv, "21", &token, &password, &params);
+
+  aat_int32 result = token_verify_password(token, password, params);
+
   if (result == 0)
     return Qtrue;
   else {
@@ -205,10 +495,175 @@ VALUE vacman_token_verify_password(VALUE module, VALUE token, VALUE password) {
   }
 }
 
+/*
+ * Verifies the given OTP against the given token, and returns the AAL2
+ * result code, 0 meaning success. Does not raise on failed verifications,
+ * so that a rejected OTP costs the same as an accepted one.
+ */
+VALUE vacman_token_verify_password_status(int argc, VALUE *argv, VALUE module) {
+  VALUE token, password, params;
+  rb_scan_args(argc, argv, "21", &token, &password, &params);
+
+  return INT2FIX(token_verify_password(token, password, params));
+}
+
+
+/*
+ * Orders pointers to token blobs by serial number and application name
+ */
+static int token_blob_cmp(const void *a, const void *b) {
+  const TDigipassBlob *x = *(const TDigipassBlob * const *)a;
+  const TDigipassBlob *y = *(const TDigipassBlob * const *)b;
+
+  int ret = memcmp(x->Serial, y->Serial, sizeof(x->Serial));
+  return ret ? ret : memcmp(x->AppName, y->AppName, sizeof(x->AppName));
+}
+
+/*
+ * Raises if the same serial number and application name appear twice
+ */
+static void token_check_unique(TDigipassBlob *dpdata, long count) {
+  VALUE sorted_buf;
+  TDigipassBlob **sorted = ALLOCV_N(TDigipassBlob *, sorted_buf, count);
+
+  for (long i = 0; i < count; i++) {
+    sorted[i] = &dpdata[i];
+  }
+
+  qsort(sorted, count, sizeof(*sorted), token_blob_cmp);
+
+  for (long i = 1; i < count; i++) {
+    if (token_blob_cmp(&sorted[i - 1], &sorted[i]) == 0) {
+      rb_raise(e_VacmanError, "invalid arguments given, token %.*s %.*s given twice",
+               (int)sizeof(sorted[i]->Serial), sorted[i]->Serial,
+               (int)sizeof(sorted[i]->AppName), sorted[i]->AppName);
+    }
+  }
+
+  ALLOCV_END(sorted_buf);
+}
+
+
+/*
+ * Verifies the given Array of OTPs against the given Array of tokens, with
+ * all the AAL2 work done in a single GVL release.
+ *
+ * Returns an Array with the AAL2 result code of each verification, 0 meaning
+ * success. Every token hash is updated, as with verify_password, and no
+ * Error is raised on failed verifications.
+ *
+ * Every token is read before any verification runs, so a token appearing
+ * twice in a batch would keep only its last update, losing the failures
+ * counted by the others: an Error is raised instead.
+ */
+VALUE vacman_token_verify_passwords(int argc, VALUE *argv, VALUE module) {
+  VALUE tokens, passwords, params;
+  rb_scan_args(argc, argv, "21", &tokens, &passwords, &params);
+
+  if (!RB_TYPE_P(tokens, T_ARRAY) || !RB_TYPE_P(passwords, T_ARRAY)) {
+    rb_raise(e_VacmanError, "invalid arguments given, requires arrays of tokens and passwords");
+    return Qnil;
+  }
+
+  /* Private copies, so that the arrays cannot change under our feet */
+  tokens    = rb_ary_dup(tokens);
+  passwords = rb_ary_dup(passwords);
+
+  long count = RARRAY_LEN(tokens);
+
+  if (RARRAY_LEN(passwords) != count) {
+    rb_raise(e_VacmanError, "invalid arguments given, got %ld tokens and %ld passwords",
+             count, RARRAY_LEN(passwords));
+    return Qnil;
+  }
+
+  TKernelParms kernel_parms;
+  vacman_kernel_params_snapshot(params, &kernel_parms);
+
+  VALUE dpdata_buf, passwd_buf, results_buf, chars_buf, keys_buf, skip_buf;
+  TDigipassBlob *dpdata  = ALLOCV_N(TDigipassBlob, dpdata_buf, count);
+  aat_ascii **passwd     = ALLOCV_N(aat_ascii *, passwd_buf, count);
+  aat_int32 *results     = ALLOCV_N(aat_int32, results_buf, count);
+  uint64_t *keys         = ALLOCV_N(uint64_t, keys_buf, count);
+  char *skip             = ALLOCV_N(char, skip_buf, count);
+  size_t chars_len       = 0;
+
+  for (long i = 0; i < count; i++) {
+    vacman_rbhash_to_digipass(RARRAY_AREF(tokens, i), &dpdata[i]);
+
+    /* Frozen, so that no later to_str call can change its length */
+    VALUE password = RARRAY_AREF(passwords, i);
+    password = rb_str_new_frozen(StringValue(password));
+    RARRAY_ASET(passwords, i, password);
+
+    chars_len += strlen(rb_string_value_cstr(&password)) + 1;
+  }
+
+  token_check_unique(dpdata, count);
+
+  /*
+   * Read by AAL2 without the GVL, when the GC may move the password
+   * strings around: copy them all in a single C buffer.
+   */
+  aat_ascii *chars = ALLOCV_N(aat_ascii, chars_buf, chars_len);
+
+  for (long i = 0; i < count; i++) {
+    VALUE password = RARRAY_AREF(passwords, i);
+    long len = RSTRING_LEN(password);
+
+    memcpy(chars, RSTRING_PTR(password), len);
+    chars[len] = '\0';
+
+    passwd[i] = chars;
+    chars += len + 1;
+
+    /* A recently seen OTP is answered without touching the token */
+    skip[i] = vacman_replay_lookup(&dpdata[i], &kernel_parms, passwd[i], &keys[i], &results[i]);
+  }
+
+  VALUE ret = rb_ary_new_capa(count);
+  long done = 0;
+
+  while (done < count) {
+    long from = done;
+
+    done = vacman_aal2_verify_passwords(dpdata, &kernel_parms, passwd, results, skip, from, count);
+
+    for (long i = from; i < done; i++) {
+      if (!skip[i]) {
+        vacman_replay_store(keys[i], results[i], &dpdata[i], &kernel_parms);
+        vacman_digipass_to_rbhash(&dpdata[i], RARRAY_AREF(tokens, i));
+      }
+
+      rb_ary_push(ret, INT2FIX(results[i]));
+    }
+
+    /* Deliver interrupts only once verified tokens have been written back */
+    rb_thread_check_ints();
+  }
+
+  ALLOCV_END(dpdata_buf);
+  ALLOCV_END(passwd_buf);
+  ALLOCV_END(results_buf);
+  ALLOCV_END(chars_buf);
+  ALLOCV_END(keys_buf);
+  ALLOCV_END(skip_buf);
+
+  RB_GC_GUARD(passwords);
+
+  return ret;
+}
+
 /*
  * Generate an OTP from the given token, if the token allows it.
  */
-VALUE vacman_token_generate_password(VALUE module, VALUE token) {
+VALUE vacman_token_generate_password(int argc, VALUE *argv, VALUE module) {
+  VALUE token, params;
+  rb_scan_args(argc, argv, "11", &token, &params);
+
+  TKernelParms kernel_parms;
+  vacman_kernel_params_snapshot(params, &kernel_parms);
+
   TDigipassBlob dpdata;
 
   vacman_rbhash_to_digipass(token, &dpdata);
@@ -216,7 +671,7 @@ VALUE vacman_token_generate_password(VALUE module, VALUE token) {
   aat_ascii password[18];
   memset(password, 0, sizeof(password));
 
-  aat_int32 result = AAL2GenPassword(&dpdata, &g_KernelParms, password, NULL);
+  aat_int32 result = vacman_aal2_generate_password(&dpdata, &kernel_parms, password);
   vacman_digipass_to_rbhash(&dpdata, token);
 
   if (result != 0) {
@@ -0,0 +1,908 @@
+/*
+ * Vacman Controller wrapper
+ *
+ * This Ruby Extension wraps the VASCO Vacman Controller
+ * library and makes its API accessible to Ruby code.
+ *
+ * (C) 2013 https://github.com/mlankenau
+ * (C) 2019 m.barnaba@ifad.org
+ */
+#include "vacman_controller.h"
+#include <ruby/thread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+/*
+ * VacmanController::LowLevel::TokenFile verifies OTPs against a file of
+ * fixed-size token records, mapped in memory, for sites and batch jobs that
+ * work offline from a local copy of the tokens.
+ *
+ * Opening the file costs a single mmap() whatever the number of tokens, and
+ * no Ruby object is built per token: verifications look the token up in the
+ * index, and run AAL2 on its record in place, without the GVL. The pages of
+ * the records that changed are scheduled for writeback with msync(), and
+ * #sync or #close wait for it.
+ *
+ * The file is laid out as:
+ *
+ *   header       struct token_file_header
+ *   records      struct token_file_record, at a page boundary
+ *   index        struct token_file_index, sorted by hash
+ *   svs          the static vectors, as a 32 bit length and the bytes
+ *
+ * in the native byte order, as the file is meant for the machine that
+ * wrote it. The index holds the hash of the serial number and application
+ * name of each record, so that a lookup touches a few cache lines of it
+ * and a single record.
+ *
+ * Records are locked by stripes, so that verifications of the same token
+ * are serialised. The file itself is locked with flock(), exclusively
+ * unless it is opened read-only: then the changes to the records stay in
+ * memory, and are never written.
+ */
+static VALUE c_TokenFile;
+
+#define TOKEN_FILE_MAGIC      "VCTF"
+#define TOKEN_FILE_VERSION    1
+#define TOKEN_FILE_BYTE_ORDER 0x01020304
+#define TOKEN_FILE_ALIGN      4096
+#define TOKEN_FILE_NO_SV      0xffffffff
+#define TOKEN_FILE_STRIPES    64
+#define TOKEN_FILE_EACH_BATCH 1024
+
+struct token_file_header {
+  char     magic[4];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t record_size;
+  uint64_t count;
+  uint64_t records_offset;
+  uint64_t index_offset;
+  uint64_t svs_offset;
+  uint32_t sv_count;
+  uint32_t reserved[3];
+};
+
+struct token_file_record {
+  TDigipassBlob dpdata;
+  uint32_t      sv;         /* Index in the static vectors, or TOKEN_FILE_NO_SV */
+  uint32_t      reserved;
+};
+
+struct token_file_index {
+  uint64_t hash;
+  uint64_t record;
+};
+
+typedef char token_file_header_size_check[sizeof(struct token_file_header) == 64 ? 1 : -1];
+typedef char token_file_record_size_check[sizeof(struct token_file_record) == 256 ? 1 : -1];
+
+struct vacman_token_file {
+  pthread_rwlock_t          lock;     /* Held for writing to unmap the file */
+  pthread_mutex_t           stripes[TOKEN_FILE_STRIPES];
+
+  int                       fd;
+  int                       readonly;
+  char                     *map;
+  size_t                    size;
+  struct token_file_header *header;
+  struct token_file_record *records;
+  struct token_file_index  *index;
+  uint64_t                  count;    /* Kept after the file is closed */
+
+  VALUE                    *svs;      /* Interned, so pinned by the registry */
+  uint32_t                  sv_count;
+  uint64_t                  changed;  /* Records changed since opened */
+};
+
+static uint64_t token_file_hash(const char *key) {
+  return vacman_sv_digest(key, VACMAN_TOKEN_KEY_SIZE);
+}
+
+/*
+ * Looks up the record with the given key, or returns NULL.
+ */
+static struct token_file_record *token_file_lookup(struct vacman_token_file *file, const char *key) {
+  uint64_t hash = token_file_hash(key);
+  uint64_t lo = 0, hi = file->count;
+
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+
+    if (file->index[mid].hash < hash) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  for (; lo < file->count && file->index[lo].hash == hash; lo++) {
+    struct token_file_record *record = &file->records[file->index[lo].record];
+    char record_key[VACMAN_TOKEN_KEY_SIZE];
+
+    vacman_token_blob_key(&record->dpdata, record_key);
+
+    if (memcmp(record_key, key, VACMAN_TOKEN_KEY_SIZE) == 0) {
+      return record;
+    }
+  }
+
+  return NULL;
+}
+
+static pthread_mutex_t *token_file_stripe(struct vacman_token_file *file, struct token_file_record *record) {
+  return &file->stripes[(record - file->records) % TOKEN_FILE_STRIPES];
+}
+
+/*
+ * Unmaps and closes the file, with the lock held for writing. The static
+ * vectors are kept until the object is freed, as they are read with the
+ * GVL held, while the file may be closed by another thread.
+ */
+static void token_file_unmap(struct vacman_token_file *file) {
+  if (file->map) {
+    if (!file->readonly) {
+      msync(file->map, file->size, MS_SYNC);
+    }
+
+    munmap(file->map, file->size);
+    file->map = NULL;
+  }
+
+  if (file->fd >= 0) {
+    close(file->fd);
+    file->fd = -1;
+  }
+}
+
+
+/*
+ * Operations on a record, run without the GVL
+ */
+enum token_file_op {
+  TOKEN_FILE_VERIFY,
+  TOKEN_FILE_COPY,
+};
+
+enum token_file_status {
+  TOKEN_FILE_DONE,
+  TOKEN_FILE_NOT_FOUND,
+  TOKEN_FILE_CLOSED,
+};
+
+struct token_file_args {
+  struct vacman_token_file *file;
+  enum token_file_op        op;
+  const char               *key;
+  TKernelParms             *kernel_parms;
+  aat_ascii                *password;
+  aat_int32                 result;
+  TDigipassBlob             dpdata;   /* The copied record */
+  uint32_t                  sv;
+  enum token_file_status    status;
+};
+
+static void *token_file_op_nogvl(void *ptr) {
+  struct token_file_args *args = ptr;
+  struct vacman_token_file *file = args->file;
+
+  pthread_rwlock_rdlock(&file->lock);
+
+  if (file->map == NULL) {
+    pthread_rwlock_unlock(&file->lock);
+    args->status = TOKEN_FILE_CLOSED;
+    return NULL;
+  }
+
+  struct token_file_record *record = token_file_lookup(file, args->key);
+
+  if (record == NULL) {
+    pthread_rwlock_unlock(&file->lock);
+    args->status = TOKEN_FILE_NOT_FOUND;
+    return NULL;
+  }
+
+  pthread_mutex_t *stripe = token_file_stripe(file, record);
+  pthread_mutex_lock(stripe);
+
+  if (args->op == TOKEN_FILE_COPY) {
+    args->dpdata = record->dpdata;
+    args->sv     = record->sv;
+  } else {
+    TDigipassBlob before = record->dpdata;
+    uint64_t replay_key;
+
+    if (!vacman_replay_lookup(&record->dpdata, args->kernel_parms, args->password, &replay_key, &args->result)) {
+      args->result = vacman_window_verify(&record->dpdata, args->kernel_parms, args->password);
+      vacman_replay_store(replay_key, args->result, &record->dpdata, args->kernel_parms);
+    }
+
+    if (memcmp(&before, &record->dpdata, sizeof(before)) != 0) {
+      __atomic_fetch_add(&file->changed, 1, __ATOMIC_RELAXED);
+
+      if (!file->readonly) {
+        uintptr_t page = (uintptr_t)record & ~(uintptr_t)(TOKEN_FILE_ALIGN - 1);
+        uintptr_t end  = (uintptr_t)(record + 1);
+
+        msync((void *)page, end - page, MS_ASYNC);
+      }
+    }
+  }
+
+  pthread_mutex_unlock(stripe);
+  pthread_rwlock_unlock(&file->lock);
+
+  args->status = TOKEN_FILE_DONE;
+  return NULL;
+}
+
+/*
+ * Runs the given operation without the GVL. There is no unblocking
+ * function: it only waits for the verifications of the same stripe, or
+ * for #close to sync the file.
+ */
+static void token_file_op(struct token_file_args *args) {
+  rb_thread_call_without_gvl(token_file_op_nogvl, args, NULL, NULL);
+
+  if (args->status == TOKEN_FILE_CLOSED) {
+    rb_raise(e_VacmanError, "token file closed");
+  }
+}
+
+static VALUE token_file_sv(struct vacman_token_file *file, uint32_t sv) {
+  return sv < file->sv_count ? file->svs[sv] : Qnil;
+}
+
+
+static void token_file_free(void *ptr) {
+  struct vacman_token_file *file = ptr;
+
+  if (file->fd != -2) {
+    token_file_unmap(file);
+
+    for (int i = 0; i < TOKEN_FILE_STRIPES; i++) {
+      pthread_mutex_destroy(&file->stripes[i]);
+    }
+
+    pthread_rwlock_destroy(&file->lock);
+  }
+
+  free(file->svs);
+  xfree(file);
+}
+
+static size_t token_file_memsize(const void *ptr) {
+  const struct vacman_token_file *file = ptr;
+
+  /* The mapping is accounted for by the page cache, not by the heap */
+  return sizeof(*file) + file->sv_count * sizeof(VALUE);
+}
+
+static const rb_data_type_t vacman_token_file_type = {
+  "VacmanController::LowLevel::TokenFile",
+  { NULL, token_file_free, token_file_memsize, },
+  0, 0,
+  0,
+};
+
+static struct vacman_token_file *token_file_get(VALUE obj) {
+  struct vacman_token_file *file = rb_check_typeddata(obj, &vacman_token_file_type);
+
+  if (file->fd == -2) {
+    rb_raise(e_VacmanError, "token file not opened");
+  }
+
+  return file;
+}
+
+static VALUE token_file_alloc(VALUE klass) {
+  struct vacman_token_file *file;
+  VALUE obj = TypedData_Make_Struct(klass, struct vacman_token_file,
+                                    &vacman_token_file_type, file);
+
+  file->fd = -2; /* Not initialized */
+
+  return obj;
+}
+
+/*
+ * Closes the file being opened, and raises an Error with the given message
+ */
+static void token_file_invalid(struct vacman_token_file *file, VALUE path, const char *message) {
+  token_file_unmap(file);
+  rb_raise(e_VacmanError, "invalid token file %"PRIsVALUE": %s", path, message);
+}
+
+/*
+ * Validates the header, the index and the static vectors of the file being
+ * opened, and interns the static vectors.
+ */
+static void token_file_load(struct vacman_token_file *file, VALUE path) {
+  struct token_file_header *header = file->header;
+  uint64_t size = file->size;
+
+  if (size < sizeof(*header) || memcmp(header->magic, TOKEN_FILE_MAGIC, 4) != 0) {
+    token_file_invalid(file, path, "bad magic");
+  }
+
+  if (header->byte_order != TOKEN_FILE_BYTE_ORDER) {
+    token_file_invalid(file, path, "written on a machine with a different byte order");
+  }
+
+  if (header->version != TOKEN_FILE_VERSION || header->record_size != sizeof(struct token_file_record)) {
+    token_file_invalid(file, path, "unsupported version");
+  }
+
+  uint64_t count = header->count;
+
+  if (count > size / sizeof(struct token_file_record) ||
+      header->records_offset % TOKEN_FILE_ALIGN != 0 ||
+      header->records_offset > size ||
+      header->index_offset < header->records_offset + count * sizeof(struct token_file_record) ||
+      header->index_offset > size ||
+      header->svs_offset < header->index_offset + count * sizeof(struct token_file_index) ||
+      header->svs_offset > size) {
+    token_file_invalid(file, path, "truncated");
+  }
+
+  file->count   = count;
+  file->records = (struct token_file_record *)(file->map + header->records_offset);
+  file->index   = (struct token_file_index *)(file->map + header->index_offset);
+
+  for (uint64_t i = 0; i < count; i++) {
+    if (file->index[i].record >= count || (i > 0 && file->index[i].hash < file->index[i - 1].hash)) {
+      token_file_invalid(file, path, "corrupted index");
+    }
+  }
+
+  file->svs = calloc(header->sv_count ? header->sv_count : 1, sizeof(VALUE));
+
+  if (file->svs == NULL) {
+    token_file_unmap(file);
+    rb_memerror();
+  }
+
+  const char *sv = file->map + header->svs_offset;
+  const char *end = file->map + size;
+
+  for (uint32_t i = 0; i < header->sv_count; i++) {
+    uint32_t len;
+
+    if (end - sv < 4 || (memcpy(&len, sv, 4), (uint64_t)(end - sv - 4) < len)) {
+      token_file_invalid(file, path, "truncated static vectors");
+    }
+
+    file->svs[i] = vacman_sv_intern(rb_str_new(sv + 4, len));
+    file->sv_count++;
+    sv += 4 + len;
+  }
+}
+
+/*
+ * TokenFile.new(path, readonly)
+ *
+ * Maps the given token file in memory. If readonly is true, the changes to
+ * the tokens are never written to the file, that may then be opened by
+ * many processes at once.
+ */
+static VALUE vacman_token_file_initialize(VALUE self, VALUE path, VALUE readonly) {
+  struct vacman_token_file *file = rb_check_typeddata(self, &vacman_token_file_type);
+
+  if (file->fd != -2) {
+    rb_raise(e_VacmanError, "token file already opened");
+  }
+
+  FilePathValue(path);
+  path = rb_str_new_frozen(path);
+
+  int fd = open(RSTRING_PTR(path), (RTEST(readonly) ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+
+  if (fd < 0) {
+    rb_sys_fail_str(path);
+  }
+
+  if (flock(fd, (RTEST(readonly) ? LOCK_SH : LOCK_EX) | LOCK_NB) != 0) {
+    int e = errno;
+    close(fd);
+
+    if (e == EWOULDBLOCK) {
+      rb_raise(e_VacmanError, "token file %"PRIsVALUE" in use by another process", path);
+    }
+
+    errno = e;
+    rb_sys_fail_str(path);
+  }
+
+  struct stat st;
+
+  if (fstat(fd, &st) != 0) {
+    int e = errno;
+    close(fd);
+    errno = e;
+    rb_sys_fail_str(path);
+  }
+
+  pthread_rwlock_init(&file->lock, NULL);
+
+  for (int i = 0; i < TOKEN_FILE_STRIPES; i++) {
+    pthread_mutex_init(&file->stripes[i], NULL);
+  }
+
+  file->fd       = fd;
+  file->readonly = RTEST(readonly);
+  file->size     = st.st_size;
+
+  if (file->size > 0) {
+    /* Read-only files are mapped privately: changes stay in memory */
+    void *map = mmap(NULL, file->size, PROT_READ | PROT_WRITE,
+                     file->readonly ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED) {
+      int e = errno;
+      token_file_unmap(file);
+      errno = e;
+      rb_sys_fail_str(path);
+    }
+
+    file->map = map;
+
+    /* Lookups hit the index and the records at random */
+    madvise(map, file->size, MADV_RANDOM);
+  }
+
+  file->header = (struct token_file_header *)file->map;
+  token_file_load(file, path);
+
+  return self;
+}
+
+
+static int token_file_index_cmp(const void *a, const void *b) {
+  const struct token_file_index *x = a, *y = b;
+
+  if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+  return x->record < y->record ? -1 : x->record > y->record;
+}
+
+static void token_file_write_all(int fd, const void *buf, size_t len, VALUE path) {
+  const char *p = buf;
+
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      rb_sys_fail_str(path);
+    }
+
+    p   += n;
+    len -= n;
+  }
+}
+
+struct token_file_write_args {
+  VALUE  path, tmp;
+  int    fd;
+  VALUE  svs;
+  char  *records;
+  char  *index;
+  long   count;
+};
+
+static VALUE token_file_write_body(VALUE ptr) {
+  struct token_file_write_args *args = (struct token_file_write_args *)ptr;
+  struct token_file_header header;
+  char pad[TOKEN_FILE_ALIGN];
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TOKEN_FILE_MAGIC, 4);
+  header.version        = TOKEN_FILE_VERSION;
+  header.byte_order     = TOKEN_FILE_BYTE_ORDER;
+  header.record_size    = sizeof(struct token_file_record);
+  header.count          = args->count;
+  header.records_offset = TOKEN_FILE_ALIGN;
+  header.index_offset   = header.records_offset + args->count * sizeof(struct token_file_record);
+  header.svs_offset     = header.index_offset + args->count * sizeof(struct token_file_index);
+  header.sv_count       = RARRAY_LEN(args->svs);
+
+  memset(pad, 0, sizeof(pad));
+  memcpy(pad, &header, sizeof(header));
+
+  token_file_write_all(args->fd, pad, sizeof(pad), args->tmp);
+  token_file_write_all(args->fd, args->records, args->count * sizeof(struct token_file_record), args->tmp);
+  token_file_write_all(args->fd, args->index, args->count * sizeof(struct token_file_index), args->tmp);
+
+  for (long i = 0; i < RARRAY_LEN(args->svs); i++) {
+    VALUE sv = RARRAY_AREF(args->svs, i);
+    uint32_t len = RSTRING_LEN(sv);
+
+    token_file_write_all(args->fd, &len, 4, args->tmp);
+    token_file_write_all(args->fd, RSTRING_PTR(sv), len, args->tmp);
+  }
+
+  if (fsync(args->fd) != 0) {
+    rb_sys_fail_str(args->tmp);
+  }
+
+  if (close(args->fd) != 0) {
+    args->fd = -1;
+    rb_sys_fail_str(args->tmp);
+  }
+
+  args->fd = -1;
+
+  if (rename(RSTRING_PTR(args->tmp), RSTRING_PTR(args->path)) != 0) {
+    rb_sys_fail_str(args->path);
+  }
+
+  args->tmp = Qnil;
+
+  return Qnil;
+}
+
+static VALUE token_file_write_ensure(VALUE ptr) {
+  struct token_file_write_args *args = (struct token_file_write_args *)ptr;
+
+  if (args->fd >= 0) {
+    close(args->fd);
+  }
+
+  if (!NIL_P(args->tmp)) {
+    unlink(RSTRING_PTR(args->tmp));
+  }
+
+  return Qnil;
+}
+
+/*
+ * TokenFile.write(path, tokens)
+ *
+ * Writes the given Array of token hashes or Digipass into a new token file,
+ * replacing the given path atomically, and returns the number of tokens.
+ */
+static VALUE vacman_token_file_s_write(VALUE klass, VALUE path, VALUE tokens) {
+  Check_Type(tokens, T_ARRAY);
+  FilePathValue(path);
+
+  /* Private copies, so that they cannot change under our feet */
+  path   = rb_str_new_frozen(path);
+  tokens = rb_ary_dup(tokens);
+
+  long count = RARRAY_LEN(tokens);
+
+  /* Ruby Strings as buffers, so they are reclaimed if anything raises */
+  VALUE records_buf = rb_str_new(NULL, count * sizeof(struct token_file_record));
+  VALUE index_buf   = rb_str_new(NULL, count * sizeof(struct token_file_index));
+  VALUE svs         = rb_ary_new();
+  VALUE last_sv     = Qnil;
+  uint32_t last_sv_index = TOKEN_FILE_NO_SV;
+
+  struct token_file_record *records = (struct token_file_record *)RSTRING_PTR(records_buf);
+  struct token_file_index  *index   = (struct token_file_index *)RSTRING_PTR(index_buf);
+
+  for (long i = 0; i < count; i++) {
+    VALUE token = RARRAY_AREF(tokens, i);
+    struct vacman_digipass *digipass = vacman_digipass_get(token);
+    struct token_file_record *record = &records[i];
+    VALUE sv;
+
+    memset(record, 0, sizeof(*record));
+
+    if (digipass) {
+      record->dpdata = digipass->dpdata;
+      sv = digipass->sv;
+    } else {
+      vacman_rbhash_to_digipass(token, &record->dpdata);
+      sv = vacman_rbhash_get_sv(token);
+
+      if (!NIL_P(sv)) {
+        sv = vacman_sv_intern(sv);
+      }
+    }
+
+    /* Tokens of the same DPX come in a row and share the static vector */
+    if (NIL_P(sv)) {
+      record->sv = TOKEN_FILE_NO_SV;
+    } else if (sv == last_sv) {
+      record->sv = last_sv_index;
+    } else {
+      long j;
+
+      for (j = 0; j < RARRAY_LEN(svs) && RARRAY_AREF(svs, j) != sv; j++);
+      if (j == RARRAY_LEN(svs)) rb_ary_push(svs, sv);
+
+      record->sv = last_sv_index = j;
+      last_sv = sv;
+    }
+
+    char key[VACMAN_TOKEN_KEY_SIZE];
+    vacman_token_blob_key(&record->dpdata, key);
+
+    index[i].hash   = token_file_hash(key);
+    index[i].record = i;
+  }
+
+  qsort(index, count, sizeof(*index), token_file_index_cmp);
+
+  for (long i = 1; i < count; i++) {
+    char a[VACMAN_TOKEN_KEY_SIZE], b[VACMAN_TOKEN_KEY_SIZE];
+
+    for (long j = i - 1; j >= 0 && index[j].hash == index[i].hash; j--) {
+      vacman_token_blob_key(&records[index[i].record].dpdata, a);
+      vacman_token_blob_key(&records[index[j].record].dpdata, b);
+
+      if (memcmp(a, b, VACMAN_TOKEN_KEY_SIZE) == 0) {
+        rb_raise(e_VacmanError, "duplicate token %.*s given",
+                 (int)VACMAN_SERIAL_SIZE, records[index[i].record].dpdata.Serial);
+      }
+    }
+  }
+
+  struct token_file_write_args args;
+
+  args.path    = path;
+  args.tmp     = rb_str_plus(path, rb_sprintf(".%d.tmp", (int)getpid()));
+  args.svs     = svs;
+  args.records = (char *)records;
+  args.index   = (char *)index;
+  args.count   = count;
+  args.fd      = open(RSTRING_PTR(args.tmp), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+  if (args.fd < 0) {
+    rb_sys_fail_str(args.tmp);
+  }
+
+  rb_ensure(token_file_write_body, (VALUE)&args, token_file_write_ensure, (VALUE)&args);
+
+  RB_GC_GUARD(records_buf);
+  RB_GC_GUARD(index_buf);
+
+  return LONG2NUM(count);
+}
+
+
+/*
+ * TokenFile#verify(serial, app_name, password, params = nil)
+ *
+ * Verifies the given OTP against the given token, in place in the file,
+ * and returns the AAL2 result code, 0 meaning success, or nil if the token
+ * is not in the file.
+ */
+static VALUE vacman_token_file_verify(int argc, VALUE *argv, VALUE self) {
+  VALUE serial, app_name, password, params;
+  rb_scan_args(argc, argv, "31", &serial, &app_name, &password, &params);
+
+  struct token_file_args args;
+  char key[VACMAN_TOKEN_KEY_SIZE];
+  TKernelParms kernel_parms;
+
+  memset(&args, 0, sizeof(args));
+  args.file = token_file_get(self);
+
+  vacman_token_key(serial, app_name, key);
+  vacman_kernel_params_snapshot(params, &kernel_parms);
+
+  /* Read by AAL2 without the GVL, so it must not change under our feet */
+  password = rb_str_new_frozen(StringValue(password));
+
+  args.op           = TOKEN_FILE_VERIFY;
+  args.key          = key;
+  args.kernel_parms = &kernel_parms;
+  args.password     = rb_string_value_cstr(&password);
+
+  token_file_op(&args);
+
+  RB_GC_GUARD(password);
+
+  return args.status == TOKEN_FILE_DONE ? INT2FIX(args.result) : Qnil;
+}
+
+/*
+ * TokenFile#fetch(serial, app_name)
+ *
+ * Returns a copy of the given token as a Digipass, or nil if the token is
+ * not in the file.
+ */
+static VALUE vacman_token_file_fetch(VALUE self, VALUE serial, VALUE app_name) {
+  struct token_file_args args;
+  char key[VACMAN_TOKEN_KEY_SIZE];
+
+  memset(&args, 0, sizeof(args));
+  args.file = token_file_get(self);
+
+  vacman_token_key(serial, app_name, key);
+
+  args.op  = TOKEN_FILE_COPY;
+  args.key = key;
+
+  token_file_op(&args);
+
+  if (args.status != TOKEN_FILE_DONE) {
+    return Qnil;
+  }
+
+  return vacman_digipass_new(&args.dpdata, token_file_sv(args.file, args.sv));
+}
+
+
+struct token_file_each_args {
+  struct vacman_token_file *file;
+  struct token_file_record *batch;
+  uint64_t                  from, count;
+  int                       closed;
+};
+
+/*
+ * Copies a batch of records, in file order
+ */
+static void *token_file_copy_nogvl(void *ptr) {
+  struct token_file_each_args *args = ptr;
+  struct vacman_token_file *file = args->file;
+
+  pthread_rwlock_rdlock(&file->lock);
+
+  if (file->map == NULL) {
+    args->closed = 1;
+  } else {
+    for (uint64_t i = 0; i < args->count; i++) {
+      struct token_file_record *record = &file->records[args->from + i];
+      pthread_mutex_t *stripe = token_file_stripe(file, record);
+
+      pthread_mutex_lock(stripe);
+      args->batch[i] = *record;
+      pthread_mutex_unlock(stripe);
+    }
+  }
+
+  pthread_rwlock_unlock(&file->lock);
+
+  return NULL;
+}
+
+static VALUE token_file_each_body(VALUE ptr) {
+  struct token_file_each_args *args = (struct token_file_each_args *)ptr;
+  uint64_t total = args->file->count;
+
+  for (uint64_t from = 0; from < total; from += TOKEN_FILE_EACH_BATCH) {
+    args->from  = from;
+    args->count = total - from < TOKEN_FILE_EACH_BATCH ? total - from : TOKEN_FILE_EACH_BATCH;
+
+    rb_thread_call_without_gvl(token_file_copy_nogvl, args, NULL, NULL);
+
+    if (args->closed) {
+      rb_raise(e_VacmanError, "token file closed");
+    }
+
+    for (uint64_t i = 0; i < args->count; i++) {
+      rb_yield(vacman_digipass_new(&args->batch[i].dpdata, token_file_sv(args->file, args->batch[i].sv)));
+    }
+  }
+
+  return Qnil;
+}
+
+static VALUE token_file_each_ensure(VALUE ptr) {
+  struct token_file_each_args *args = (struct token_file_each_args *)ptr;
+
+  xfree(args->batch);
+
+  return Qnil;
+}
+
+/*
+ * TokenFile#each { |digipass| ... }
+ *
+ * Yields a copy of every token as a Digipass, in file order.
+ */
+static VALUE vacman_token_file_each(VALUE self) {
+  RETURN_ENUMERATOR(self, 0, 0);
+
+  struct vacman_token_file *file = token_file_get(self);
+
+  if (file->map == NULL) {
+    rb_raise(e_VacmanError, "token file closed");
+  }
+
+  struct token_file_each_args args = { file, NULL, 0, 0, 0 };
+
+  args.batch = ALLOC_N(struct token_file_record, TOKEN_FILE_EACH_BATCH);
+
+  rb_ensure(token_file_each_body, (VALUE)&args, token_file_each_ensure, (VALUE)&args);
+
+  return self;
+}
+
+
+static void *token_file_sync_nogvl(void *ptr) {
+  struct vacman_token_file *file = ptr;
+
+  pthread_rwlock_rdlock(&file->lock);
+  if (file->map && !file->readonly) {
+    msync(file->map, file->size, MS_SYNC);
+  }
+  pthread_rwlock_unlock(&file->lock);
+
+  return NULL;
+}
+
+/*
+ * TokenFile#sync
+ *
+ * Waits until the changed records are written to the file.
+ */
+static VALUE vacman_token_file_sync(VALUE self) {
+  rb_thread_call_without_gvl(token_file_sync_nogvl, token_file_get(self), NULL, NULL);
+
+  return Qnil;
+}
+
+static void *token_file_close_nogvl(void *ptr) {
+  struct vacman_token_file *file = ptr;
+
+  pthread_rwlock_wrlock(&file->lock);
+  token_file_unmap(file);
+  pthread_rwlock_unlock(&file->lock);
+
+  return NULL;
+}
+
+/*
+ * TokenFile#close
+ *
+ * Writes the changed records, waiting for the verifications running, and
+ * unmaps the file.
+ */
+static VALUE vacman_token_file_close(VALUE self) {
+  rb_thread_call_without_gvl(token_file_close_nogvl, token_file_get(self), NULL, NULL);
+
+  return Qnil;
+}
+
+/*
+ * TokenFile#closed?
+ */
+static VALUE vacman_token_file_closed_p(VALUE self) {
+  return token_file_get(self)->fd < 0 ? Qtrue : Qfalse;
+}
+
+/*
+ * TokenFile#size
+ */
+static VALUE vacman_token_file_size(VALUE self) {
+  return ULL2NUM(token_file_get(self)->count);
+}
+
+/*
+ * TokenFile#changed
+ *
+ * The number of verifications that changed a record since the file was
+ * opened.
+ */
+static VALUE vacman_token_file_changed(VALUE self) {
+  return ULL2NUM(__atomic_load_n(&token_file_get(self)->changed, __ATOMIC_RELAXED));
+}
+
+
+/*
+ * Define the TokenFile class
+ */
+void vacman_tokenfile_init(VALUE lowlevel) {
+  c_TokenFile = rb_define_class_under(lowlevel, "TokenFile", rb_cObject);
+  rb_define_alloc_func(c_TokenFile, token_file_alloc);
+
+  rb_define_singleton_method(c_TokenFile, "write", vacman_token_file_s_write, 2);
+
+  rb_define_method(c_TokenFile, "initialize", vacman_token_file_initialize, 2);
+  rb_define_method(c_TokenFile, "verify",     vacman_token_file_verify, -1);
+  rb_define_method(c_TokenFile, "fetch",      vacman_token_file_fetch, 2);
+  rb_define_method(c_TokenFile, "each",       vacman_token_file_each, 0);
+  rb_define_method(c_TokenFile, "sync",       vacman_token_file_sync, 0);
+  rb_define_method(c_TokenFile, "close",      vacman_token_file_close, 0);
+  rb_define_method(c_TokenFile, "closed?",    vacman_token_file_closed_p, 0);
+  rb_define_method(c_TokenFile, "size",       vacman_token_file_size, 0);
+  rb_define_method(c_TokenFile, "changed",    vacman_token_file_changed, 0);
+}
@@ -10,43 +10,180 @@ extern "C" {
 
 #include <ruby.h>
 #include <string.h>
+#include <pthread.h>
 #include <aal2sdk.h>
 
-/* The Vacman default kernel parameters, set up upon extension initialisation. */
-TKernelParms g_KernelParms;
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+#include <ruby/ractor.h>
+
+/* Frozen objects handed out to every Ractor must be flagged as shareable */
+#define VACMAN_SHAREABLE(obj) rb_ractor_make_shareable(obj)
+#else
+#define VACMAN_SHAREABLE(obj) (obj)
+#endif
 
 /* Ruby exception type, defined as VacmanController::Error in Ruby land. */
 VALUE e_VacmanError;
 
 /* General methods (main.c) */
+VALUE vacman_library_error_new(const char* method, int vacman_error_code);
 void vacman_library_error(const char* method, int vacman_error_code);
 VALUE vacman_library_version(VALUE unused);
 
 /* Kernel methods (kernel.c) */
-VALUE vacman_kernel_get_property_names();
+VALUE vacman_kernel_get_property_names(VALUE module);
 VALUE vacman_kernel_get_param(VALUE module, VALUE paramname);
 VALUE vacman_kernel_set_param(VALUE module, VALUE paramname, VALUE rbval);
-void vacman_kernel_init_params();
+void vacman_kernel_params_snapshot(VALUE params, TKernelParms *kernel_parms);
+void vacman_kernel_init_params(VALUE controller);
 
 /* Token methods (token.c) */
-VALUE vacman_token_get_property_names();
-VALUE vacman_token_get_property(VALUE module, VALUE token, VALUE property);
-VALUE vacman_token_set_property(VALUE module, VALUE token, VALUE property, VALUE rbval);
-VALUE vacman_token_set_pin(VALUE module, VALUE token, VALUE pin);
-VALUE vacman_token_reset_info(VALUE module, VALUE token);
-VALUE vacman_token_verify_password(VALUE module, VALUE token, VALUE password);
-VALUE vacman_token_generate_password(VALUE module, VALUE token);
+void vacman_token_init(void);
+VALUE vacman_token_get_property_names(VALUE module);
+VALUE vacman_token_get_property_ids(VALUE module);
+VALUE vacman_token_get_property(int argc, VALUE *argv, VALUE module);
+VALUE vacman_token_get_properties(int argc, VALUE *argv, VALUE module);
+VALUE vacman_token_set_property(int argc, VALUE *argv, VALUE module);
+VALUE vacman_token_set_pin(int argc, VALUE *argv, VALUE module);
+VALUE vacman_token_reset_info(int argc, VALUE *argv, VALUE module);
+VALUE vacman_token_verify_password(int argc, VALUE *argv, VALUE module);
+VALUE vacman_token_verify_password_status(int argc, VALUE *argv, VALUE module);
+VALUE vacman_token_verify_passwords(int argc, VALUE *argv, VALUE module);
+VALUE vacman_token_generate_password(int argc, VALUE *argv, VALUE module);
+
+/* Native token representation (digipass.c) */
+struct vacman_digipass {
+  TDigipassBlob dpdata;
+  VALUE sv;             /* The static vector as a frozen String, or nil */
+  int dirty;            /* The blob changed since it was last persisted */
+};
+
+struct vacman_digipass *vacman_digipass_get(VALUE obj);
+VALUE vacman_digipass_new(const TDigipassBlob *dpdata, VALUE sv);
+void vacman_digipass_init(VALUE lowlevel);
 
 /* Token interchange format between Ruby and libaal2 (serialize.c) */
+void vacman_serialize_init(void);
+
 void vacman_digipass_to_rbhash(TDigipassBlob* dpdata, VALUE hash);
-void vacman_digipass_to_rbhash_sv(TDigipassBlob* dpdata, aat_ascii* dpsv, VALUE hash);
 
 void vacman_rbhash_to_digipass(VALUE token, TDigipassBlob* dpdata);
 void vacman_rbhash_to_digipass_sv(VALUE token, TDigipassBlob* dpdata, aat_ascii* dpsv, aat_int32 dpsv_len);
 
+VALUE vacman_rbhash_get_sv(VALUE hash);
+VALUE vacman_rbhash_fetch_sv(VALUE token);
+void vacman_rbhash_set_sv(VALUE hash, VALUE sv);
+
+/* AAL2 calls performed without holding the GVL (aal2.c) */
+aat_int32 vacman_aal2_verify_password(TDigipassBlob *dpdata, TKernelParms *kernel_parms, aat_ascii *password);
+long vacman_aal2_verify_passwords(TDigipassBlob *dpdata, TKernelParms *kernel_parms, aat_ascii **passwords,
+                                  aat_int32 *results, const char *skip, long from, long count);
+aat_int32 vacman_aal2_generate_password(TDigipassBlob *dpdata, TKernelParms *kernel_parms, aat_ascii *password);
+aat_int32 vacman_aal2_dpx_init(TDPXHandle *dpx_handle, aat_ascii *filename, aat_ascii *key,
+                               aat_int16 *appl_count, aat_ascii *appl_names, aat_int16 *token_count);
+aat_int32 vacman_aal2_dpx_get_token(TDPXHandle *dpx_handle, TKernelParms *kernel_parms, aat_ascii *appl_names,
+                                    aat_ascii *serial, aat_ascii *type, aat_ascii *authmode, TDigipassBlob *dpdata);
+aat_int32 vacman_aal2_gen_activation(TDigipassBlob **dpdata_ary, aat_int32 appl_count, TKernelParms *kernel_parms,
+                                     aat_ascii *static_vector, aat_int32 *actv_flags, aat_ascii *serial_num,
+                                     aat_ascii *actv_code);
+
+/* Bulk OTP generation on scratch copies of the tokens (generate.c) */
+VALUE vacman_generate_passwords(int argc, VALUE *argv, VALUE module);
+VALUE vacman_generate_passwords_bulk(int argc, VALUE *argv, VALUE module);
+
+/* Native worker threads and their result queue (pool.c) */
+struct vacman_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t  readable;   /* An item was pushed, or a worker exited */
+  pthread_cond_t  writable;   /* An item was popped, or the pool was cancelled */
+
+  void    **items;            /* The queue, a ring buffer of capacity items */
+  long      capacity, head, count;
+
+  pthread_t *threads;
+  long      workers, running; /* Started and still running workers */
+  long      jobs, next;       /* Total jobs, and the next one to pick */
+
+  int       cancelled;        /* The workers must stop */
+  int       interrupted;      /* The Ruby thread waiting in pop must wake up */
+  int       nomem;            /* A worker could not allocate memory */
+
+  void    (*work)(struct vacman_pool *pool, long job);
+  void    (*free_item)(void *item);
+  void     *data;
+};
+
+void vacman_pool_start(struct vacman_pool *pool, long workers, long jobs, long capacity);
+int vacman_pool_push(struct vacman_pool *pool, void *item);
+void *vacman_pool_alloc(struct vacman_pool *pool, size_t size);
+int vacman_pool_cancelled(struct vacman_pool *pool);
+void *vacman_pool_pop(struct vacman_pool *pool);
+void vacman_pool_finish(struct vacman_pool *pool);
+
+/* Call counters and latency histograms (stats.c) */
+enum vacman_stat {
+  STAT_VERIFY_PASSWORD,
+  STAT_GEN_PASSWORD,
+  STAT_GET_TOKEN_PROPERTY,
+  STAT_SET_TOKEN_PROPERTY,
+  STAT_CHANGE_STATIC_PASSWORD,
+  STAT_RESET_TOKEN_INFO,
+  STAT_DPX_INIT,
+  STAT_DPX_GET_STATIC_VECTOR,
+  STAT_DPX_GET_TOKEN,
+  STAT_GEN_ACTIVATION,
+  STAT_MARSHAL,         /* Token hash to TDigipassBlob */
+  STAT_UNMARSHAL,       /* TDigipassBlob to token hash */
+  STAT_COUNT
+};
+
+uint64_t vacman_stats_start(void);
+void vacman_stats_record(enum vacman_stat stat, uint64_t start, aat_int32 result);
+void vacman_stats_init(VALUE lowlevel);
+
+/* Cache of the recently verified OTPs (replay.c) */
+int vacman_replay_lookup(TDigipassBlob *dpdata, TKernelParms *kernel_parms, const aat_ascii *password,
+                         uint64_t *key, aat_int32 *result);
+void vacman_replay_store(uint64_t key, aat_int32 result, TDigipassBlob *dpdata, TKernelParms *kernel_parms);
+void vacman_replay_init(VALUE lowlevel);
+
+/* Narrow verification window tried first (window.c) */
+aat_int32 vacman_window_verify(TDigipassBlob *dpdata, TKernelParms *kernel_parms, aat_ascii *password);
+void vacman_window_init(VALUE lowlevel);
+
+/* Verifications completed through a pipe (async.c) */
+void vacman_async_init(VALUE lowlevel);
+
+/* Sharded in-memory token store (store.c) */
+#define VACMAN_SERIAL_SIZE    sizeof(((TDigipassBlob *)0)->Serial)
+#define VACMAN_APP_NAME_SIZE  sizeof(((TDigipassBlob *)0)->AppName)
+#define VACMAN_TOKEN_KEY_SIZE (VACMAN_SERIAL_SIZE + VACMAN_APP_NAME_SIZE)
+
+void vacman_token_key(VALUE serial, VALUE app_name, char *key);
+void vacman_token_blob_key(const TDigipassBlob *dpdata, char *key);
+void vacman_store_init(VALUE lowlevel);
+
+/* Stream of the verification outcomes (audit.c) */
+void vacman_audit_verify(TDigipassBlob *dpdata, TKernelParms *kernel_parms, aat_int32 result);
+void vacman_audit_init(VALUE lowlevel);
+
+/* Memory-mapped token file (tokenfile.c) */
+void vacman_tokenfile_init(VALUE lowlevel);
+
+/* Registry of the static vectors (sv.c) */
+uint64_t vacman_sv_digest(const char *sv, long len);
+VALUE vacman_sv_lookup(uint64_t digest);
+VALUE vacman_sv_intern(VALUE sv);
+VALUE vacman_sv_digest_hex(uint64_t digest);
+uint64_t vacman_sv_digest_parse(VALUE hex);
+void vacman_sv_init(VALUE lowlevel);
+
 /* DPX methods (dpx.c) */
-VALUE vacman_dpx_import(VALUE module, VALUE filename, VALUE key);
-VALUE vacman_dpx_generate_token_activation(VALUE module, VALUE token);
+VALUE vacman_dpx_import(int argc, VALUE *argv, VALUE module);
+VALUE vacman_dpx_import_each(int argc, VALUE *argv, VALUE module);
+VALUE vacman_dpx_import_files(int argc, VALUE *argv, VALUE module);
+VALUE vacman_dpx_generate_token_activation(int argc, VALUE *argv, VALUE module);
+VALUE vacman_dpx_generate_activations(int argc, VALUE *argv, VALUE module);
 
 #if defined(__cplusplus)
 #if 0
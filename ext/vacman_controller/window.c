@@ -0,0 +1,175 @@
+/*
+ * Vacman Controller wrapper
+ *
+ * This Ruby Extension wraps the VASCO Vacman Controller
+ * library and makes its API accessible to Ruby code.
+ *
+ * (C) 2013 https://github.com/mlankenau
+ * (C) 2019 m.barnaba@ifad.org
+ */
+#include "vacman_controller.h"
+
+/*
+ * Adaptive verification window.
+ *
+ * AAL2VerifyPassword searches ITimeWindow time steps, or EventWindow events,
+ * around the time shift and event counter recorded in the token by its last
+ * successful verification. The windows must be wide enough for the worst
+ * token, yet a token that was verified before has a known drift, and its
+ * OTPs almost always fall within a few steps of it.
+ *
+ * When enabled, tokens with a known drift, that is that were verified
+ * successfully before as their use_count tells, are verified first with
+ * narrow windows on a scratch copy of the blob. If the OTP is accepted the copy is adopted, otherwise the OTP is
+ * verified again on the token with the full windows. So a narrow attempt
+ * that fails never counts as an error nor alters the token, and tokens
+ * that drifted further are still resynchronised as before.
+ *
+ * Tokens that were never verified go straight to the full windows. An
+ * OTP that is not valid costs a property read and two verifications, so
+ * brute force attempts on a known token cost about twice as much.
+ *
+ * It is disabled by default, and enabled via configure_adaptive_window.
+ */
+static int window_time;   /* Narrow ITimeWindow, 0 if disabled */
+static int window_event;  /* Narrow EventWindow */
+
+static struct {
+  uint64_t narrow;        /* Accepted within the narrow windows */
+  uint64_t widened;       /* Verified again with the full windows */
+  uint64_t unknown;       /* No known drift, full windows only */
+} window_stats __attribute__((aligned(64)));
+
+#define WINDOW_COUNT(counter) __atomic_fetch_add(&window_stats.counter, 1, __ATOMIC_RELAXED)
+
+/*
+ * Returns whether the given token was verified successfully before, so
+ * that its time shift and event counter are known. The last_time_shift of
+ * a time based token that was never verified reads 0, so the use_count is
+ * checked instead.
+ */
+static int window_known_drift(TDigipassBlob *dpdata, TKernelParms *kernel_parms) {
+  aat_ascii value[64];
+  char *end;
+
+  uint64_t start = vacman_stats_start();
+  aat_int32 result = AAL2GetTokenProperty(dpdata, kernel_parms, USE_COUNT, value);
+  vacman_stats_record(STAT_GET_TOKEN_PROPERTY, start, result);
+
+  if (result != 0) {
+    return 0;
+  }
+
+  long use_count = strtol(value, &end, 10);
+
+  return end != value && *end == '\0' && use_count > 0;
+}
+
+/*
+ * AAL2VerifyPassword with the adaptive window, called without the GVL.
+ *
+ * Records a single STAT_VERIFY_PASSWORD call, whatever the number of AAL2
+ * calls it took, and audits the outcome.
+ */
+aat_int32 vacman_window_verify(TDigipassBlob *dpdata, TKernelParms *kernel_parms, aat_ascii *password) {
+  int time  = __atomic_load_n(&window_time, __ATOMIC_RELAXED);
+  int event = __atomic_load_n(&window_event, __ATOMIC_RELAXED);
+
+  uint64_t start = vacman_stats_start();
+  aat_int32 result;
+
+  if (time > 0 && (time < kernel_parms->ITimeWindow || event < kernel_parms->EventWindow)) {
+    if (window_known_drift(dpdata, kernel_parms)) {
+      TKernelParms narrow_parms = *kernel_parms;
+      TDigipassBlob scratch = *dpdata;
+
+      if (time  < narrow_parms.ITimeWindow) narrow_parms.ITimeWindow = time;
+      if (event < narrow_parms.EventWindow) narrow_parms.EventWindow = event;
+
+      result = AAL2VerifyPassword(&scratch, &narrow_parms, password, 0);
+
+      if (result == 0) {
+        *dpdata = scratch;
+        WINDOW_COUNT(narrow);
+        vacman_stats_record(STAT_VERIFY_PASSWORD, start, result);
+        vacman_audit_verify(dpdata, kernel_parms, result);
+        return result;
+      }
+
+      WINDOW_COUNT(widened);
+    } else {
+      WINDOW_COUNT(unknown);
+    }
+  }
+
+  result = AAL2VerifyPassword(dpdata, kernel_parms, password, 0);
+
+  vacman_stats_record(STAT_VERIFY_PASSWORD, start, result);
+  vacman_audit_verify(dpdata, kernel_parms, result);
+
+  return result;
+}
+
+
+/*
+ * LowLevel.configure_adaptive_window(time_window, event_window)
+ *
+ * Sets the narrow ITimeWindow and EventWindow tried first. A time_window
+ * of 0 disables the adaptive window.
+ */
+static VALUE vacman_window_configure(VALUE module, VALUE time, VALUE event) {
+  int time_window  = NUM2INT(time);
+  int event_window = NUM2INT(event);
+
+  if (time_window < 0) {
+    rb_raise(rb_eArgError, "invalid time window given: %d", time_window);
+  }
+
+  if (event_window < 0) {
+    rb_raise(rb_eArgError, "invalid event window given: %d", event_window);
+  }
+
+  __atomic_store_n(&window_event, event_window, __ATOMIC_RELAXED);
+  __atomic_store_n(&window_time,  time_window,  __ATOMIC_RELAXED);
+
+  return Qnil;
+}
+
+/*
+ * LowLevel.adaptive_window_stats
+ *
+ * Returns the narrow windows, and the number of verifications accepted
+ * within them, widened to the full windows, or with no known drift.
+ */
+static VALUE vacman_window_stats(VALUE module) {
+  VALUE ret = rb_hash_new();
+
+  rb_hash_aset(ret, rb_str_new2("time_window"),  INT2FIX(__atomic_load_n(&window_time, __ATOMIC_RELAXED)));
+  rb_hash_aset(ret, rb_str_new2("event_window"), INT2FIX(__atomic_load_n(&window_event, __ATOMIC_RELAXED)));
+  rb_hash_aset(ret, rb_str_new2("narrow"),  ULL2NUM(__atomic_load_n(&window_stats.narrow, __ATOMIC_RELAXED)));
+  rb_hash_aset(ret, rb_str_new2("widened"), ULL2NUM(__atomic_load_n(&window_stats.widened, __ATOMIC_RELAXED)));
+  rb_hash_aset(ret, rb_str_new2("unknown"), ULL2NUM(__atomic_load_n(&window_stats.unknown, __ATOMIC_RELAXED)));
+
+  return ret;
+}
+
+/*
+ * LowLevel.reset_adaptive_window_stats
+ */
+static VALUE vacman_window_reset_stats(VALUE module) {
+  __atomic_store_n(&window_stats.narrow,  0, __ATOMIC_RELAXED);
+  __atomic_store_n(&window_stats.widened, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&window_stats.unknown, 0, __ATOMIC_RELAXED);
+
+  return Qnil;
+}
+
+
+/*
+ * Define the adaptive window methods
+ */
+void vacman_window_init(VALUE lowlevel) {
+  rb_define_singleton_method(lowlevel, "configure_adaptive_window",   vacman_window_configure, 2);
+  rb_define_singleton_method(lowlevel, "adaptive_window_stats",       vacman_window_stats, 0);
+  rb_define_singleton_method(lowlevel, "reset_adaptive_window_stats", vacman_window_reset_stats, 0);
+}
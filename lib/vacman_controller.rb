@@ -1,6 +1,13 @@
+require 'etc'
 require 'vacman_controller/vacman_low_level'
 require 'vacman_controller/token'
+require 'vacman_controller/async_verifier'
+require 'vacman_controller/token_store'
+require 'vacman_controller/token_file'
+require 'vacman_controller/audit_stream'
+require 'vacman_controller/ractor_pool' if defined?(Ractor)
 require 'vacman_controller/kernel'
+require 'vacman_controller/kernel_params'
 require 'vacman_controller/error'
 
 # Wraps VACMAN Controller functionality for Ruby.
@@ -30,21 +37,120 @@ module VacmanController
     # +VacmanController::Token.import+.
     #
     def import(filename, key)
-      VacmanController::LowLevel.import(filename, key)
+      dpx_errors do
+        VacmanController::LowLevel.import(filename, key)
+      end
+    end
+
+    # Imports a .dpx file like +import+ does, but yields each token hash to
+    # the given block as soon as it is read, instead of returning them all,
+    # so that memory use stays constant regardless of the DPX size. All the
+    # yielded hashes share the same frozen static vector String.
+    #
+    # == Parameters:
+    #
+    # filename::
+    #   The path of the .dpx file to load
+    #
+    # key::
+    #   The transport key to decrypt the dpx file
+    #
+    # chunk::
+    #   If given, Arrays of at most this many token hashes are yielded
+    #
+    # == Returns:
+    # An Enumerator if no block is given.
+    #
+    def each_token(filename, key, chunk: nil, &block)
+      return enum_for(__method__, filename, key, chunk: chunk) unless block
+
+      dpx_errors do
+        VacmanController::LowLevel.import_each(filename, key, chunk, &block)
+      end
+    end
+
+    # Imports many .dpx files at once, decoding them concurrently on a pool
+    # of native threads, each one working on a different file.
+    #
+    # Token hashes are yielded in batches as soon as they are decoded, along
+    # with the name of their file, so that they can be stored while the
+    # other files are still being read. When the block does not keep up,
+    # the workers wait for it, so memory use is bounded by the number of
+    # workers and the batch size.
+    #
+    # A file that cannot be imported does not stop the others. If no block
+    # is given, an Enumerator is returned.
+    #
+    # == Parameters:
+    #
+    # filenames::
+    #   The paths of the .dpx files to load, each one given once
+    #
+    # key::
+    #   The transport key to decrypt the dpx files, or an Array with the
+    #   transport key of each file
+    #
+    # workers::
+    #   How many files to decode at once, defaults to the number of CPUs
+    #
+    # batch::
+    #   How many token hashes to yield at most at once
+    #
+    # progress::
+    #   If given, it is called with the file name and the number of tokens
+    #   imported so far from that file, after each batch
+    #
+    # == Returns:
+    # A Hash keyed by file name, with either the number of imported tokens
+    # or the +VacmanController::Error+ that stopped the import of the file.
+    # Batches yielded before the error are not taken back.
+    #
+    def import_files(filenames, key, workers: Etc.nprocessors, batch: 100, progress: nil)
+      unless block_given?
+        return enum_for(__method__, filenames, key, workers: workers, batch: batch, progress: progress)
+      end
 
-    rescue VacmanController::Error => e
-      # We handle two undocumented error codes here
-      case e.error_code
-      when -15
-        raise VacmanController::Error, "#{e.library_method} error #{e.error_code}: invalid transport key"
+      # Results are keyed by file name
+      if filenames.uniq.size != filenames.size
+        raise ArgumentError, "the same file name is given more than once"
+      end
+
+      results  = {}
+      imported = Hash.new(0)
+
+      VacmanController::LowLevel.import_files(filenames, key, workers, batch) do |filename, event, payload|
+        case event
+        when :tokens
+          yield filename, payload
+          progress.call(filename, imported[filename] += payload.size) if progress
 
-      when -20
-        raise VacmanController::Error, "#{e.library_method} error #{e.error_code}: cannot open DPX file"
+        when :done
+          results[filename] = payload
 
-      else
-        raise # Sorry, I did my best.
+        when :error
+          results[filename] = dpx_error(payload)
 
+        end
       end
+
+      results
+    end
+
+    # Registers the given static vector, and returns its digest.
+    #
+    # Static vectors are registered on import, and every token of a DPX
+    # shares the same one. Token hashes and dumps can reference it by its
+    # digest, in place of carrying it: after a restart, register the
+    # static vectors returned by +static_vectors+ before loading them.
+    #
+    def register_static_vector(sv)
+      VacmanController::LowLevel.intern_static_vector(sv)
+    end
+
+    # Returns the registered static vectors, as an Hash keyed by digest.
+    #
+    def static_vectors
+      VacmanController::LowLevel.static_vectors
     end
 
     # Returns the +Kernel+ module
@@ -52,6 +158,29 @@ module VacmanController
     def kernel
       VacmanController::Kernel
     end
+
+    private
+      def dpx_errors
+        yield
+
+      rescue VacmanController::Error => e
+        raise dpx_error(e)
+      end
+
+      def dpx_error(e)
+        # We handle two undocumented error codes here
+        case e.error_code
+        when -15
+          VacmanController::Error.new "#{e.library_method} error #{e.error_code}: invalid transport key"
+
+        when -20
+          VacmanController::Error.new "#{e.library_method} error #{e.error_code}: cannot open DPX file"
+
+        else
+          e # Sorry, I did my best.
+
+        end
+      end
   end
 
 end
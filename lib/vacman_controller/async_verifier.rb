@@ -0,0 +1,116 @@
+require 'io/wait'
+
+module VacmanController
+
+  # Verifies OTPs on a pool of native threads, so that a verification only
+  # blocks the Thread or Fiber that asked for it. Under a Fiber scheduler,
+  # such as the one of the +async+ gem, the event loop keeps running while
+  # the verifications are in flight.
+  #
+  #   verifier = VacmanController::AsyncVerifier.new(workers: 4)
+  #
+  #   Async do |task|
+  #     tokens.each do |token|
+  #       task.async { token.persist { |hash| save(hash) } if verifier.verify(token, otp) }
+  #     end
+  #   end
+  #
+  # Completed verifications are collected by a single Ruby thread, that
+  # waits on the +LowLevel::AsyncQueue+ file descriptor and hands every
+  # result back to the Thread or Fiber waiting for it.
+  #
+  # As with +Token.verify_all+, do not verify the same token twice at once.
+  #
+  class AsyncVerifier
+    # Starts the given number of native workers.
+    #
+    def initialize(workers: Etc.nprocessors)
+      @queue   = VacmanController::LowLevel::AsyncQueue.new(workers)
+      @io      = IO.for_fd(@queue.fileno, autoclose: false)
+      @waiting = {}
+      @mutex   = Thread::Mutex.new
+      @reaper  = nil
+    end
+
+
+    # Verifies the given OTP against the given +Token+, and returns true if
+    # it is valid. The token state is updated, as with +Token#verify+.
+    #
+    def verify(token, otp)
+      verify_status(token.digipass, otp).zero?
+    end
+
+
+    # Verifies the given OTP against the given token hash or +Digipass+, and
+    # returns the AAL2 result code, 0 meaning success.
+    #
+    def verify_status(token, otp, params = nil)
+      done = Thread::Queue.new
+
+      @mutex.synchronize do
+        raise VacmanController::Error, 'async verifier closed' if @queue.closed?
+
+        @waiting[@queue.submit(token, otp.to_s, params)] = done
+        @reaper ||= Thread.new { reap }
+      end
+
+      status = done.pop
+      raise VacmanController::Error, 'async verifier closed' if status.nil?
+      raise status if status.is_a?(Exception)
+
+      status
+    end
+
+
+    # Returns the number of verifications in flight.
+    #
+    def size
+      @mutex.synchronize { @waiting.size }
+    end
+
+
+    # Stops the workers, once the verifications they are running complete.
+    # Verifications still waiting for a worker raise an Error.
+    #
+    def close
+      reaper = @mutex.synchronize do
+        return if @queue.closed?
+
+        @queue.close
+        @waiting.each_value(&:close)
+        @waiting.clear
+        @reaper
+      end
+
+      reaper.join if reaper && reaper != Thread.current
+      nil
+    end
+
+
+    private
+      # Waits for the completed verifications and wakes up their waiters,
+      # until the verifier is closed. A token that cannot be written back
+      # raises in its own waiter; if reaping fails altogether, every waiter
+      # gets the error, as their results are lost.
+      #
+      def reap
+        loop do
+          @io.wait_readable
+
+          @mutex.synchronize do
+            return if @queue.closed?
+
+            begin
+              @queue.reap.each do |ticket, status|
+                @waiting.delete(ticket).push(status)
+              end
+            rescue StandardError => e
+              @waiting.each_value { |done| done.push(e) }
+              @waiting.clear
+            end
+          end
+        end
+      end
+  end
+
+end
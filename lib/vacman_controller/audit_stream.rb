@@ -0,0 +1,156 @@
+module VacmanController
+
+  # Records the outcome of every OTP verification, for auditing.
+  #
+  #   audit = VacmanController::AuditStream.new(path: 'log/verifications.audit')
+  #
+  #   audit = VacmanController::AuditStream.new do |records|
+  #     records.each { |r| logger.info "#{r.serial} #{r.success? ? 'ok' : r.result}" }
+  #   end
+  #
+  # The extension pushes a fixed-size record after every verification, by
+  # any API, into a native ring buffer, without allocating nor blocking: a
+  # verification never waits for the audit, and when the ring is full the
+  # record is dropped and counted in +Kernel.audit_stats+. A background
+  # thread drains the ring every +interval+ seconds, appending the records
+  # to the given file as they are, or yielding them to the given block.
+  #
+  # There is a single ring per process, so run a single stream at once.
+  #
+  class AuditStream
+    # The outcome of a verification. +last_time_shift+ and +error_count+
+    # are the token properties after it, nil when not known.
+    #
+    Record = Struct.new(:time, :serial, :app_name, :result, :last_time_shift, :error_count) do
+      # Whether the OTP was accepted
+      #
+      def success?
+        result.zero?
+      end
+    end
+
+    RECORD_SIZE = VacmanController::LowLevel::AUDIT_RECORD_SIZE
+    UNKNOWN     = -2**31
+    FORMAT      = 'q l l l Z10 Z12 x6 '.freeze
+
+
+    # Parses a String of records, as drained from the ring or read from an
+    # audit file, into an Array of +Record+s.
+    #
+    def self.parse(data)
+      count = data.bytesize / RECORD_SIZE
+
+      data.unpack(FORMAT * count).each_slice(6).map do |time, result, shift, errors, serial, app_name|
+        Record.new(
+          Time.at(Rational(time, 1_000_000_000)),
+          serial, app_name, result,
+          shift == UNKNOWN ? nil : shift,
+          errors == UNKNOWN ? nil : errors,
+        )
+      end
+    end
+
+
+    # Yields every +Record+ in the given audit file. Audit files are in the
+    # byte order of the machine that wrote them.
+    #
+    def self.read(path)
+      return enum_for(__method__, path) unless block_given?
+
+      File.open(path, 'rb') do |file|
+        while (data = file.read(RECORD_SIZE * 1024))
+          parse(data).each { |record| yield record }
+        end
+      end
+    end
+
+
+    # Enables the audit ring, and starts draining it.
+    #
+    # == Parameters:
+    # path::
+    #   If given, the records are appended to this file
+    #
+    # interval::
+    #   How many seconds to wait between drains
+    #
+    # capacity::
+    #   How many records the ring holds, rounded up to a power of two. Size
+    #   it for the verifications of at least two intervals.
+    #
+    # batch::
+    #   How many records to drain, and yield, at most at once
+    #
+    # If a block is given, it is called with Arrays of +Record+s.
+    #
+    def initialize(path: nil, interval: 0.1, capacity: 65536, batch: 1024, &block)
+      unless path || block
+        raise ArgumentError, 'an audit file path or a block is required'
+      end
+
+      @file     = File.open(path, 'ab') if path
+      @callback = block
+      @batch    = batch
+
+      VacmanController::LowLevel.configure_audit(capacity)
+
+      @drainer = Thread.new { drain_every(interval) }
+    end
+
+
+    # Drains the ring, and returns the number of records drained.
+    #
+    def drain
+      count = 0
+
+      loop do
+        data = VacmanController::LowLevel.audit_drain(@batch)
+        break if data.empty?
+
+        if @file
+          @file.write(data)
+          @file.flush
+        end
+
+        @callback.call(self.class.parse(data)) if @callback
+
+        count += data.bytesize / RECORD_SIZE
+        break if data.bytesize < @batch * RECORD_SIZE
+      end
+
+      count
+    end
+
+
+    # Stops draining, drains the records left, and disables the audit ring.
+    #
+    def close
+      return unless @drainer
+
+      @closed = true
+      @drainer.wakeup if @drainer.alive?
+      @drainer.join
+      @drainer = nil
+
+      drain
+
+      VacmanController::LowLevel.configure_audit(0)
+      @file.close if @file
+    end
+
+
+    private
+      def drain_every(interval)
+        until @closed
+          sleep interval
+
+          begin
+            drain
+          rescue StandardError => e
+            warn "VacmanController::AuditStream: drain failed: #{e.class}: #{e.message}"
+          end
+        end
+      end
+  end
+
+end
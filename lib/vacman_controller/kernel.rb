@@ -1,18 +1,22 @@
 module VacmanController
 
   module Kernel
+    # The kernel property names, deeply frozen so that they can be read
+    # from any Ractor.
+    PROPERTY_NAMES = VacmanController::LowLevel.kernel_property_names.map(&:freeze).freeze
+
     class << self
       # Returns the library version as an hash
       #
       def version
-        @_version = VacmanController::LowLevel.library_version
+        VacmanController::LowLevel.library_version
       end
 
 
       # Gets the available kernel property names
       #
       def property_names
-        @_property_names ||= VacmanController::LowLevel.kernel_property_names.freeze
+        PROPERTY_NAMES
       end
 
 
@@ -50,6 +54,10 @@ module VacmanController
 
       # Set a Kernel property.
       #
+      # This replaces the default parameters with a modified copy of them:
+      # calls already running keep using the previous ones. Every Ractor
+      # has its own default parameters.
+      #
       # == Parameters:
       # name::
       #   the param name. See +property_names+ for a list of available property
@@ -59,12 +67,234 @@ module VacmanController
       #   the integer value
       #
       def []=(name, val)
-        Mutex.synchronize do
-          VacmanController::LowLevel.set_kernel_param(name, val)
+        VacmanController::LowLevel.set_kernel_param(name, val)
+      end
+
+
+      # Returns the +KernelParams+ in effect on the current thread.
+      #
+      def params
+        VacmanController::KernelParams.current
+      end
+
+
+      # Runs the given block with the given +KernelParams+, or Hash of
+      # parameter overrides, in effect on the current thread.
+      #
+      # See +KernelParams.with+.
+      #
+      def with(params, &block)
+        VacmanController::KernelParams.with(params, &block)
+      end
+
+
+      # Enables the cache of the recently verified OTPs, that answers
+      # double submissions and retries without calling into AAL2 and
+      # without altering the token:
+      #
+      # * An OTP that was accepted is rejected as a replay
+      # * An OTP that was not valid is rejected again
+      #
+      # The cache never accepts an OTP.
+      #
+      # == Parameters:
+      # capacity::
+      #   The number of OTPs to remember, 0 disables the cache.
+      #
+      # ttl::
+      #   The number of seconds an OTP is remembered for. By default, an
+      #   accepted OTP for as long as the token may accept it: ITimeWindow
+      #   times the token time step, or 60 seconds for event based tokens.
+      #   An OTP that was not valid is remembered for 60 seconds.
+      #
+      def configure_replay_cache(capacity: 65536, ttl: nil)
+        VacmanController::LowLevel.configure_replay_cache(capacity, ttl || 0)
+      end
+
+
+      # Returns the replay cache capacity, the number of OTPs it holds,
+      # and the number of replays and rejects answered from it, of misses
+      # and of OTPs evicted before their time.
+      #
+      def replay_cache_stats
+        VacmanController::LowLevel.replay_cache_stats
+      end
+
+
+      # Forgets all the OTPs in the replay cache.
+      #
+      def clear_replay_cache
+        VacmanController::LowLevel.clear_replay_cache
+      end
+
+
+      # Enables the adaptive verification window: tokens that were verified
+      # successfully before, and so have a known time shift, are first
+      # verified with the given narrow windows, that are much cheaper to
+      # search, and only if that fails with the full ITimeWindow and
+      # EventWindow.
+      #
+      # An attempt with the narrow windows that fails does not alter the
+      # token, nor count as an error: the full windows decide.
+      #
+      # Valid OTPs get cheaper, but wrong ones cost more: a property read,
+      # a narrow and a full verification, roughly twice the AAL2 work of a
+      # plain verification. Brute force attempts on known tokens cost as
+      # much to the server.
+      #
+      # == Parameters:
+      # time_window::
+      #   The ITimeWindow tried first, in time steps. 0 disables the
+      #   adaptive window.
+      #
+      # event_window::
+      #   The EventWindow tried first, in events.
+      #
+      def configure_adaptive_window(time_window: 2, event_window: 10)
+        VacmanController::LowLevel.configure_adaptive_window(time_window, event_window)
+      end
+
+
+      # Returns the narrow windows, and how many verifications were
+      # accepted within them (+narrow+), were verified again with the full
+      # windows (+widened+), or were on tokens never verified successfully
+      # before (+unknown+).
+      #
+      def adaptive_window_stats
+        VacmanController::LowLevel.adaptive_window_stats
+      end
+
+
+      # Returns the capacity of the audit ring, and how many verification
+      # outcomes were pushed into it, were dropped because it was full, and
+      # are waiting to be drained. See +AuditStream+.
+      #
+      def audit_stats
+        VacmanController::LowLevel.audit_stats
+      end
+
+
+      # Returns the call counters and latency statistics of the AAL2
+      # functions, and of the token marshalling, as an Hash keyed by
+      # function name.
+      #
+      # Every entry has the number of +calls+ and +errors+, the +error_codes+
+      # tally as an Hash of code => count, the +total_ns+ spent, the latency
+      # +histogram+ as an Array of [from_ns, to_ns, count], and the
+      # +mean_ns+, +p50_ns+, +p90_ns+, +p99_ns+ and +max_ns+ latencies.
+      # Percentiles are the upper bound of the histogram bucket they fall
+      # into, so they overestimate by at most 25%.
+      #
+      # Statistics are only collected when +stats_enabled+ is true, or the
+      # VACMAN_CONTROLLER_STATS environment variable is set.
+      #
+      def stats
+        VacmanController::LowLevel.stats.each_with_object({}) do |(name, stat), ret|
+          histogram = stat['histogram']
+
+          ret[name] = stat.merge(
+            'mean_ns' => stat['calls'] > 0 ? stat['total_ns'] / stat['calls'] : 0,
+            'p50_ns'  => stats_percentile(histogram, 0.50),
+            'p90_ns'  => stats_percentile(histogram, 0.90),
+            'p99_ns'  => stats_percentile(histogram, 0.99),
+            'max_ns'  => histogram.empty? ? 0 : histogram.last[1],
+          )
+        end
+      end
+
+
+      # Returns whether statistics are being collected
+      #
+      def stats_enabled
+        VacmanController::LowLevel.stats_enabled
+      end
+      alias stats_enabled? stats_enabled
+
+
+      # Starts or stops collecting statistics, process-wide.
+      #
+      def stats_enabled=(enabled)
+        VacmanController::LowLevel.stats_enabled = enabled
+      end
+
+
+      # Clears the statistics collected so far.
+      #
+      def reset_stats
+        VacmanController::LowLevel.reset_stats
+      end
+
+
+      # Returns the statistics in the Prometheus text exposition format, to
+      # be served by your metrics endpoint. Latencies are exported with
+      # power-of-two buckets, from 128ns to ~34s.
+      #
+      def prometheus_stats
+        stats = VacmanController::LowLevel.stats.select { |_, stat| stat['calls'] > 0 }
+
+        out = []
+
+        out << '# HELP vacman_controller_calls_total Calls, by function.'
+        out << '# TYPE vacman_controller_calls_total counter'
+        stats.each do |name, stat|
+          out << "vacman_controller_calls_total{function=\"#{name}\"} #{stat['calls']}"
+        end
+
+        out << '# HELP vacman_controller_errors_total Calls that returned an error, by function and error code.'
+        out << '# TYPE vacman_controller_errors_total counter'
+        stats.each do |name, stat|
+          stat['error_codes'].each do |code, count|
+            out << "vacman_controller_errors_total{function=\"#{name}\",code=\"#{code}\"} #{count}"
+          end
         end
+
+        out << '# HELP vacman_controller_duration_seconds Call latency, by function.'
+        out << '# TYPE vacman_controller_duration_seconds histogram'
+        stats.each do |name, stat|
+          histogram = stat['histogram']
+          count     = histogram.inject(0) { |sum, (_, _, n)| sum + n }
+
+          PROMETHEUS_BUCKETS.each do |le|
+            below = histogram.inject(0) { |sum, (_, to, n)| to <= le ? sum + n : sum }
+            out << "vacman_controller_duration_seconds_bucket{function=\"#{name}\",le=\"#{prometheus_float(le)}\"} #{below}"
+          end
+
+          out << "vacman_controller_duration_seconds_bucket{function=\"#{name}\",le=\"+Inf\"} #{count}"
+          out << "vacman_controller_duration_seconds_sum{function=\"#{name}\"} #{prometheus_float(stat['total_ns'])}"
+          out << "vacman_controller_duration_seconds_count{function=\"#{name}\"} #{count}"
+        end
+
+        out.join("\n") << "\n"
       end
 
-      Mutex = Thread::Mutex.new
+      # Upper bounds of the exported buckets in nanoseconds, they are
+      # boundaries of the native histogram buckets as well.
+      PROMETHEUS_BUCKETS = (7..35).map { |exp| 2**exp }.freeze
+
+      private
+        # Returns the upper bound of the histogram bucket where the given
+        # quantile falls.
+        #
+        def stats_percentile(histogram, quantile)
+          total = histogram.inject(0) { |sum, (_, _, n)| sum + n }
+          return 0 if total == 0
+
+          rank = (total * quantile).ceil
+          seen = 0
+
+          histogram.each do |_, to, n|
+            seen += n
+            return to if seen >= rank
+          end
+
+          histogram.last[1]
+        end
+
+        # Formats the given nanoseconds as seconds.
+        #
+        def prometheus_float(ns)
+          format('%.9g', ns / 1e9)
+        end
     end
   end
 
@@ -0,0 +1,42 @@
+module VacmanController
+
+  # An immutable set of Kernel parameters. Instances are frozen, and changing
+  # a parameter returns a new instance via +merge+.
+  #
+  # Every +LowLevel+ call accepts a +KernelParams+ as its last, optional,
+  # argument. When it is not given, the parameters set on the current thread
+  # via +KernelParams.current=+ are used, or the process-wide default ones.
+  # They are shared by all the fibers of the thread, so they apply to
+  # external enumerators and to fiber scheduler tasks as well.
+  #
+  class KernelParams
+    class << self
+      # Runs the given block with the given parameters in effect on the
+      # current thread, restoring the previous ones afterwards.
+      #
+      # == Parameters:
+      # params::
+      #   A +KernelParams+ instance, or an Hash of parameters that are merged
+      #   into the current ones.
+      #
+      def with(params)
+        previous = Thread.current.thread_variable_get(:__vacman_kernel_params)
+        params   = current.merge(params) if params.is_a?(Hash)
+
+        begin
+          self.current = params
+          yield params
+        ensure
+          self.current = previous
+        end
+      end
+    end
+
+    # Renders the parameters in your development console
+    #
+    def inspect
+      "#<#{self.class.name} #{to_h.inspect}>"
+    end
+  end
+
+end
@@ -0,0 +1,141 @@
+module VacmanController
+
+  # Verifies OTPs on a pool of Ractors, so that the Ruby side of the
+  # verifications, and not only the AAL2 calls, runs in parallel on all
+  # the cores.
+  #
+  #   pool = VacmanController::RactorPool.new(workers: 4)
+  #
+  #   pool.verify_all(tokens, otps) # => [true, false, ...]
+  #   tokens.each { |token| token.persist { |hash| save(hash) } }
+  #
+  # Tokens are not shareable, so every verification sends the token state
+  # as a frozen binary dump, referencing the static vector by digest, and
+  # the worker sends back the updated one, that is restored into the
+  # token. As with +Token#verify+, persist the tokens afterwards.
+  #
+  # Each worker verifies with the given +KernelParams+, or with the library
+  # defaults: the process default parameters are per Ractor, so changes
+  # made via +Kernel[]=+ in the main Ractor do not reach the workers.
+  #
+  # Replies are received by the calling Ractor via +Ractor.receive+, so do
+  # not use the pool from a Ractor that receives other messages. Calls are
+  # serialised, pass many tokens at once to keep all the workers busy.
+  #
+  # Requires Ruby 3.0 or later.
+  #
+  class RactorPool
+    # Starts the given number of worker Ractors.
+    #
+    # == Parameters:
+    # workers::
+    #   How many Ractors to start, defaults to the number of CPUs
+    #
+    # params::
+    #   The +KernelParams+ the workers verify with, the library defaults if
+    #   not given
+    #
+    def initialize(workers: Etc.nprocessors, params: nil)
+      raise ArgumentError, "invalid number of workers given: #{workers}" unless workers > 0
+
+      @workers = workers.times.map do |i|
+        Ractor.new(params, name: "vacman-#{i}") do |kernel_params|
+          VacmanController::RactorPool.work(kernel_params)
+        end
+      end
+
+      @mutex = Thread::Mutex.new
+      @calls = 0
+    end
+
+
+    # Verifies the given OTP against the given +Token+, and returns true if
+    # it is valid.
+    #
+    def verify(token, otp)
+      verify_all([token], [otp]).first
+    end
+
+
+    # Verifies an Array of OTPs against an Array of +Token+s, spreading them
+    # across the workers, and returns an Array of booleans telling whether
+    # each OTP is valid. The tokens are updated, as with +Token#verify+.
+    #
+    # If a verification fails with an error, the first one is raised once
+    # all the others complete and their tokens are updated.
+    #
+    def verify_all(tokens, otps)
+      unless tokens.size == otps.size
+        raise ArgumentError, "#{tokens.size} tokens given for #{otps.size} OTPs"
+      end
+
+      @mutex.synchronize do
+        raise VacmanController::Error, 'ractor pool closed' if @workers.empty?
+
+        call = @calls += 1
+
+        tokens.each_with_index do |token, index|
+          job = [call, index, token.digipass.dump(true).freeze, otps[index].to_s.freeze, Ractor.current]
+          @workers[index % @workers.size].send(job.freeze)
+        end
+
+        results = Array.new(tokens.size)
+        error   = nil
+        pending = tokens.size
+
+        while pending > 0
+          reply_call, index, result, dump = Ractor.receive
+          next unless reply_call == call # Left over by an interrupted call
+
+          pending -= 1
+          tokens[index].digipass.restore(dump) if dump
+
+          if result.is_a?(Exception)
+            error ||= result
+          else
+            results[index] = result.zero?
+          end
+        end
+
+        raise error if error
+
+        results
+      end
+    end
+
+
+    # Stops the workers, once the verifications they are running complete.
+    #
+    def close
+      @mutex.synchronize do
+        @workers.each { |worker| worker.send(nil) }
+        @workers.each { |worker| worker.respond_to?(:value) ? worker.value : worker.take }
+        @workers.clear
+      end
+
+      nil
+    end
+
+
+    # Runs in every worker Ractor: verifies the OTPs it receives, until it
+    # receives nil.
+    #
+    def self.work(params) # :nodoc:
+      VacmanController::KernelParams.default = params if params
+
+      while (job = Ractor.receive)
+        call, index, dump, otp, reply_to = job
+
+        begin
+          digipass = VacmanController::LowLevel::Digipass.load(dump)
+          status   = VacmanController::LowLevel.verify_password_status(digipass, otp)
+
+          reply_to.send([call, index, status, digipass.dirty? ? digipass.dump(true).freeze : nil].freeze)
+        rescue Exception => e # Replied, or the caller would wait forever
+          reply_to.send([call, index, e, nil])
+        end
+      end
+    end
+  end
+
+end
@@ -14,24 +14,210 @@ module VacmanController
     end
 
 
-    # Initialises a Token instance with the given token hash.
+    # Opens the given dpx_filename with the given transport key and yields
+    # a Token instance for each token in the DPX file, without keeping them
+    # all in memory.
     #
-    def initialize(token_hash)
-      @token_hash = token_hash
+    # Returns an Enumerator if no block is given.
+    #
+    def self.import_each(dpx_filename, transport_key)
+      return enum_for(__method__, dpx_filename, transport_key) unless block_given?
+
+      VacmanController.each_token(dpx_filename, transport_key) do |hash|
+        yield Token.new(hash)
+      end
+    end
+
+
+    # Verifies the given OTPs against the given tokens, in a single native
+    # call that does not hold the GVL while verifying.
+    #
+    # == Parameters:
+    # tokens::
+    #   An Array of Token instances. The same token must not appear twice,
+    #   or an Error is raised.
+    #
+    # otps::
+    #   An Array of OTPs, one per token
+    #
+    # == Returns:
+    # An Array of booleans, telling whether each OTP is valid.
+    #
+    # ATTENTION: it is very important to persist the token hashes
+    # afterwards.
+    #
+    def self.verify_all(tokens, otps)
+      VacmanController::LowLevel.verify_passwords(
+        tokens.map(&:digipass), otps.map(&:to_s)).map(&:zero?)
     end
 
 
+    # Generates the activation codes of the given tokens concurrently, on a
+    # pool of native threads, and yields them as soon as they are ready, in
+    # no particular order.
+    #
+    # Tokens with the same serial number are the applications of the same
+    # DIGIPASS, and they are activated together with a single code.
+    #
+    # == Parameters:
+    # tokens::
+    #   An Array of Token instances
+    #
+    # workers::
+    #   How many activation codes to generate at once, defaults to the
+    #   number of CPUs
+    #
+    # == Yields:
+    # The Array of tokens activated by the code, and either the serial
+    # number and activation code as returned by +activation+, or the
+    # +VacmanController::Error+ that prevented generating it.
+    #
+    # Returns an Enumerator if no block is given.
+    #
+    def self.activations(tokens, workers: Etc.nprocessors)
+      return enum_for(__method__, tokens, workers: workers) unless block_given?
+
+      VacmanController::LowLevel.generate_activations(tokens.map(&:digipass), workers) do |indexes, result|
+        unless result.is_a?(VacmanController::Error)
+          result = [ result.fetch('serial').scan(/\d(\d)/).flatten.join, result.fetch('activation') ]
+        end
+
+        yield tokens.values_at(*indexes), result
+      end
+    end
+
+
+    # Generates a range of OTPs of each of the given tokens, as
+    # +generate_passwords+ does, concurrently on a pool of native threads,
+    # to produce fixtures for load tests. The tokens are not altered.
+    #
+    # == Parameters:
+    # tokens::
+    #   An Array of Token instances
+    #
+    # from, to, step, count::
+    #   The range, as for +generate_passwords+
+    #
+    # workers::
+    #   How many tokens to generate OTPs for at once, defaults to the
+    #   number of CPUs
+    #
+    # io::
+    #   If given, the OTPs are written to it as CSV lines of serial number,
+    #   application name, time or event index, and OTP, and their number is
+    #   returned
+    #
+    # == Yields:
+    # The token, the time or event index and the OTP, as an Array. The
+    # OTPs of each token come in order, those of different tokens
+    # interleaved.
+    #
+    # Raises the first +VacmanController::Error+ that stopped the
+    # generation for a token, once the others complete.
+    #
+    # Returns an Enumerator if neither a block nor an +io+ is given.
+    #
+    def self.generate_passwords(tokens, from: nil, to: nil, step: 30, count: nil, workers: Etc.nprocessors, io: nil)
+      range = otp_range(from, to, step, count)
+
+      if io
+        written = 0
+
+        generate_passwords(tokens, from: from, to: to, step: step, count: count, workers: workers) do |token, at, otp|
+          io.write "#{token.serial},#{token.app_name},#{at.to_i},#{otp}\n"
+          written += 1
+        end
+
+        return written
+      end
+
+      unless block_given?
+        return enum_for(__method__, tokens, from: from, to: to, step: step, count: count, workers: workers)
+      end
+
+      error = nil
+
+      VacmanController::LowLevel.generate_passwords_bulk(tokens.map(&:digipass), *range, workers) do |index, first, otps|
+        if otps.is_a?(VacmanController::Error)
+          error ||= otps
+        else
+          otps.each_with_index { |otp, i| yield [tokens[index], otp_at(range, first + i), otp] }
+        end
+      end
+
+      raise error if error
+
+      nil
+    end
+
+
+    # Returns the arguments of the low-level generation functions for the
+    # given range
+    #
+    def self.otp_range(from, to, step, count) # :nodoc:
+      if from.nil?
+        raise ArgumentError, 'the number of OTPs is required without a start time' unless count
+        return [nil, nil, count]
+      end
+
+      unless count || to
+        raise ArgumentError, 'an end time or a number of OTPs is required'
+      end
+
+      from  = from.to_i
+      count ||= to.to_i >= from ? (to.to_i - from) / step + 1 : 0
+
+      [from, step, count]
+    end
+
+
+    # Returns the time of the OTP at the given position in the given
+    # range, or the position itself for event ranges
+    #
+    def self.otp_at(range, position) # :nodoc:
+      from, step, _ = range
+      from ? Time.at(from + position * step) : position
+    end
+
+
+    # Loads a Token from the binary String returned by +dump+.
+    #
+    def self.load(data)
+      new(VacmanController::LowLevel::Digipass.load(data))
+    end
+
+
+    # Initialises a Token instance with the given token hash, or with
+    # the given +LowLevel::Digipass+.
+    #
+    def initialize(token)
+      if token.is_a?(VacmanController::LowLevel::Digipass)
+        @token_hash = {}
+        @digipass   = token
+      else
+        @token_hash = token
+        @digipass   = VacmanController::LowLevel::Digipass.from_h(token)
+      end
+    end
+
+
+    # Returns the native token state, that is passed to the low-level
+    # functions.
+    #
+    attr_reader :digipass
+
+
     # Return the token serial number
     #
     def serial
-      @token_hash.fetch('serial').dup
+      @digipass.serial
     end
 
 
     # Returns the token Application Name
     #
     def app_name
-      @token_hash.fetch('app_name').dup
+      @digipass.app_name
     end
 
 
@@ -46,8 +232,76 @@ module VacmanController
     # Returns the token as an hash, that is suitable for passing to
     # the low-level functions, or for persistance purposes.
     #
+    # The token state is kept natively, and it is written into the
+    # hash given to +new+ when calling this method, that returns it.
+    #
     def to_h
-      @token_hash
+      @digipass.write_to(@token_hash)
+    end
+
+
+    # Returns the token state and static vector as a compact, versioned
+    # binary String, suitable for persistence in place of the token hash.
+    # It is loaded back with +Token.load+, that copies it straight into
+    # the native token.
+    #
+    # == Parameters:
+    # static_vector::
+    #   +:inline+ to store the static vector in the dump, +:digest+ to
+    #   reference it by digest. See +VacmanController.static_vectors+.
+    #
+    def dump(static_vector: :inline)
+      unless %i( inline digest ).include?(static_vector)
+        raise ArgumentError, "invalid static_vector given: #{static_vector.inspect}"
+      end
+
+      @digipass.dump(static_vector == :digest)
+    end
+
+
+    # Returns the digest of the token static vector, or nil if the token
+    # has none.
+    #
+    def static_vector_digest
+      @digipass.static_vector_digest
+    end
+
+
+    # Returns whether the token state has changed since this instance was
+    # built, or since it was last persisted, so that it needs persisting.
+    #
+    # Verifications, OTP generation, PIN changes, resets and property
+    # writes change the state only when AAL2 alters the token blob; an
+    # OTP rejected by the replay cache and property reads never do.
+    #
+    def dirty?
+      @digipass.dirty?
+    end
+
+
+    # Yields the token hash for persistence if the token state changed,
+    # and marks the token as clean once the block returns. Nothing is
+    # yielded if the token is clean.
+    #
+    #   token.persist { |hash| record.update!(token: hash) }
+    #
+    # == Returns:
+    # true if the block was called, false otherwise.
+    #
+    def persist
+      return false unless dirty?
+
+      yield to_h
+      persisted!
+      true
+    end
+
+
+    # Marks the token as clean, once its state has been persisted.
+    #
+    def persisted!
+      @digipass.clean!
+      self
     end
 
 
@@ -65,9 +319,7 @@ module VacmanController
     # afterwards.
     #
     def verify(otp)
-      verify!(otp)
-    rescue VacmanController::Error
-      false
+      VacmanController::LowLevel.verify_password_status(@digipass, otp.to_s).zero?
     end
 
 
@@ -75,7 +327,7 @@ module VacmanController
     # fails.
     #
     def verify!(otp)
-      VacmanController::LowLevel.verify_password(@token_hash, otp.to_s)
+      VacmanController::LowLevel.verify_password(@digipass, otp.to_s)
     end
 
 
@@ -88,7 +340,45 @@ module VacmanController
     # Not all tokens support OTP generation.
     #
     def generate
-      VacmanController::LowLevel.generate_password(@token_hash)
+      VacmanController::LowLevel.generate_password(@digipass)
+    end
+
+
+    # Generates a range of OTPs of this token without altering it, to
+    # produce fixtures for load tests.
+    #
+    # == Parameters:
+    # from, to::
+    #   The OTPs the token shows from this time to that one, every +step+
+    #   seconds. Times or epoch Integers.
+    #
+    # count::
+    #   How many OTPs to generate, in place of +to+. Without +from+, the
+    #   OTPs of an event based token as its counter moves on.
+    #
+    # == Yields:
+    # The time, or the event index from 0, and the OTP, as an Array.
+    #
+    # Returns an Enumerator if no block is given: it generates the OTPs
+    # natively in chunks, without holding the GVL, as it is iterated.
+    #
+    def generate_passwords(from: nil, to: nil, step: 30, count: nil)
+      range = self.class.otp_range(from, to, step, count)
+
+      unless block_given?
+        return enum_for(__method__, from: from, to: to, step: step, count: count) { range.last }
+      end
+
+      position = 0
+
+      VacmanController::LowLevel.generate_passwords(@digipass, *range) do |otps|
+        otps.each do |otp|
+          yield [self.class.otp_at(range, position), otp]
+          position += 1
+        end
+      end
+
+      nil
     end
 
 
@@ -105,7 +395,7 @@ module VacmanController
     # in the token hash.
     #
     def activation
-      ad = VacmanController::LowLevel.generate_activation(@token_hash)
+      ad = VacmanController::LowLevel.generate_activation(@digipass)
       [ ad.fetch('serial').scan(/\d(\d)/).flatten.join, ad.fetch('activation') ]
     end
 
@@ -117,14 +407,14 @@ module VacmanController
     #   the new PIN. Must be coercible to String.
     #
     def set_pin(pin)
-      VacmanController::LowLevel.set_token_pin(@token_hash, pin.to_s)
+      VacmanController::LowLevel.set_token_pin(@digipass, pin.to_s)
     end
 
 
     # Resets error count and time window
     #
     def reset!
-      VacmanController::LowLevel.reset!(@token_hash)
+      VacmanController::LowLevel.reset!(@digipass)
     end
 
 
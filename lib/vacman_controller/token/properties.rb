@@ -2,11 +2,15 @@ module VacmanController
   class Token
 
     class Properties
+      # The token property names, deeply frozen so that they can be read
+      # from any Ractor.
+      NAMES = VacmanController::LowLevel.token_property_names.map(&:freeze).freeze
+
       class << self
         # Gets the available token property names
         #
         def names
-          @_names ||= VacmanController::LowLevel.token_property_names.freeze
+          NAMES
         end
       end
 
@@ -21,9 +25,16 @@ module VacmanController
       end
 
 
+      # Get all the Token properties, in a single low-level call.
+      #
+      # Properties that cannot be read are reported as an "ERROR: "
+      # string, followed by the library error message.
+      #
       def all
-        self.class.names.inject({}) do |h, name|
-          h.update(name => (self[name] rescue "ERROR: #$!"))
+        values = VacmanController::LowLevel.get_token_properties(@token.digipass)
+
+        values.each do |name, value|
+          values[name] = "ERROR: #{value}" if value.is_a?(VacmanController::Error)
         end
       end
       alias to_h all
@@ -36,11 +47,13 @@ module VacmanController
       # property::
       #   the property name. See +Token::Properties.names+
       #
+      # == Returns:
+      # The property value, as an Integer, a boolean, a UTC Time, a Symbol
+      # or a String depending on the property. Values not available on
+      # this token are returned as nil.
+      #
       def [](name)
-        name  = name.to_s
-        value = VacmanController::LowLevel.get_token_property(@token.to_h, name)
-
-        read_cast(name, value)
+        VacmanController::LowLevel.get_token_property(@token.digipass, name)
       end
 
 
@@ -60,10 +73,20 @@ module VacmanController
       #   +write_cast!+
       #
       def []=(name, value)
-        name  = name.to_s
-        value = write_cast!(name, value)
+        value = write_cast!(name.to_s, value)
+
+        VacmanController::LowLevel.set_token_property(@token.digipass, name, value)
+      end
+
+      # Exposes a getter and setter method for each
+      # property name. Delegates error handling for
+      # read-only properties to +[]=+.
+      #
+      names.each do |name|
+        property = name.to_sym
 
-        VacmanController::LowLevel.set_token_property(@token.to_h, name, value)
+        define_method(property) { self[property] }
+        define_method("#{name}=") { |value| self[property] = value }
       end
 
       protected
@@ -145,102 +168,6 @@ module VacmanController
 
           value
         end
-
-
-        # Maps the given property value to a Ruby value for:
-        #
-        # * Integers
-        # * Booleans
-        # * Dates
-        # * Enumerations (Symbols)
-        #
-        def read_cast(property, value)
-          # Short-circuit on 'NA'
-          return nil if value == 'NA' or value == 'DISABLE'
-
-          case property
-          when  # Integer values
-            'use_count',
-            'pin_len',
-            'pin_length',
-            'pin_min_len',
-            'pin_minimum_length',
-            'last_time_shift',
-            'virtual_token_remain_use',
-            'error_count',
-            'event_value',
-            'last_event_value',
-            'max_dtf_number',
-            'response_len',
-            'response_length',
-            'time_step'
-            value.to_i
-
-          when # Boolean values
-            'time_based_algo',
-            'event_based_algo',
-            'pin_supported',
-            'unlock_supported',
-            'pin_ch_on',
-            'pin_change_enabled',
-            'pin_enabled',
-            'pin_ch_forced',
-            'pin_change_forced',
-            'sync_windows',
-            'primary_token_enabled',
-            'virtual_token_supported',
-            'virtual_token_enabled',
-            'derivation_supported',
-            'response_chk',
-            'response_checksum',
-            'triple_des_used',
-            'use_3des'
-
-            case value
-            when 'YES' then true
-            when 'NO' then false
-            end
-
-          when # Date/time values
-            'last_time_used',
-            'virtual_token_grace_period'
-
-            # AAL2 returns UTC values, we add the timezone.
-            Time.strptime("#{value} UTC", '%a %b %d %H:%M:%S %Y %Z')
-
-          when
-            'auth_mode'
-
-            case value
-            when 'RO' then :response_only
-            when 'SG' then :signature_application
-            when 'CR' then :challenge_response
-            when 'MM' then :multi_mode
-            when 'UL' then :unlock_v2
-            else
-              value
-            end
-
-          else # String values
-
-            value
-          end
-        end
-
-      private
-        # Exposes a getter and setter method for each
-        # property name. Delegates error handling for
-        # invalid properties to +[]+ and +[]=+.
-        #
-        def method_missing(name, *args, &block)
-          prop, setter = name.to_s.match(/\A(.+?)(=)?\Z/).values_at(1, 2)
-
-          if setter
-            self[prop] = args.first
-          else
-            self[prop]
-          end
-        end
     end
 
   end
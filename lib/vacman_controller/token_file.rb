@@ -0,0 +1,145 @@
+module VacmanController
+
+  # Verifies OTPs against a local file of tokens, mapped in memory, for
+  # sites and batch jobs that work offline from the token database.
+  #
+  #   VacmanController::TokenFile.export('tokens.vctf', tokens)
+  #
+  #   VacmanController::TokenFile.open('tokens.vctf') do |file|
+  #     file.verify(serial, otp, app_name: 'RESPONLY    ')
+  #   end
+  #
+  # The file holds the token state in fixed-size records, along with an
+  # index by serial number and application name. Opening it costs the same
+  # whatever the number of tokens, and verifications update the record in
+  # place, in the file: there is nothing to persist afterwards.
+  #
+  # A file is used by a single process at once, unless it is opened
+  # read-only: then the token state changes only in memory, and is lost
+  # when the file is closed.
+  #
+  # Files are written in the byte order of the machine, and cannot be moved
+  # to a machine with a different one.
+  #
+  class TokenFile
+    include Enumerable
+
+    # Writes the given +Token+s or token hashes into a new token file at
+    # the given path, replacing it atomically, and returns how many they
+    # are.
+    #
+    # Raises an Error if the same token is given twice.
+    #
+    def self.export(path, tokens)
+      VacmanController::LowLevel::TokenFile.write(path.to_s, tokens.map do |token|
+        token.is_a?(VacmanController::Token) ? token.digipass : token
+      end)
+    end
+
+
+    # Opens the given token file. If a block is given, the file is yielded
+    # and closed when the block returns, and the block value is returned.
+    #
+    def self.open(path, readonly: false)
+      file = new(path, readonly: readonly)
+      return file unless block_given?
+
+      begin
+        yield file
+      ensure
+        file.close
+      end
+    end
+
+
+    # Maps the given token file in memory.
+    #
+    # Raises an Error if the file is not a token file, or if another
+    # process has it open.
+    #
+    def initialize(path, readonly: false)
+      @file = VacmanController::LowLevel::TokenFile.new(path.to_s, readonly)
+      @readonly = readonly
+    end
+
+
+    # Verifies the given OTP against the given token, updating the token
+    # in the file, and returns true if it is valid.
+    #
+    # Raises an Error if the token is not in the file.
+    #
+    def verify(serial, otp, app_name:)
+      status = @file.verify(serial, app_name, otp.to_s)
+
+      if status.nil?
+        raise VacmanController::Error, "token #{serial} #{app_name.inspect} not found"
+      end
+
+      status.zero?
+    end
+
+
+    # Returns a copy of the given token as a +Token+, or nil if it is not
+    # in the file. Changes made to it are not written to the file.
+    #
+    def token(serial, app_name:)
+      digipass = @file.fetch(serial, app_name)
+      VacmanController::Token.new(digipass) if digipass
+    end
+
+
+    # Yields a copy of every token as a +Token+, in the order they were
+    # exported.
+    #
+    def each
+      return enum_for(__method__) { size } unless block_given?
+
+      @file.each { |digipass| yield VacmanController::Token.new(digipass) }
+    end
+
+
+    # Returns the number of tokens in the file
+    #
+    def size
+      @file.size
+    end
+
+
+    # Returns the number of verifications that changed a token since the
+    # file was opened
+    #
+    def changed
+      @file.changed
+    end
+
+
+    # Returns whether the changes stay in memory
+    #
+    def readonly?
+      @readonly
+    end
+
+
+    # Waits until the tokens that changed are written to the file. They
+    # are written in the background in any case.
+    #
+    def sync
+      @file.sync
+    end
+
+
+    # Writes the tokens that changed, and closes the file.
+    #
+    def close
+      @file.close
+    end
+
+
+    # Returns whether the file is closed
+    #
+    def closed?
+      @file.closed?
+    end
+  end
+
+end
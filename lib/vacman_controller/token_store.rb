@@ -0,0 +1,187 @@
+module VacmanController
+
+  # Keeps tokens in memory, in a native +LowLevel::TokenStore+, so that
+  # verifications do not load and save the token every time, and writes
+  # back the changed ones in batches.
+  #
+  #   store = VacmanController::TokenStore.new(
+  #     load:    ->(serial, app_name) { Record.find_by(serial: serial, app_name: app_name)&.token },
+  #     persist: ->(tokens) { Record.upsert_all(tokens.map { |t| { serial: t.serial, app_name: t.app_name, token: t.to_h } }) },
+  #     interval: 1
+  #   )
+  #
+  #   store.verify(serial, otp, app_name: 'RESPONLY    ')
+  #
+  # Tokens are locked one by one: verifications of different tokens run in
+  # parallel, while the ones of the same token are serialised, so that
+  # concurrent logins never lose an update of the token state.
+  #
+  # Tokens not in memory are loaded via the +load+ callback on first use.
+  # The changed ones are passed to the +persist+ callback by +flush+, every
+  # +interval+ seconds if given, and by +close+.
+  #
+  class TokenStore
+    # Builds an empty store.
+    #
+    # == Parameters:
+    # load::
+    #   Called with the serial number and application name of a token that
+    #   is not in memory, it returns its token hash, +Token+ or nil
+    #
+    # persist::
+    #   Called with Arrays of the +Token+s that changed
+    #
+    # batch::
+    #   How many tokens to pass to +persist+ at most at once
+    #
+    # interval::
+    #   If given, the changed tokens are flushed every this many seconds
+    #   by a background thread
+    #
+    # shards::
+    #   How many parts to split the store into
+    #
+    def initialize(load: nil, persist: nil, batch: 100, interval: nil, shards: 64)
+      @store   = VacmanController::LowLevel::TokenStore.new(shards)
+      @load    = load
+      @persist = persist
+      @batch   = batch
+      @flusher = Thread.new { flush_every(interval) } if interval
+    end
+
+
+    # Adds the given +Token+ or token hash, unless it is in memory already.
+    # Returns whether it was added.
+    #
+    def add(token)
+      @store.add(token.is_a?(VacmanController::Token) ? token.digipass : token)
+    end
+
+
+    # Verifies the given OTP against the given token, and returns true if
+    # it is valid. The token is loaded if it is not in memory.
+    #
+    # Raises an Error if the token does not exist.
+    #
+    def verify(serial, otp, app_name:)
+      status = fetch(serial, app_name) do
+        @store.verify(serial, app_name, otp.to_s)
+      end
+
+      status.zero?
+    end
+
+
+    # Yields the given token as a +Token+, with the token locked, and
+    # stores its changes when the block returns. The token is loaded if it
+    # is not in memory.
+    #
+    # Other threads wait for the block before using the same token, so do
+    # not keep it for longer than needed, nor use the +Token+ afterwards.
+    #
+    #   store.lock(serial, app_name: app_name) { |token| token.reset_error_count! }
+    #
+    # Raises an Error if the token does not exist.
+    #
+    def lock(serial, app_name:)
+      ret = nil
+
+      fetch(serial, app_name) do
+        found = false
+
+        ret = @store.lock(serial, app_name) do |digipass|
+          found = true
+          yield VacmanController::Token.new(digipass)
+        end
+
+        found || nil
+      end
+
+      ret
+    end
+
+
+    # Removes the given token from memory, and returns whether it was
+    # there. Its changes that were not flushed are lost.
+    #
+    def delete(serial, app_name:)
+      @store.delete(serial, app_name)
+    end
+
+
+    # Passes the tokens that changed to the +persist+ callback, and returns
+    # how many there were. If the callback raises, the tokens it was given
+    # and the following ones are flushed again the next time.
+    #
+    def flush
+      @store.flush(@batch) do |digipasses|
+        @persist.call(digipasses.map { |digipass| VacmanController::Token.new(digipass) }) if @persist
+      end
+    end
+
+
+    # Returns the number of tokens in memory
+    #
+    def size
+      @store.size
+    end
+
+
+    # Returns the number of tokens waiting to be flushed
+    #
+    def dirty_size
+      @store.dirty_size
+    end
+
+
+    # Stops the background flushes, and flushes the tokens that changed.
+    #
+    def close
+      if @flusher
+        @closed = true
+        @flusher.wakeup if @flusher.alive?
+        @flusher.join
+        @flusher = nil
+      end
+
+      flush
+    end
+
+
+    private
+      # Runs the given block, that returns nil if the token is not in
+      # memory, loading the token and running it again in that case.
+      # Returns the block value.
+      #
+      def fetch(serial, app_name)
+        ret = yield
+        return ret unless ret.nil?
+
+        token = @load.call(serial, app_name) if @load
+
+        if token.nil?
+          raise VacmanController::Error, "token #{serial} #{app_name.inspect} not found"
+        end
+
+        add(token)
+
+        ret = yield
+        raise VacmanController::Error, "token #{serial} #{app_name.inspect} not found" if ret.nil?
+
+        ret
+      end
+
+      def flush_every(interval)
+        until @closed
+          sleep interval
+
+          begin
+            flush
+          rescue StandardError => e
+            warn "VacmanController::TokenStore: flush failed: #{e.class}: #{e.message}"
+          end
+        end
+      end
+  end
+
+end
@@ -9,3 +9,5 @@ require 'byebug'
 
 require 'rspec'
 require 'vacman_controller'
+
+require_relative 'support/interrupts'
@@ -0,0 +1,308 @@
+/*
+ * Stand-in for the AAL2 library, used to measure the wrapper behaviour
+ * under concurrency and to benchmark it without depending on the real
+ * crypto cost.
+ *
+ * It is built against the real aal2sdk.h and loaded with LD_PRELOAD, so
+ * that the functions defined here take precedence over the ones in
+ * libaal2sdk. Every function called by the extension is defined here, so
+ * the real library is only needed to link the extension.
+ *
+ * Each OTP, DPX or activation call burns AAL2STUB_COST_US microseconds
+ * (default 200) of CPU time, so that a wrapper that holds the GVL shows up
+ * as a flat throughput line as threads are added. Property calls are free.
+ *
+ * The token state is kept in the blob as text, so that it survives the
+ * round trip through the token hash:
+ *
+ *   STUB use_count error_count last_time_used last_time_shift
+ *
+ * DPX files are only checked for existence: every file yields the same
+ * AAL2STUB_DPX_TOKENS tokens (default 20).
+ *
+ * (C) 2019 m.barnaba@ifad.org
+ */
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <aal2sdk.h>
+
+static long stub_env(const char *name, long deflt) {
+  const char *env = getenv(name);
+
+  return env ? atol(env) : deflt;
+}
+
+static long stub_cost_ns(void) {
+  static long cost = -1;
+
+  if (cost < 0) {
+    cost = stub_env("AAL2STUB_COST_US", 200) * 1000;
+  }
+
+  return cost;
+}
+
+static void stub_burn(void) {
+  struct timespec start, now;
+  long elapsed;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  do {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - start.tv_sec) * 1000000000L +
+              (now.tv_nsec - start.tv_nsec);
+  } while (elapsed < stub_cost_ns());
+}
+
+/*
+ * The OTP is derived from the serial only, so that it is stable across
+ * calls and verifies on every thread.
+ */
+static void stub_otp(TDigipassBlob *dpdata, aat_ascii *password) {
+  unsigned long otp = 5381;
+
+  for (size_t i = 0; i < sizeof(dpdata->Serial); i++) {
+    otp = otp * 33 + (unsigned char)dpdata->Serial[i];
+  }
+
+  sprintf(password, "%06lu", otp % 1000000);
+}
+
+
+/*
+ * Token state, stored in the blob
+ */
+struct stub_state {
+  long use_count;
+  long error_count;
+  long last_time_used;
+  long last_time_shift;
+};
+
+static void stub_state_read(TDigipassBlob *dpdata, struct stub_state *state) {
+  char blob[sizeof(dpdata->Blob) + 1];
+
+  memcpy(blob, dpdata->Blob, sizeof(dpdata->Blob));
+  blob[sizeof(dpdata->Blob)] = '\0';
+
+  memset(state, 0, sizeof(*state));
+  sscanf(blob, "STUB %ld %ld %ld %ld", &state->use_count, &state->error_count,
+         &state->last_time_used, &state->last_time_shift);
+}
+
+static void stub_state_write(TDigipassBlob *dpdata, struct stub_state *state) {
+  char blob[sizeof(dpdata->Blob) + 1];
+
+  snprintf(blob, sizeof(blob), "STUB %ld %ld %ld %ld", state->use_count,
+           state->error_count, state->last_time_used, state->last_time_shift);
+
+  memset(dpdata->Blob, ' ', sizeof(dpdata->Blob));
+  memcpy(dpdata->Blob, blob, strlen(blob));
+}
+
+
+aat_int32 AAL2GenPassword(TDigipassBlob *dpdata, TKernelParms *kernel_parms,
+                          aat_ascii *password, aat_ascii *challenge) {
+  stub_burn();
+  stub_otp(dpdata, password);
+
+  return 0;
+}
+
+aat_int32 AAL2VerifyPassword(TDigipassBlob *dpdata, TKernelParms *kernel_parms,
+                             aat_ascii *password, aat_ascii *challenge) {
+  struct stub_state state;
+  aat_ascii expected[18];
+
+  stub_burn();
+  stub_otp(dpdata, expected);
+  stub_state_read(dpdata, &state);
+
+  if (strcmp(expected, password) != 0) {
+    state.error_count++;
+    stub_state_write(dpdata, &state);
+    return 1;
+  }
+
+  state.use_count++;
+  state.error_count = 0;
+  state.last_time_used = time(NULL);
+  stub_state_write(dpdata, &state);
+
+  return 0;
+}
+
+aat_int32 AAL2GetTokenProperty(TDigipassBlob *dpdata, TKernelParms *kernel_parms,
+                               aat_int32 property, aat_ascii *value) {
+  struct stub_state state;
+  stub_state_read(dpdata, &state);
+
+  switch (property) {
+    case USE_COUNT:
+      sprintf(value, "%ld", state.use_count);
+      return 0;
+
+    case ERROR_COUNT:
+      sprintf(value, "%ld", state.error_count);
+      return 0;
+
+    case LAST_TIME_SHIFT:
+      sprintf(value, "%ld", state.last_time_shift);
+      return 0;
+
+    case LAST_TIME_USED: {
+      time_t t = state.last_time_used;
+      strftime(value, 64, "%a %b %d %H:%M:%S %Y", gmtime(&t));
+      return 0;
+    }
+
+    case PIN_SUPPORTED:
+    case PIN_ENABLED:
+      strcpy(value, "NO");
+      return 0;
+
+    case AUTH_MODE:
+      strcpy(value, "RO");
+      return 0;
+
+    case TOKEN_STATUS:
+      return 503; /* Write-only */
+
+    default:
+      strcpy(value, "NA");
+      return 0;
+  }
+}
+
+aat_int32 AAL2SetTokenProperty(TDigipassBlob *dpdata, TKernelParms *kernel_parms,
+                               aat_int32 property, aat_int32 value) {
+  struct stub_state state;
+  stub_state_read(dpdata, &state);
+
+  switch (property) {
+    case ERROR_COUNT:
+      state.error_count = value;
+      break;
+
+    case LAST_TIME_SHIFT:
+      state.last_time_shift = value;
+      break;
+
+    default:
+      return 517;
+  }
+
+  stub_state_write(dpdata, &state);
+  return 0;
+}
+
+aat_int32 AAL2ChangeStaticPassword(TDigipassBlob *dpdata, TKernelParms *kernel_parms,
+                                   aat_ascii *old_pin, aat_ascii *new_pin) {
+  return 517;
+}
+
+aat_int32 AAL2ResetTokenInfo(TDigipassBlob *dpdata, TKernelParms *kernel_parms) {
+  struct stub_state state;
+
+  stub_state_read(dpdata, &state);
+  state.error_count = 0;
+  state.last_time_shift = 0;
+  stub_state_write(dpdata, &state);
+
+  return 0;
+}
+
+
+/*
+ * DPX import, the handle points to the number of tokens read so far
+ */
+aat_int32 AAL2DPXInit(TDPXHandle *dpx_handle, aat_ascii *filename, aat_ascii *key,
+                      aat_int16 *appl_count, aat_ascii *appl_names, aat_int16 *token_count) {
+  FILE *dpx = fopen(filename, "r");
+
+  stub_burn();
+
+  if (dpx == NULL) return -20;
+  fclose(dpx);
+
+  long *read = calloc(1, sizeof(long));
+  if (read == NULL) return -1;
+
+  *(long **)dpx_handle = read;
+
+  *appl_count = 1;
+  strcpy(appl_names, "RESPONLY    ");
+  *token_count = stub_env("AAL2STUB_DPX_TOKENS", 20);
+
+  return 0;
+}
+
+aat_int32 AAL2DPXGetStaticVector(TDPXHandle *dpx_handle, TKernelParms *kernel_parms,
+                                 aat_ascii *static_vector, aat_int32 *static_vector_len) {
+  strcpy(static_vector, "5354554253544154494356454354");
+  *static_vector_len = strlen(static_vector);
+
+  return 0;
+}
+
+aat_int32 AAL2DPXGetToken(TDPXHandle *dpx_handle, TKernelParms *kernel_parms, aat_ascii *appl_names,
+                          aat_ascii *serial, aat_ascii *type, aat_ascii *authmode, TDigipassBlob *dpdata) {
+  long *read = *(long **)dpx_handle;
+  struct stub_state state = { 0, 0, 0, 0 };
+  char token_serial[16];
+
+  if (*read >= stub_env("AAL2STUB_DPX_TOKENS", 20)) return 107;
+
+  stub_burn();
+
+  snprintf(token_serial, sizeof(token_serial), "STB%07ld", (*read)++);
+
+  memset(dpdata, 0, sizeof(*dpdata));
+  memcpy(dpdata->Serial, token_serial, sizeof(dpdata->Serial));
+  memcpy(dpdata->AppName, "RESPONLY    ", sizeof(dpdata->AppName));
+  stub_state_write(dpdata, &state);
+
+  strcpy(serial, token_serial);
+  strcpy(type, "STUB");
+  strcpy(authmode, "RO");
+
+  return 0;
+}
+
+aat_int32 AAL2DPXClose(TDPXHandle *dpx_handle) {
+  free(*(long **)dpx_handle);
+  *(long **)dpx_handle = NULL;
+
+  return 0;
+}
+
+aat_int32 AAL2GenActivationCodeXErc(TDigipassBlob **dpdata, aat_int32 appl_count, TKernelParms *kernel_parms,
+                                    aat_ascii *static_vector, aat_ascii *shared_data, aat_ascii *alea,
+                                    aat_int32 *flags, aat_ascii *serial_suffix, aat_ascii *xfad, aat_ascii *xerc) {
+  stub_burn();
+
+  sprintf(serial_suffix, "%.10s", dpdata[0]->Serial);
+  sprintf(xfad, "%.10s%s", dpdata[0]->Serial, static_vector);
+
+  return 0;
+}
+
+
+void AAL2GetErrorMsg(aat_int32 code, aat_ascii *message) {
+  sprintf(message, "AAL2 stub error %d", code);
+}
+
+aat_int32 AAL2GetLibraryVersion(aat_ascii *version, aat_int32 *version_len,
+                                aat_ascii *bitness, aat_int32 *bitness_len,
+                                aat_ascii *type, aat_int32 *type_len) {
+  snprintf(version, *version_len, "0.0.0");
+  snprintf(bitness, *bitness_len, "%d", (int)(sizeof(void *) * 8));
+  snprintf(type, *type_len, "STUB");
+
+  return 0;
+}
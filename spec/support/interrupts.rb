@@ -0,0 +1,39 @@
+# Helpers to run native calls while interrupts are pending on the calling
+# thread, as when signals arrive or other threads want the GVL.
+#
+module InterruptsHelper
+  # Runs the given block while a forked process keeps sending SIGUSR2 to
+  # this one, and another thread keeps asking for the GVL.
+  #
+  def with_pending_interrupts
+    previous = trap('USR2') { }
+    parent   = Process.pid
+    sender   = fork { loop { Process.kill('USR2', parent); sleep 0.0005 } }
+    busy     = Thread.new { loop { 1000.times { }; Thread.pass } }
+
+    yield
+  ensure
+    busy.kill.join if busy
+    Process.kill('KILL', sender) if sender
+    Process.wait(sender) if sender
+    trap('USR2', previous)
+  end
+
+  # Runs a native call long enough for signals to arrive meanwhile, that
+  # are left pending when it returns.
+  #
+  def leave_interrupts_pending
+    'x' * 20_000_000
+    nil
+  end
+
+  # The number of native threads of this process
+  #
+  def native_threads
+    Dir.glob('/proc/self/task/*').size
+  end
+end
+
+RSpec.configure do |config|
+  config.include InterruptsHelper
+end
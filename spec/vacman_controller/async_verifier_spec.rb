@@ -0,0 +1,100 @@
+require 'spec_helper'
+
+describe VacmanController::AsyncVerifier do
+  let(:dpx_filename) { 'sample_dpx/VDP0000000.dpx' }
+  let(:transport_key) { '11111111111111111111111111111111' }
+
+  let(:tokens) do
+    VacmanController::Token.import dpx_filename, transport_key
+  end
+
+  let(:token) { tokens.first }
+
+  subject(:verifier) { described_class.new(workers: 2) }
+  after { verifier.close }
+
+  describe '#verify' do
+    it { expect(verifier.verify(token, token.generate)).to be(true) }
+    it { expect(verifier.verify(token, '000000')).to be(false) }
+
+    it 'updates the token' do
+      expect { verifier.verify(token, '000000') }.to change { token.properties.error_count }.by(1)
+      expect(token).to be_dirty
+    end
+
+    it 'verifies many tokens at once' do
+      otps = tokens.map(&:generate)
+
+      results = tokens.zip(otps).map do |token, otp|
+        Thread.new { verifier.verify(token, otp) }
+      end.map(&:value)
+
+      expect(results).to all(be(true))
+      expect(verifier.size).to eq(0)
+    end
+  end
+
+  describe '#verify_status' do
+    it { expect(verifier.verify_status(token.to_h, '000000')).to eq(1) }
+
+    it 'raises when the token cannot be written back, and keeps verifying' do
+      expect { verifier.verify_status(token.to_h.freeze, '000000') }.to raise_error(RuntimeError, /frozen/)
+
+      expect(verifier.verify(tokens.last, '000000')).to be(false)
+      expect(verifier.size).to eq(0)
+    end
+  end
+
+  describe '#close' do
+    before { verifier.close }
+
+    it { expect { verifier.verify(token, '000000') }.to raise_error(VacmanController::Error, /closed/) }
+    it { expect(verifier.close).to be(nil) }
+  end
+
+end
+
+describe VacmanController::LowLevel::AsyncQueue do
+  let(:dpx_filename) { 'sample_dpx/VDP0000000.dpx' }
+  let(:transport_key) { '11111111111111111111111111111111' }
+
+  let(:token) do
+    VacmanController::Token.import(dpx_filename, transport_key).first
+  end
+
+  subject(:queue) { described_class.new(2) }
+  after { queue.close }
+
+  let(:io) { IO.for_fd(queue.fileno, autoclose: false) }
+
+  it 'reports the completed verifications through the file descriptor' do
+    ticket = queue.submit(token.digipass, '000000')
+
+    expect(IO.select([io], nil, nil, 5)).to_not be_nil
+    expect(queue.reap).to eq([[ticket, 1]])
+    expect(token).to be_dirty
+  end
+
+  it { expect(queue.reap).to eq([]) }
+
+  it 'reports the tokens that cannot be written back, along with the others' do
+    frozen = queue.submit(token.to_h.freeze, '000000')
+    other  = queue.submit(token.digipass, '000000')
+
+    reaped = {}
+    reaped.update(queue.reap.to_h) while reaped.size < 2 && IO.select([io], nil, nil, 5)
+
+    expect(reaped[frozen]).to be_a(RuntimeError)
+    expect(reaped[other]).to eq(1)
+    expect(queue.size).to eq(0)
+  end
+
+  it { expect { described_class.new(0) }.to raise_error(ArgumentError) }
+
+  it 'is closed' do
+    queue.close
+
+    expect(queue).to be_closed
+    expect { queue.submit(token.digipass, '000000') }.to raise_error(VacmanController::Error, /closed/)
+  end
+end
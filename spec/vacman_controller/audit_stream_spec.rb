@@ -0,0 +1,102 @@
+require 'spec_helper'
+require 'tmpdir'
+
+describe VacmanController::AuditStream do
+  let(:dpx_filename) { 'sample_dpx/VDP0000000.dpx' }
+  let(:transport_key) { '11111111111111111111111111111111' }
+
+  let(:tokens) do
+    VacmanController::Token.import dpx_filename, transport_key
+  end
+
+  let(:token) { tokens.first }
+
+  let(:records) { [] }
+  let(:stats) { VacmanController::Kernel.audit_stats }
+
+  subject(:audit) do
+    described_class.new(interval: 60, capacity: 64) { |batch| records.concat(batch) }
+  end
+
+  after { audit.close }
+
+  it 'records the outcome of every verification' do
+    audit
+    token.verify(token.generate)
+    token.verify('000000')
+
+    expect(audit.drain).to eq(2)
+
+    expect(records.map(&:success?)).to eq([true, false])
+    expect(records.map(&:serial)).to eq([token.serial] * 2)
+    expect(records.map(&:app_name)).to eq([token.app_name] * 2)
+    expect(records.last.error_count).to eq(1)
+    expect(records.last.time).to be_within(60).of(Time.now)
+  end
+
+  it 'records batches' do
+    audit
+    VacmanController::Token.verify_all(tokens.first(3), %w(000000 000000 000000))
+
+    expect(audit.drain).to eq(3)
+    expect(records.map(&:serial)).to eq(tokens.first(3).map(&:serial))
+  end
+
+  it 'records the replays rejected by the replay cache' do
+    VacmanController::Kernel.configure_replay_cache(capacity: 1024)
+    audit
+
+    otp = token.generate
+    2.times { token.verify(otp) }
+
+    audit.drain
+    expect(records.map(&:success?)).to eq([true, false])
+  ensure
+    VacmanController::Kernel.configure_replay_cache(capacity: 0)
+  end
+
+  it 'records the verifications of many threads' do
+    audit
+    threads = tokens.first(4).map { |t| Thread.new { 8.times { t.verify('000000') } } }
+    threads.each(&:join)
+
+    expect(audit.drain).to eq(32)
+    expect(records.group_by(&:serial).values.map(&:size)).to eq([8] * 4)
+  end
+
+  it 'drops the records when the ring is full' do
+    audit
+    70.times { token.verify('000000') }
+
+    expect(stats['dropped']).to eq(6)
+    expect(audit.drain).to eq(64)
+  end
+
+  it 'does not record when closed' do
+    audit.close
+    token.verify('000000')
+
+    expect(stats['capacity']).to eq(0)
+    expect(stats['pushed']).to eq(0)
+  end
+
+  it { expect { described_class.new }.to raise_error(ArgumentError) }
+
+  context 'with a file' do
+    let(:dir) { Dir.mktmpdir }
+    let(:path) { File.join(dir, 'verifications.audit') }
+
+    subject(:audit) { described_class.new(path: path, interval: 60) }
+
+    after { FileUtils.remove_entry(dir) }
+
+    it 'appends the records to the file' do
+      audit
+      token.verify('000000')
+      audit.close
+
+      expect(File.size(path)).to eq(described_class::RECORD_SIZE)
+      expect(described_class.read(path).map(&:serial)).to eq([token.serial])
+    end
+  end
+end
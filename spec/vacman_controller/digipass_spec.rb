@@ -0,0 +1,111 @@
+require 'spec_helper'
+
+describe VacmanController::LowLevel::Digipass do
+  let(:dpx_filename) { 'sample_dpx/Demo_DP4MobileES.dpx' }
+  let(:transport_key) { '11111111111111111111111111111111' }
+
+  let(:hash) do
+    VacmanController.import(dpx_filename, transport_key).first
+  end
+
+  let(:digipass) { described_class.from_h(hash) }
+
+  describe '.new' do
+    it { expect { described_class.new }.to raise_error(NoMethodError) }
+  end
+
+  describe '.from_h' do
+    it { expect(digipass.serial).to eq(hash['serial']) }
+    it { expect(digipass.app_name).to eq(hash['app_name']) }
+
+    it { expect(digipass.static_vector).to eq(hash['sv']) }
+    it { expect(digipass.static_vector).to be_frozen }
+
+    it { expect { described_class.from_h({}) }.to raise_error(VacmanController::Error, /blob property is nil/) }
+
+    it do
+      expect { described_class.from_h(hash.merge('blob' => 'x' * 225)) }.to \
+        raise_error(VacmanController::Error, /blob is 225 bytes long, at most 224 allowed/)
+    end
+  end
+
+  describe '#to_h' do
+    subject { digipass.to_h }
+
+    it { is_expected.to eq(hash) }
+    it { is_expected.to_not be(hash) }
+  end
+
+  describe '#write_to' do
+    let(:target) { {} }
+    subject { digipass.write_to(target) }
+
+    it { is_expected.to be(target) }
+    it { is_expected.to eq(hash) }
+  end
+
+  describe '.load' do
+    subject { described_class.load(digipass.dump) }
+
+    it { expect(subject.to_h).to eq(hash) }
+    it { expect(subject.static_vector).to be_frozen }
+  end
+
+  describe '#restore' do
+    let(:copy) { digipass.dup }
+
+    before do
+      VacmanController::LowLevel.generate_password(copy)
+      digipass.clean!
+    end
+
+    it 'replaces the token state' do
+      expect(digipass.restore(copy.dump(true)).to_h).to eq(copy.to_h)
+      expect(digipass).to be_dirty
+    end
+
+    it 'leaves the token clean if the state did not change' do
+      expect(digipass.restore(digipass.dump)).not_to be_dirty
+    end
+
+    it { expect { digipass.restore('garbage') }.to raise_error(VacmanController::Error, /invalid token dump/) }
+  end
+
+  describe '#dup' do
+    subject { digipass.dup }
+
+    it { expect(subject.to_h).to eq(digipass.to_h) }
+
+    it 'does not share the token state' do
+      VacmanController::LowLevel.generate_password(subject)
+
+      expect(subject.to_h).to_not eq(digipass.to_h)
+    end
+  end
+
+  describe '#dirty?' do
+    it { expect(digipass).to_not be_dirty }
+
+    it 'is set by calls that change the state' do
+      expect { VacmanController::LowLevel.verify_password_status(digipass, '000000') }.to change { digipass.dirty? }.to(true)
+    end
+
+    it 'is not set by property reads' do
+      expect { VacmanController::LowLevel.get_token_properties(digipass) }.to_not change { digipass.dirty? }
+    end
+
+    it 'is cleared by clean!' do
+      VacmanController::LowLevel.verify_password_status(digipass, '000000')
+
+      expect { digipass.clean! }.to change { digipass.dirty? }.to(false)
+    end
+  end
+
+  describe 'low-level calls' do
+    it 'update the native state' do
+      expect { VacmanController::LowLevel.generate_password(digipass) }.to change { digipass.to_h }
+    end
+
+    it { expect(VacmanController::LowLevel.generate_activation(digipass)).to eq(VacmanController::LowLevel.generate_activation(hash)) }
+  end
+end
@@ -0,0 +1,86 @@
+require 'spec_helper'
+
+describe VacmanController::KernelParams do
+  let(:dpx_filename) { 'sample_dpx/VDP0000000.dpx' }
+  let(:transport_key) { '11111111111111111111111111111111' }
+
+  let(:token) do
+    VacmanController::Token.import(dpx_filename, transport_key).first
+  end
+
+  describe '.new' do
+    subject { described_class.new('ITimeWindow' => 10) }
+
+    it { is_expected.to be_frozen }
+
+    it { expect(subject['ITimeWindow']).to eq(10) }
+    it { expect(subject['IThreshold']).to eq(3) }
+
+    it { expect(subject.to_h.keys).to eq(VacmanController::Kernel.property_names) }
+
+    it { expect { described_class.new('Foo' => 1) }.to raise_error(/Invalid kernel param Foo/) }
+  end
+
+  describe '#merge' do
+    let(:params) { described_class.new }
+    subject { params.merge(EventWindow: 10) }
+
+    it { is_expected.to_not be(params) }
+    it { expect(subject['EventWindow']).to eq(10) }
+    it { expect { subject }.to_not change { params['EventWindow'] } }
+  end
+
+  describe '.default' do
+    subject { described_class.default }
+
+    it { is_expected.to be_frozen }
+
+    it 'is swapped when a Kernel parameter is changed' do
+      previous = subject
+
+      VacmanController::Kernel['ITimeWindow'] = 60
+
+      expect(described_class.default).to_not be(previous)
+      expect(described_class.default['ITimeWindow']).to eq(60)
+      expect(previous['ITimeWindow']).to eq(30)
+    end
+
+    after { VacmanController::Kernel['ITimeWindow'] = 30 }
+  end
+
+  describe '.with' do
+    it 'sets the parameters on the current thread only' do
+      described_class.with('ITimeWindow' => 5) do
+        expect(described_class.current['ITimeWindow']).to eq(5)
+
+        expect(Thread.new { described_class.current['ITimeWindow'] }.value).to eq(30)
+      end
+
+      expect(described_class.current).to be(described_class.default)
+    end
+
+    it 'sets the parameters for every fiber of the thread' do
+      described_class.with('ITimeWindow' => 5) do
+        expect(Fiber.new { described_class.current['ITimeWindow'] }.resume).to eq(5)
+        expect(Enumerator.new { |y| y << described_class.current['ITimeWindow'] }.next).to eq(5)
+      end
+    end
+
+    it 'keeps the enclosing parameters when given an invalid one' do
+      described_class.with('ITimeWindow' => 5) do
+        expect { described_class.with('Bogus' => 1) {} }.to \
+          raise_error(VacmanController::Error, /Invalid kernel param Bogus/)
+
+        expect(described_class.current['ITimeWindow']).to eq(5)
+      end
+    end
+  end
+
+  describe 'per-call parameters' do
+    let(:locking) { described_class.default.merge('DiagLevel' => 1, 'IThreshold' => 1) }
+
+    it 'are used instead of the default ones' do
+      expect(VacmanController::LowLevel.verify_password(token.to_h, token.generate, locking)).to be(true)
+    end
+  end
+end
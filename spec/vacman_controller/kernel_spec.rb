@@ -39,6 +39,8 @@ describe VacmanController::Kernel do
     context 'on a valid property' do
       it { expect(described_class['DiagLevel']).to eq(0) }
       it { expect(described_class['ITimeWindow']).to eq(30) }
+      it { expect(described_class[:ITimeWindow]).to eq(30) }
+      it { expect(described_class[described_class.property_names.index('ITimeWindow')]).to eq(30) }
     end
 
     context 'on a bogus property' do
@@ -63,4 +65,100 @@ describe VacmanController::Kernel do
     end
   end
 
+  describe '.stats' do
+    let(:token) { VacmanController::Token.import('sample_dpx/VDP0000000.dpx', '11111111111111111111111111111111').first }
+
+    before do
+      described_class.stats_enabled = true
+      described_class.reset_stats
+    end
+
+    after do
+      described_class.stats_enabled = false
+      described_class.reset_stats
+    end
+
+    subject { described_class.stats }
+
+    it { is_expected.to be_a(Hash) }
+    it { is_expected.to have_key('AAL2VerifyPassword') }
+    it { is_expected.to have_key('marshal') }
+
+    context 'after a verification' do
+      before do
+        described_class.reset_stats
+        token.verify(token.generate)
+      end
+
+      it 'counts the calls and their latency' do
+        stat = subject['AAL2VerifyPassword']
+
+        expect(stat['calls']).to eq(1)
+        expect(stat['errors']).to eq(0)
+        expect(stat['total_ns']).to be > 0
+        expect(stat['histogram'].map(&:last).inject(:+)).to eq(1)
+        expect(stat['p99_ns']).to be >= stat['mean_ns']
+      end
+    end
+
+    context 'after a failed verification' do
+      before do
+        described_class.reset_stats
+        token.verify('000000')
+        token.verify('000000')
+      end
+
+      it 'tallies the error codes' do
+        stat = subject['AAL2VerifyPassword']
+
+        expect(stat['errors']).to eq(2)
+        expect(stat['error_codes'].values).to eq([2])
+      end
+    end
+
+    context 'when disabled' do
+      before do
+        described_class.stats_enabled = false
+        token.generate
+      end
+
+      it { expect(subject['AAL2GenPassword']['calls']).to eq(0) }
+    end
+  end
+
+  describe '.reset_stats' do
+    before { described_class.stats_enabled = true }
+    after { described_class.stats_enabled = false }
+
+    it 'clears the counters' do
+      VacmanController.import('sample_dpx/VDP0000000.dpx', '11111111111111111111111111111111')
+      described_class.reset_stats
+
+      expect(described_class.stats.values.map { |stat| stat['calls'] }.uniq).to eq([0])
+    end
+  end
+
+  describe '.prometheus_stats' do
+    let(:token) { VacmanController::Token.import('sample_dpx/VDP0000000.dpx', '11111111111111111111111111111111').first }
+
+    before do
+      described_class.stats_enabled = true
+      described_class.reset_stats
+      token.generate
+    end
+
+    after do
+      described_class.stats_enabled = false
+      described_class.reset_stats
+    end
+
+    subject { described_class.prometheus_stats }
+
+    it { is_expected.to include('# TYPE vacman_controller_calls_total counter') }
+    it { is_expected.to include('vacman_controller_calls_total{function="AAL2GenPassword"} 1') }
+    it { is_expected.to include('vacman_controller_duration_seconds_bucket{function="AAL2GenPassword",le="+Inf"} 1') }
+    it { is_expected.to include('vacman_controller_duration_seconds_count{function="AAL2GenPassword"} 1') }
+    it { is_expected.not_to include('function="AAL2VerifyPassword"') }
+  end
+
 end
@@ -0,0 +1,77 @@
+require 'spec_helper'
+
+describe 'VacmanController::RactorPool', if: defined?(Ractor) do
+  let(:dpx_filename) { 'sample_dpx/VDP0000000.dpx' }
+  let(:transport_key) { '11111111111111111111111111111111' }
+
+  let(:tokens) do
+    VacmanController::Token.import dpx_filename, transport_key
+  end
+
+  let(:token) { tokens.first }
+
+  subject(:pool) { VacmanController::RactorPool.new(workers: 2) }
+  after { pool.close }
+
+  describe '#verify' do
+    it { expect(pool.verify(token, token.generate)).to be(true) }
+    it { expect(pool.verify(token, '000000')).to be(false) }
+
+    it 'updates the token' do
+      token.persisted!
+
+      expect { pool.verify(token, '000000') }.to change { token.properties.error_count }.by(1)
+      expect(token).to be_dirty
+    end
+  end
+
+  describe '#verify_all' do
+    it 'verifies many tokens at once' do
+      otps = tokens.map(&:generate)
+
+      expect(pool.verify_all(tokens, otps)).to all(be(true))
+    end
+
+    it { expect { pool.verify_all(tokens, []) }.to raise_error(ArgumentError) }
+
+    it 'raises any error of a worker, and keeps working' do
+      otps = tokens.first(2).map(&:generate)
+      otps[1] = "12\0"
+
+      expect { pool.verify_all(tokens.first(2), otps) }.to raise_error(ArgumentError, /null byte/)
+      expect(pool.verify(tokens.last, tokens.last.generate)).to be(true)
+    end
+  end
+
+  describe '#close' do
+    it 'rejects further verifications' do
+      pool.close
+      expect { pool.verify(token, '000000') }.to raise_error(VacmanController::Error, /closed/)
+    end
+  end
+
+  it { expect { VacmanController::RactorPool.new(workers: 0) }.to raise_error(ArgumentError) }
+
+  context 'with kernel params' do
+    subject(:pool) do
+      VacmanController::RactorPool.new(workers: 1,
+        params: VacmanController::KernelParams.default.merge('ITimeWindow' => 10))
+    end
+
+    it { expect(pool.verify(token, token.generate)).to be(true) }
+  end
+
+  describe 'kernel params' do
+    it 'are kept per Ractor' do
+      ractor = Ractor.new do
+        VacmanController::Kernel['ITimeWindow'] = 5
+        VacmanController::Kernel['ITimeWindow']
+      end
+
+      expect(ractor.respond_to?(:value) ? ractor.value : ractor.take).to eq(5)
+      expect(VacmanController::Kernel['ITimeWindow']).to eq(30)
+    end
+
+    it { expect(Ractor.shareable?(VacmanController::KernelParams.default)).to be(true) }
+  end
+end
@@ -0,0 +1,43 @@
+require 'spec_helper'
+require 'etc'
+
+# Run with `rake spec:threads`, that builds the stub AAL2 library in
+# spec/support/aal2stub.c and preloads it.
+#
+describe 'Concurrent verification' do
+  let(:dpx_filename) { 'sample_dpx/VDP0000000.dpx' }
+  let(:transport_key) { '11111111111111111111111111111111' }
+
+  let(:tokens) do
+    VacmanController::Token.import dpx_filename, transport_key
+  end
+
+  let(:threads) { [Etc.nprocessors, 4].min }
+  let(:verifies) { 400 }
+
+  # Runs `verifies` verifications spread over `count` threads, each thread
+  # working on its own token, and returns the elapsed wall clock time.
+  #
+  def verify_with(count)
+    otps = tokens.first(count).map(&:generate)
+
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+    count.times.map do |i|
+      Thread.new do
+        (verifies / count).times { tokens[i].verify!(otps[i]) }
+      end
+    end.each(&:join)
+
+    Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+  end
+
+  it 'scales with the number of threads' do
+    skip 'needs at least 2 CPUs' if threads < 2
+
+    serial   = verify_with(1)
+    parallel = verify_with(threads)
+
+    expect(serial / parallel).to be > (threads * 0.6)
+  end
+end if ENV['AAL2STUB']
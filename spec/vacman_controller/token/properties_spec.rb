@@ -31,9 +31,60 @@ describe VacmanController::Token::Properties do
 
     it { expect(subject).to be_a(Hash) }
     it { expect(subject.keys).to eq(described_class.names) }
+
+    it 'returns the same values as reading each property' do
+      each = described_class.names.map { |name| [name, (token.properties[name] rescue "ERROR: #$!")] }.to_h
+
+      expect(subject).to eq(each)
+    end
+
+    it { expect(subject['token_status']).to match(/\AERROR: .*AAL2GetTokenProperty/) }
+  end
+
+  describe 'LowLevel.get_token_properties' do
+    subject { VacmanController::LowLevel.get_token_properties(token.digipass, names) }
+
+    let(:names) { ['pin_len', :pin_length, 'use_count'] }
+
+    it { expect(subject.keys).to eq(names) }
+    it { expect(subject['pin_len']).to be(subject[:pin_length]) }
+    it { expect(subject['use_count']).to be(0) }
+
+    context 'given property IDs' do
+      let(:ids) { VacmanController::LowLevel.token_property_ids }
+      let(:names) { [ids['use_count'], ids['pin_len']] }
+
+      it { expect(subject).to eq(ids['use_count'] => 0, ids['pin_len'] => 0) }
+    end
+
+    context 'on typed properties' do
+      let(:names) { %w( last_time_used pin_supported auth_mode virtual_token_grace_period ) }
+
+      it { expect(subject['last_time_used']).to eq(Time.utc(1970)) }
+      it { expect(subject['last_time_used']).to be_utc }
+      it { expect(subject['pin_supported']).to be(false) }
+      it { expect(subject['auth_mode']).to be(:response_only) }
+      it { expect(subject['virtual_token_grace_period']).to be(nil) }
+    end
+
+    context 'on a write-only property' do
+      let(:names) { ['token_status', 'use_count'] }
+
+      it { expect(subject['token_status']).to be_a(VacmanController::Error) }
+      it { expect(subject['use_count']).to be(0) }
+    end
+
+    context 'given an invalid property name' do
+      let(:names) { ['use_count', 'foobar'] }
+
+      it { expect { subject }.to raise_error(VacmanController::Error, /Invalid property name/) }
+    end
   end
 
   describe '[]' do
+    it { expect(token.properties['use_count']).to be(0) }
+    it { expect { token.properties[:foobar] }.to raise_error(VacmanController::Error, /Invalid property name `foobar'/) }
+
     it { expect(token.properties[:last_time_used]).to eq(Time.utc(1970)) }
     it { expect(token.properties[:virtual_token_grace_period]).to be(nil) }
 
@@ -121,7 +172,7 @@ describe VacmanController::Token::Properties do
     end
   end
 
-  describe '#method_missing' do
+  describe 'accessors' do
     context 'on a PIN-enabled token' do
       let(:dpx_filename) { 'sample_dpx/Demo_GO6.dpx' }
 
@@ -0,0 +1,136 @@
+require 'spec_helper'
+require 'tmpdir'
+
+describe VacmanController::TokenFile do
+  let(:dpx_filename) { 'sample_dpx/VDP0000000.dpx' }
+  let(:transport_key) { '11111111111111111111111111111111' }
+
+  let(:tokens) do
+    VacmanController::Token.import dpx_filename, transport_key
+  end
+
+  let(:token) { tokens.first }
+
+  let(:dir) { Dir.mktmpdir }
+  let(:path) { File.join(dir, 'tokens.vctf') }
+
+  before { described_class.export(path, tokens) }
+  after  { FileUtils.remove_entry(dir) }
+
+  def error_count(file)
+    file.token(token.serial, app_name: token.app_name).properties.error_count
+  end
+
+  describe '.export' do
+    it { expect(described_class.export(path, tokens)).to eq(tokens.size) }
+    it { expect(described_class.export(path, tokens.map(&:to_h))).to eq(tokens.size) }
+    it { expect(described_class.export(path, [])).to eq(0) }
+
+    it { expect { described_class.export(path, [token, token]) }.to raise_error(VacmanController::Error, /duplicate token/) }
+
+    it 'leaves no temporary file behind' do
+      expect(Dir.entries(dir) - %w(. ..)).to eq(['tokens.vctf'])
+    end
+  end
+
+  describe '.open' do
+    it 'yields the file and closes it' do
+      file = described_class.open(path) { |f| f }
+      expect(file).to be_closed
+    end
+
+    it { expect(described_class.open(path, &:size)).to eq(tokens.size) }
+
+    it 'refuses a file in use by another process' do
+      described_class.open(path) do
+        pid = fork do
+          begin
+            described_class.open(path)
+            exit! 0
+          rescue VacmanController::Error
+            exit! 1
+          end
+        end
+
+        expect(Process.wait2(pid).last.exitstatus).to eq(1)
+      end
+    end
+
+    it 'refuses a file that is not a token file' do
+      File.write(path, 'x' * 8192)
+      expect { described_class.open(path) }.to raise_error(VacmanController::Error, /invalid token file/)
+    end
+
+    it 'refuses a truncated file' do
+      File.truncate(path, File.size(path) - 512)
+      expect { described_class.open(path) }.to raise_error(VacmanController::Error, /invalid token file/)
+    end
+
+    it { expect { described_class.open(File.join(dir, 'missing')) }.to raise_error(Errno::ENOENT) }
+  end
+
+  describe '#verify' do
+    subject(:file) { described_class.new(path) }
+    after { file.close }
+
+    it { expect(file.verify(token.serial, token.generate, app_name: token.app_name)).to be(true) }
+    it { expect(file.verify(token.serial, '000000', app_name: token.app_name)).to be(false) }
+
+    it { expect { file.verify('VDP9999999', '000000', app_name: token.app_name) }.to raise_error(VacmanController::Error, /not found/) }
+
+    it 'updates the token in the file' do
+      2.times { file.verify(token.serial, '000000', app_name: token.app_name) }
+
+      expect(error_count(file)).to eq(2)
+      expect(file.changed).to eq(2)
+
+      file.close
+      expect(described_class.open(path) { |f| error_count(f) }).to eq(2)
+    end
+
+    it 'serialises the verifications of the same token' do
+      threads = 8.times.map { Thread.new { file.verify(token.serial, '000000', app_name: token.app_name) } }
+      threads.each(&:join)
+
+      expect(error_count(file)).to eq(8)
+    end
+
+    it 'raises once the file is closed' do
+      file.close
+      expect { file.verify(token.serial, '000000', app_name: token.app_name) }.to raise_error(VacmanController::Error, /closed/)
+    end
+  end
+
+  context 'when read-only' do
+    it 'keeps the changes in memory' do
+      described_class.open(path, readonly: true) do |file|
+        file.verify(token.serial, '000000', app_name: token.app_name)
+        expect(error_count(file)).to eq(1)
+      end
+
+      expect(described_class.open(path) { |f| error_count(f) }).to eq(0)
+    end
+
+    it 'can be opened by many at once' do
+      described_class.open(path, readonly: true) do
+        expect(described_class.open(path, readonly: true, &:readonly?)).to be(true)
+      end
+    end
+  end
+
+  describe '#token' do
+    subject(:file) { described_class.new(path) }
+    after { file.close }
+
+    it { expect(file.token(token.serial, app_name: token.app_name).to_h).to eq(token.to_h) }
+    it { expect(file.token('VDP9999999', app_name: token.app_name)).to be(nil) }
+  end
+
+  describe '#each' do
+    subject(:file) { described_class.new(path) }
+    after { file.close }
+
+    it { expect(file.map(&:serial)).to eq(tokens.map(&:serial)) }
+    it { expect(file.each.size).to eq(tokens.size) }
+  end
+end
@@ -49,6 +49,95 @@ describe VacmanController::Token do
 
       expect(token.to_h.object_id).to be(id)
     end
+
+    it 'replaces only the values that changed' do
+      before = token.to_h.dup
+
+      token.verify!(token.generate)
+
+      expect(token.to_h['serial']).to be(before['serial'])
+      expect(token.to_h['app_name']).to be(before['app_name'])
+      expect(token.to_h['blob']).to_not be(before['blob'])
+    end
+
+    it { expect(token.to_h.keys).to all(be_frozen) }
+  end
+
+  describe '#dump' do
+    subject { token.dump }
+
+    it { is_expected.to be_a(String) }
+    it { expect(subject.encoding).to eq(Encoding::BINARY) }
+    it { expect(subject.bytesize).to eq(256 + 4 + token.to_h['sv'].bytesize) }
+    it { expect(subject.bytesize).to be < token.to_h.to_s.bytesize }
+  end
+
+  describe '.load' do
+    subject { described_class.load(token.dump) }
+
+    it { is_expected.to be_a(described_class) }
+    it { expect(subject.to_h).to eq(token.to_h) }
+    it { expect(subject.serial).to eq(token.serial) }
+    it { expect(subject).to_not be_dirty }
+    it { expect(subject.verify(subject.generate)).to be(true) }
+
+    it 'round-trips tokens without a static vector' do
+      hash = token.to_h.dup
+      hash.delete('sv')
+
+      expect(described_class.load(described_class.new(hash).dump).to_h).to eq(hash)
+    end
+
+    context 'with a static vector digest' do
+      subject { described_class.load(token.dump(static_vector: :digest)) }
+
+      it { expect(token.dump(static_vector: :digest).bytesize).to eq(256 + 8) }
+      it { expect(subject.to_h).to eq(token.to_h) }
+      it { expect(subject.to_h['sv']).to be(token.to_h['sv']) }
+    end
+
+    it { expect { token.dump(static_vector: :foo) }.to raise_error(ArgumentError) }
+
+    it { expect { described_class.load('foo') }.to raise_error(VacmanController::Error, /invalid token dump/) }
+    it { expect { described_class.load(token.dump[0...-1]) }.to raise_error(VacmanController::Error, /truncated/) }
+    it { expect { described_class.load(token.dump.tap { |d| d.setbyte(4, 9) }) }.to raise_error(VacmanController::Error, /version 9/) }
+  end
+
+  describe '#static_vector_digest' do
+    subject { token.static_vector_digest }
+
+    it { is_expected.to match(/\A[0-9a-f]{16}\z/) }
+    it { is_expected.to eq(tokens.last.static_vector_digest) }
+    it { expect(VacmanController.static_vectors[subject]).to be(token.to_h['sv']) }
+  end
+
+  describe '#dirty?' do
+    it { expect(token).to_not be_dirty }
+
+    it { expect { token.verify(token.generate) }.to change { token.dirty? }.to(true) }
+    it { expect { token.verify('000000') }.to change { token.dirty? }.to(true) }
+    it { expect { token.properties.all }.to_not change { token.dirty? } }
+  end
+
+  describe '#persist' do
+    before { token.verify(token.generate) }
+
+    it 'yields the token hash when dirty' do
+      expect { |b| token.persist(&b) }.to yield_control.once
+      expect(token).to_not be_dirty
+    end
+
+    it 'does not yield when clean' do
+      token.persisted!
+
+      expect { |b| token.persist(&b) }.to_not yield_control
+      expect(token.persist { }).to be(false)
+    end
+
+    it 'keeps the token dirty if persistence fails' do
+      expect { token.persist { raise 'boom' } }.to raise_error('boom')
+      expect(token).to be_dirty
+    end
   end
 
   describe '#verify!' do
@@ -73,6 +162,15 @@ describe VacmanController::Token do
 
     it { expect { token.verify(token.generate) }.to change { token.to_h } }
 
+    it { expect { token.verify('111111') }.to change { token.properties.error_count }.by(1) }
+
+    context 'low-level status' do
+      let(:lowlevel) { VacmanController::LowLevel }
+
+      it { expect(lowlevel.verify_password_status(token.to_h, token.generate)).to eq(0) }
+      it { expect(lowlevel.verify_password_status(token.to_h, '111111')).to be_a(Integer).and be_nonzero }
+    end
+
     context 'lockout' do
       before { expect(VacmanController::Kernel['IThreshold']).to eq(3) }
 
@@ -113,6 +211,158 @@ describe VacmanController::Token do
     end
   end
 
+  describe 'adaptive window' do
+    before { VacmanController::Kernel.configure_adaptive_window(time_window: 2, event_window: 10) }
+    after { VacmanController::Kernel.configure_adaptive_window(time_window: 0) }
+
+    let(:stats) { VacmanController::Kernel.adaptive_window_stats }
+
+    it { expect(stats).to include('time_window' => 2, 'event_window' => 10) }
+
+    context 'on a token verified before' do
+      before { expect(token.verify(token.generate)).to be(true) }
+
+      let(:next_otp) { token.generate_passwords(from: Time.now + 30, count: 1).first.last }
+
+      it 'accepts a valid OTP within the narrow windows' do
+        expect { expect(token.verify(next_otp)).to be(true) }.to \
+          change { VacmanController::Kernel.adaptive_window_stats['narrow'] }.by(1)
+      end
+
+      it 'verifies an invalid OTP again with the full windows' do
+        expect { expect(token.verify('000000')).to be(false) }.to \
+          change { VacmanController::Kernel.adaptive_window_stats['widened'] }.by(1)
+      end
+    end
+
+    it 'verifies a token never verified before with the full windows only' do
+      expect { expect(token.verify(token.generate)).to be(true) }.to \
+        change { VacmanController::Kernel.adaptive_window_stats['unknown'] }.by(1)
+    end
+
+    it 'counts a single error for an invalid OTP' do
+      expect { token.verify('000000') }.to change { token.properties.error_count }.by(1)
+    end
+
+    it 'applies to batches' do
+      pair = tokens.first(2)
+
+      expect(described_class.verify_all(pair, [pair.first.generate, '000000'])).to eq([true, false])
+    end
+
+    it do
+      expect { VacmanController::Kernel.configure_adaptive_window(time_window: -1) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe 'replay cache' do
+    before { VacmanController::Kernel.configure_replay_cache(capacity: 1024) }
+    after { VacmanController::Kernel.configure_replay_cache(capacity: 0) }
+
+    let(:stats) { VacmanController::Kernel.replay_cache_stats }
+
+    it 'rejects a replayed OTP without altering the token' do
+      otp = token.generate
+
+      expect(token.verify(otp)).to be(true)
+      expect { expect(token.verify(otp)).to be(false) }.to_not change { token.to_h }
+
+      expect(stats['replays']).to eq(1)
+    end
+
+    it 'rejects a known invalid OTP without altering the token' do
+      expect(token.verify('000000')).to be(false)
+      expect { expect(token.verify('000000')).to be(false) }.to_not change { token.properties.error_count }
+
+      expect(stats['rejects']).to eq(1)
+    end
+
+    it 'does not read the token time step for an invalid OTP' do
+      VacmanController::Kernel.stats_enabled = true
+      VacmanController::Kernel.reset_stats
+
+      token.verify('000000')
+
+      expect(VacmanController::Kernel.stats['AAL2GetTokenProperty']['calls']).to eq(0)
+    ensure
+      VacmanController::Kernel.stats_enabled = false
+      VacmanController::Kernel.reset_stats
+    end
+
+    it 'verifies different OTPs and tokens' do
+      expect(token.verify('000000')).to be(false)
+      expect(token.verify(token.generate)).to be(true)
+      expect(tokens.last.verify(tokens.last.generate)).to be(true)
+
+      expect(stats['misses']).to eq(3)
+      expect(stats['entries']).to eq(3)
+    end
+
+    it 'applies to batches' do
+      pair = tokens.first(2)
+      otps = [pair.first.generate, '000000']
+
+      expect(described_class.verify_all(pair, otps)).to eq([true, false])
+      expect { expect(described_class.verify_all(pair, otps)).to eq([false, false]) }.to_not change { pair.map(&:to_h) }
+
+      expect(stats['replays']).to eq(1)
+      expect(stats['rejects']).to eq(1)
+    end
+
+    it 'forgets OTPs when cleared' do
+      expect(token.verify('000000')).to be(false)
+
+      VacmanController::Kernel.clear_replay_cache
+
+      expect { token.verify('000000') }.to change { token.properties.error_count }.by(1)
+    end
+
+    it 'is bounded' do
+      VacmanController::Kernel.configure_replay_cache(capacity: 1)
+
+      expect(stats['capacity']).to eq(512)
+    end
+
+    it { expect { VacmanController::Kernel.configure_replay_cache(capacity: -1) }.to raise_error(ArgumentError) }
+  end
+
+  describe '.import_each' do
+    subject { described_class.import_each(dpx_filename, transport_key) }
+
+    it { expect(subject.first).to be_a(described_class) }
+    it { expect(subject.map(&:serial)).to eq(tokens.map(&:serial)) }
+  end
+
+  describe '.verify_all' do
+    let(:pair) { tokens.first(2) }
+    let(:otps) { [pair.first.generate, '000000'] }
+
+    subject { described_class.verify_all(pair, otps) }
+
+    it { is_expected.to eq([true, false]) }
+
+    it { expect { subject }.to change { pair.first.properties.use_count }.by(1) }
+    it { expect { subject }.to change { pair.last.properties.error_count }.by(1) }
+
+    it do
+      expect { described_class.verify_all(pair, otps.first(1)) }.to \
+        raise_error(VacmanController::Error, /got 2 tokens and 1 passwords/)
+    end
+
+    it 'rejects the same token given twice' do
+      expect { described_class.verify_all([pair.first, pair.first], otps) }.to \
+        raise_error(VacmanController::Error, /#{pair.first.serial}.*given twice/)
+    end
+
+    it 'rejects two copies of the same token' do
+      copy = described_class.new(pair.first.to_h.dup)
+
+      expect { described_class.verify_all([pair.first, copy], otps) }.to \
+        raise_error(VacmanController::Error, /given twice/)
+      expect(pair.first.properties.error_count).to eq(0)
+    end
+  end
+
   describe '#generate' do
     subject { token.generate }
 
@@ -121,6 +371,83 @@ describe VacmanController::Token do
     end
   end
 
+  describe '#generate_passwords' do
+    let(:from) { Time.at(Time.now.to_i) }
+
+    subject { token.generate_passwords(from: from, count: 3, step: 60) }
+
+    it { expect(subject.size).to eq(3) }
+    it { expect(subject.map(&:first)).to eq([from, from + 60, from + 120]) }
+    it { expect(subject.map(&:last)).to all(match(/\A[0-9]{6}\Z/)) }
+
+    it 'generates the OTPs the token shows at those times' do
+      expect(token.verify(subject.first.last)).to be(true)
+    end
+
+    it 'does not alter the token' do
+      expect { subject.to_a }.to_not change { token.to_h }
+    end
+
+    it 'stops at the end time' do
+      expect(token.generate_passwords(from: from, to: from + 90, step: 30).count).to eq(4)
+    end
+
+    it 'generates in chunks' do
+      otps = token.generate_passwords(from: from, count: 5000, step: 30).to_a
+
+      expect(otps.size).to eq(5000)
+      expect(otps.last.first).to eq(from + 4999 * 30)
+    end
+
+    it 'generates event OTPs without a start time' do
+      expect(token.generate_passwords(count: 3).map(&:first)).to eq([0, 1, 2])
+    end
+
+    it { expect { token.generate_passwords(from: from) }.to raise_error(ArgumentError) }
+    it { expect { token.generate_passwords(from: from, count: 1, step: 0).to_a }.to raise_error(ArgumentError) }
+    it { expect { token.generate_passwords(from: from + 2**40, count: 1).to_a }.to raise_error(ArgumentError, /too far/) }
+  end
+
+  describe '.generate_passwords' do
+    let(:from) { Time.at(Time.now.to_i) }
+    let(:pair) { tokens.first(2) }
+
+    subject { described_class.generate_passwords(pair, from: from, count: 3, workers: 2) }
+
+    it 'generates the OTPs of every token, in order' do
+      expect(subject.to_a.size).to eq(6)
+
+      pair.each do |t|
+        expect(subject.select { |owner, _, _| owner.equal?(t) }.map { |_, at, _| at }).to eq([from, from + 30, from + 60])
+      end
+    end
+
+    it 'generates the same OTPs as generate_passwords' do
+      expect(subject.select { |owner, _, _| owner.equal?(token) }.map(&:last)).to eq(token.generate_passwords(from: from, count: 3).map(&:last))
+    end
+
+    it 'writes them to an IO' do
+      io = StringIO.new
+
+      expect(described_class.generate_passwords(pair, from: from, count: 3, io: io)).to eq(6)
+      expect(io.string.lines.first).to eq("#{token.serial},#{token.app_name},#{from.to_i},#{token.generate_passwords(from: from, count: 1).first.last}\n")
+    end
+
+    it 'stops the workers when the block breaks with interrupts pending' do
+      with_pending_interrupts do
+        threads = native_threads
+
+        50.times do
+          described_class.generate_passwords(tokens, from: from, count: 10_000, workers: 8) { leave_interrupts_pending; break }
+
+          expect(native_threads).to eq(threads)
+        end
+      end
+    end
+
+    it { expect(described_class.generate_passwords([], count: 3).to_a).to eq([]) }
+  end
+
   describe '#activation' do
     subject { token.activation }
 
@@ -139,6 +466,65 @@ describe VacmanController::Token do
     end
   end
 
+  describe '.activations' do
+    let(:dpx_filename) { 'sample_dpx/Demo_DP4MobileES.dpx' }
+
+    subject { described_class.activations(tokens, workers: 2).to_a }
+
+    it 'activates every token' do
+      expect(subject.map(&:first).flatten).to match_array(tokens)
+    end
+
+    it 'returns the same codes as #activation' do
+      expect(subject.sort_by { |(t), _| t.serial }).to eq(tokens.map { |t| [[t], t.activation] })
+    end
+
+    it { expect { subject }.to_not change { tokens.map(&:to_h) } }
+
+    context 'given the applications of the same DIGIPASS' do
+      let(:app) do
+        described_class.new(tokens.first.to_h.merge('app_name' => 'CHALRESP    '))
+      end
+
+      subject { described_class.activations([tokens.first, tokens[1], app], workers: 2).to_a }
+
+      it 'activates them together' do
+        expect(subject.map(&:first)).to match_array([[tokens.first, app], [tokens[1]]])
+      end
+    end
+
+    context 'on tokens that do not support activation data generation' do
+      let(:dpx_filename) { 'sample_dpx/VDP0000000.dpx' }
+
+      it 'yields the errors' do
+        expect(subject.map(&:last)).to all(be_a(VacmanController::Error))
+        expect(subject.first.last.message).to match(/Invalid Static Vector Length/)
+      end
+    end
+
+    it 'stops the workers when the block breaks' do
+      count = 0
+
+      described_class.activations(tokens, workers: 2) { break if (count += 1) == 2 }
+
+      expect(count).to eq(2)
+    end
+
+    it 'stops the workers when the block breaks with interrupts pending' do
+      with_pending_interrupts do
+        threads = native_threads
+
+        50.times do
+          described_class.activations(tokens * 10, workers: 8) { leave_interrupts_pending; break }
+
+          expect(native_threads).to eq(threads)
+        end
+      end
+    end
+
+    it { expect { described_class.activations(tokens, workers: 0) { } }.to raise_error(ArgumentError) }
+  end
+
   context 'on tokens that support PINs' do
     let(:dpx_filename) { 'sample_dpx/Demo_GO6.dpx' }
 
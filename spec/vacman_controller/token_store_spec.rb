@@ -0,0 +1,139 @@
+require 'spec_helper'
+
+describe VacmanController::TokenStore do
+  let(:dpx_filename) { 'sample_dpx/VDP0000000.dpx' }
+  let(:transport_key) { '11111111111111111111111111111111' }
+
+  let(:tokens) do
+    VacmanController::Token.import dpx_filename, transport_key
+  end
+
+  let(:token) { tokens.first }
+
+  let(:database) { tokens.map { |token| [[token.serial, token.app_name], token.to_h] }.to_h }
+  let(:persisted) { [] }
+
+  subject(:store) do
+    described_class.new(
+      load:    ->(serial, app_name) { database[[serial, app_name]] },
+      persist: ->(tokens) { persisted << tokens },
+      batch:   3,
+      shards:  4,
+    )
+  end
+
+  describe '#verify' do
+    it { expect(store.verify(token.serial, token.generate, app_name: token.app_name)).to be(true) }
+    it { expect(store.verify(token.serial, '000000', app_name: token.app_name)).to be(false) }
+
+    it 'loads the token on first use' do
+      expect { store.verify(token.serial, '000000', app_name: token.app_name) }.to change { store.size }.from(0).to(1)
+    end
+
+    it 'keeps the token state in memory' do
+      2.times { store.verify(token.serial, '000000', app_name: token.app_name) }
+      store.lock(token.serial, app_name: token.app_name) { |t| expect(t.properties.error_count).to eq(2) }
+    end
+
+    it { expect { store.verify('VDP9999999', '000000', app_name: token.app_name) }.to raise_error(VacmanController::Error, /not found/) }
+
+    it 'serialises the verifications of the same token' do
+      threads = 8.times.map { Thread.new { store.verify(token.serial, '000000', app_name: token.app_name) } }
+      threads.each(&:join)
+
+      store.lock(token.serial, app_name: token.app_name) { |t| expect(t.properties.error_count).to eq(8) }
+    end
+  end
+
+  describe '#lock' do
+    it 'yields a Token and stores its changes' do
+      store.lock(token.serial, app_name: token.app_name) { |t| t.verify('000000') }
+
+      expect(store.lock(token.serial, app_name: token.app_name) { |t| t.properties.error_count }).to eq(1)
+      expect(store.dirty_size).to eq(1)
+    end
+
+    it { expect(store.lock(token.serial, app_name: token.app_name) { nil }).to be(nil) }
+
+    it 'raises rather than waiting for itself' do
+      expect {
+        store.lock(token.serial, app_name: token.app_name) do
+          store.verify(token.serial, '000000', app_name: token.app_name)
+        end
+      }.to raise_error(VacmanController::Error, /already locked/)
+    end
+  end
+
+  describe '#add' do
+    it { expect(store.add(token)).to be(true) }
+
+    it 'does not overwrite a stored token' do
+      store.add(token)
+      expect(store.add(token.to_h)).to be(false)
+      expect(store.size).to eq(1)
+    end
+  end
+
+  describe '#delete' do
+    before { store.add(token) }
+
+    it { expect(store.delete(token.serial, app_name: token.app_name)).to be(true) }
+    it { expect(store.delete('VDP9999999', app_name: token.app_name)).to be(false) }
+    it { expect { store.delete(token.serial, app_name: token.app_name) }.to change { store.size }.by(-1) }
+  end
+
+  describe '#flush' do
+    before do
+      tokens.each { |t| store.verify(t.serial, '000000', app_name: t.app_name) }
+    end
+
+    it 'persists the changed tokens in batches' do
+      expect(store.dirty_size).to eq(tokens.size)
+      expect(store.flush).to eq(tokens.size)
+
+      expect(persisted.map(&:size).max).to eq(3)
+      expect(persisted.flatten.map(&:serial)).to match_array(tokens.map(&:serial))
+      expect(persisted.flatten.first.to_h.keys).to include('blob', 'sv')
+      expect(store.dirty_size).to eq(0)
+    end
+
+    it { store.flush; expect(store.flush).to eq(0) }
+
+    it 'flushes again the tokens that were not persisted' do
+      failing = described_class.new(load: ->(serial, app_name) { database[[serial, app_name]] },
+                                    persist: ->(_) { raise 'database down' })
+      failing.verify(token.serial, '000000', app_name: token.app_name)
+
+      expect { failing.flush }.to raise_error(RuntimeError)
+      expect(failing.dirty_size).to eq(1)
+    end
+  end
+
+  describe '#close' do
+    it 'flushes the changed tokens' do
+      store.verify(token.serial, '000000', app_name: token.app_name)
+      store.close
+
+      expect(persisted.flatten.map(&:serial)).to eq([token.serial])
+    end
+  end
+end
+
+describe VacmanController::LowLevel::TokenStore do
+  let(:token) do
+    VacmanController::LowLevel.import('sample_dpx/VDP0000000.dpx', '11111111111111111111111111111111').first
+  end
+
+  subject(:store) { described_class.new(5) }
+
+  it { expect(store.shards).to eq(8) }
+  it { expect(store.verify(token['serial'], token['app_name'], '000000')).to be(nil) }
+  it { expect { described_class.new(0) }.to raise_error(ArgumentError) }
+  it { expect { store.verify('X' * 11, token['app_name'], '000000') }.to raise_error(ArgumentError) }
+  it { expect { store.flush(0) { } }.to raise_error(ArgumentError) }
+
+  it 'returns the AAL2 result code' do
+    store.add(token)
+    expect(store.verify(token['serial'], token['app_name'], '000000')).to eq(1)
+  end
+end
@@ -1,4 +1,6 @@
 require 'spec_helper'
+require 'tmpdir'
+require 'fileutils'
 
 describe VacmanController do
   let(:dpx_filename) { 'sample_dpx/VDP0000000.dpx' }
@@ -17,6 +19,12 @@ describe VacmanController do
       expect(hashes.select {|e| e['serial'] =~ /VDP000000[01]/}.count).to eq(2)
     end
 
+    it 'shares the static vector across imports' do
+      again = described_class.import(dpx_filename, transport_key)
+
+      expect(again.first['sv']).to be(hashes.first['sv'])
+    end
+
     context 'given an invalid key' do
       let(:transport_key) { '00000000000000000000000000000000' }
 
@@ -30,6 +38,191 @@ describe VacmanController do
     end
   end
 
+  describe '.register_static_vector' do
+    let(:sv) { 'ABCDEF0123' }
+
+    subject { described_class.register_static_vector(sv) }
+
+    it { is_expected.to match(/\A[0-9a-f]{16}\z/) }
+    it { expect(described_class.static_vectors[subject]).to eq(sv) }
+    it { expect(described_class.static_vectors[subject]).to be_frozen }
+    it { expect(VacmanController::LowLevel.static_vector(subject)).to be(described_class.static_vectors[subject]) }
+
+    it 'resolves token hashes that reference it by digest' do
+      hash = hashes.first.dup
+      sv   = hash.delete('sv')
+      hash['sv_digest'] = described_class.register_static_vector(sv)
+
+      expect(VacmanController::LowLevel.generate_activation(hash)).to eq(VacmanController::LowLevel.generate_activation(hashes.first))
+      expect(VacmanController::LowLevel::Digipass.from_h(hash).static_vector).to be(hashes.first['sv'])
+    end
+
+    it do
+      expect { VacmanController::LowLevel.static_vector('nope') }.to \
+        raise_error(VacmanController::Error, /invalid static vector digest/)
+    end
+
+    it do
+      hash = hashes.first.dup
+      hash.delete('sv')
+      hash['sv_digest'] = '0000000000000000'
+
+      expect { VacmanController::LowLevel.generate_activation(hash) }.to \
+        raise_error(VacmanController::Error, /unknown static vector 0000000000000000/)
+    end
+  end
+
+  describe '.each_token' do
+    it 'yields every token' do
+      expect { |b| described_class.each_token(dpx_filename, transport_key, &b) }.to \
+        yield_control.exactly(20).times
+    end
+
+    it 'yields the same tokens as import' do
+      expect(described_class.each_token(dpx_filename, transport_key).to_a).to eq(hashes)
+    end
+
+    it 'shares a single frozen static vector' do
+      svs = described_class.each_token(dpx_filename, transport_key).map { |h| h['sv'] }
+
+      expect(svs.map(&:object_id).uniq.size).to eq(1)
+      expect(svs.first).to be_frozen
+    end
+
+    context 'in chunks' do
+      subject { described_class.each_token(dpx_filename, transport_key, chunk: 8).to_a }
+
+      it { expect(subject.map(&:size)).to eq([8, 8, 4]) }
+    end
+
+    context 'given an invalid key' do
+      let(:transport_key) { '00000000000000000000000000000000' }
+
+      it { expect { described_class.each_token(dpx_filename, transport_key) {} }.to raise_error(VacmanController::Error, /invalid transport key/) }
+    end
+  end
+
+  describe '.import_files' do
+    let(:tmpdir) { Dir.mktmpdir }
+    after { FileUtils.remove_entry(tmpdir) }
+
+    let(:filenames) do
+      3.times.map do |i|
+        File.join(tmpdir, "shipment#{i}.dpx").tap { |f| FileUtils.cp(dpx_filename, f) }
+      end
+    end
+
+    let(:batches) { [] }
+
+    subject do
+      described_class.import_files(filenames, transport_key, workers: 2, batch: 8) do |filename, tokens|
+        batches << [filename, tokens]
+      end
+    end
+
+    it 'imports every file' do
+      expect(subject).to eq(filenames.map { |f| [f, 20] }.to_h)
+    end
+
+    it 'yields batches of at most the given size' do
+      subject
+
+      expect(batches.map { |_, tokens| tokens.size }.max).to eq(8)
+      expect(batches.map { |_, tokens| tokens.size }.inject(:+)).to eq(60)
+    end
+
+    it 'yields the same tokens as import' do
+      subject
+
+      tokens = batches.select { |f, _| f == filenames.first }.flat_map(&:last)
+      expect(tokens).to eq(hashes)
+    end
+
+    it 'reports progress per file' do
+      progress = []
+
+      described_class.import_files(filenames, transport_key, batch: 8, progress: ->(f, n) { progress << [f, n] }) { }
+
+      expect(progress.select { |f, _| f == filenames.first }.map(&:last)).to eq([8, 16, 20])
+    end
+
+    context 'given a non-existing file' do
+      before { filenames.insert(1, 'nonexistant') }
+
+      it 'imports the other files' do
+        expect(subject.values_at(*filenames - ['nonexistant'])).to eq([20, 20, 20])
+      end
+
+      it 'returns the error' do
+        expect(subject['nonexistant']).to be_a(VacmanController::Error)
+        expect(subject['nonexistant'].message).to match(/cannot open DPX file/)
+      end
+    end
+
+    context 'given a key per file' do
+      let(:transport_key) { ['11111111111111111111111111111111', '00000000000000000000000000000000', '11111111111111111111111111111111'] }
+
+      it { expect(subject.values.grep(VacmanController::Error).map(&:message)).to eq(['AAL2DPXInit error -15: invalid transport key']) }
+    end
+
+    context 'given a different number of files and keys' do
+      let(:transport_key) { ['11111111111111111111111111111111'] }
+
+      it { expect { subject }.to raise_error(VacmanController::Error, /got 3 files and 1 keys/) }
+    end
+
+    context 'given the same file twice' do
+      before { filenames << filenames.first }
+
+      it { expect { subject }.to raise_error(ArgumentError, /more than once/) }
+      it { expect { subject rescue nil }.to_not change { batches.size } }
+    end
+
+    context 'without a block' do
+      subject { described_class.import_files(filenames, transport_key, batch: 8) }
+
+      it { is_expected.to be_an(Enumerator) }
+
+      it 'enumerates the batches, and returns the results' do
+        expect(subject.map { |_, tokens| tokens.size }.inject(:+)).to eq(60)
+        expect(subject.each { }).to eq(filenames.map { |f| [f, 20] }.to_h)
+      end
+    end
+
+    it 'is not cut short by signals' do
+      with_pending_interrupts do
+        20.times do
+          count = 0
+          described_class.import_files(filenames, transport_key, workers: 2, batch: 1) { |_, tokens| count += tokens.size }
+
+          expect(count).to eq(60)
+        end
+      end
+    end
+
+    it 'stops the workers when stopped early with interrupts pending' do
+      with_pending_interrupts do
+        threads = native_threads
+
+        20.times do
+          expect(described_class.import_files(filenames, transport_key, workers: 2, batch: 1).first(1).size).to eq(1)
+          expect(native_threads).to eq(threads)
+
+          described_class.import_files(filenames, transport_key, workers: 2, batch: 1) { leave_interrupts_pending; break }
+          expect(native_threads).to eq(threads)
+        end
+      end
+    end
+
+    it 'stops the workers when the block breaks' do
+      count = 0
+
+      described_class.import_files(filenames, transport_key, batch: 1) { break if (count += 1) == 2 }
+
+      expect(count).to eq(2)
+    end
+  end
+
   describe '.kernel' do
     it { expect(described_class.kernel).to be(VacmanController::Kernel) }
   end